@@ -20,6 +20,7 @@ struct InfoVisitor: public boost::static_visitor<ErrorInfo> {
     VISITP(IfThenElse)
     VISITP(ForLoop)
     VISITP(LocalVar)
+    VISITP(ArrayIndex)
 };
 
 static const InfoVisitor visitor = InfoVisitor();
@@ -28,6 +29,70 @@ ErrorInfo get_info(const Expression &expr) {
     return boost::apply_visitor(visitor, expr);
 }
 
+struct CountVisitor: public boost::static_visitor<void> {
+    std::map<std::string, uint64_t> &counts;
+    CountVisitor(std::map<std::string, uint64_t> &counts): counts(counts) {}
+
+    void operator()(const NumberLiteral &) { ++counts["NumberLiteral"]; }
+    void operator()(const VariableName &)  { ++counts["VariableName"]; }
+
+    void operator()(const std::unique_ptr<BinaryOp> &op) {
+        ++counts["BinaryOp"];
+        boost::apply_visitor(*this, op->lhs);
+        boost::apply_visitor(*this, op->rhs);
+    }
+
+    void operator()(const std::unique_ptr<FunctionCall> &call) {
+        ++counts["FunctionCall"];
+        for (auto &arg: call->args) boost::apply_visitor(*this, arg);
+    }
+
+    void operator()(const std::unique_ptr<IfThenElse> &if_) {
+        ++counts["IfThenElse"];
+        boost::apply_visitor(*this, if_->cond);
+        boost::apply_visitor(*this, if_->then);
+        boost::apply_visitor(*this, if_->else_);
+    }
+
+    void operator()(const std::unique_ptr<ForLoop> &loop) {
+        ++counts["ForLoop"];
+        boost::apply_visitor(*this, loop->start);
+        boost::apply_visitor(*this, loop->end);
+        boost::apply_visitor(*this, loop->step);
+        boost::apply_visitor(*this, loop->body);
+    }
+
+    void operator()(const std::unique_ptr<LocalVar> &local) {
+        ++counts["LocalVar"];
+        for (auto &name: local->names) {
+            boost::apply_visitor(*this, name.second);
+        }
+        boost::apply_visitor(*this, local->body);
+    }
+
+    void operator()(const std::unique_ptr<ArrayIndex> &index) {
+        ++counts["ArrayIndex"];
+        boost::apply_visitor(*this, index->index);
+    }
+
+    void operator()(const std::unique_ptr<FunctionPrototype> &) {
+        ++counts["FunctionPrototype"];
+    }
+
+    void operator()(const std::unique_ptr<FunctionDefinition> &def) {
+        ++counts["FunctionDefinition"];
+        boost::apply_visitor(*this, def->body);
+    }
+
+    void operator()(const Error &) {}
+};
+
+void count_nodes(const Declaration &decl,
+                 std::map<std::string, uint64_t> &counts) {
+    CountVisitor counter(counts);
+    boost::apply_visitor(counter, decl);
+}
+
 
 }
 }
@@ -5,6 +5,8 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -29,6 +31,12 @@ namespace AST {
 
 struct Error { };
 
+/**
+ * @brief Types of values: numbers (`double`s), or arrays of them (passed as
+ *        `double *`).
+ */
+enum class Type { number, array };
+
 /**
  * @brief Floating-point literals.
  */
@@ -54,6 +62,7 @@ struct FunctionCall;
 struct IfThenElse;
 struct ForLoop;
 struct LocalVar;
+struct ArrayIndex;
 
 /**
  * @brief An expression: any of the various expression structs.
@@ -64,7 +73,8 @@ typedef boost::variant< NumberLiteral,
                         std::unique_ptr<FunctionCall>,
                         std::unique_ptr<IfThenElse>,
                         std::unique_ptr<ForLoop>,
-                        std::unique_ptr<LocalVar> > Expression;
+                        std::unique_ptr<LocalVar>,
+                        std::unique_ptr<ArrayIndex> > Expression;
 
 ErrorInfo get_info(const Expression &);
 
@@ -72,11 +82,12 @@ ErrorInfo get_info(const Expression &);
  * @brief Binary operations of the form `expression op expression`.
  */
 struct BinaryOp {
-    char op;
+    /** The operator's character, or its `Token` if it has two. */
+    int op;
     Expression lhs;
     Expression rhs;
     ErrorInfo info;
-    BinaryOp(char op, Expression lhs, Expression rhs, ErrorInfo info)
+    BinaryOp(int op, Expression lhs, Expression rhs, ErrorInfo info)
         : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)), info(info) {}
 };
 
@@ -106,12 +117,34 @@ struct IfThenElse {
           else_(std::move(else_)), info(info) {}
 };
 
+/**
+ * @brief A variable that the iterations of a loop all contribute to,
+ *        combining their contributions with an associative operator.
+ */
+struct Reduction {
+    /** `+` or `*`, or `<` for `min` and `>` for `max`. */
+    char op;
+    /** Or empty, for the loop's own value. */
+    std::string var;
+    ErrorInfo info;
+    Reduction(char op, std::string var, ErrorInfo info)
+        : op(op), var(var), info(info) {}
+};
+
 /**
  * @brief A "for" loop.
  */
 struct ForLoop {
     std::string index_var;
     Expression start, end, step, body;
+    /** A `parfor` loop, whose iterations may run in parallel. */
+    bool parallel = false;
+    /** Iterations per task for a `parfor`, or 0 to let the runtime choose. */
+    unsigned chunk = 0;
+    std::vector<Reduction> reductions;
+    /** The operator combining the body's values into the loop's value (as
+     *  in `Reduction`), or 0 if the loop's value is always 0. */
+    char reduce_op = 0;
     ErrorInfo info;
 
     ForLoop(std::string index_var,
@@ -133,6 +166,17 @@ struct LocalVar {
         : names(std::move(names)), body(std::move(body)), info(info) {}
 };
 
+/**
+ * @brief An element of an array, `array[index]`.  May be assigned to.
+ */
+struct ArrayIndex {
+    std::string array;
+    Expression index;
+    ErrorInfo info;
+    ArrayIndex(std::string array, Expression index, ErrorInfo info)
+        : array(array), index(std::move(index)), info(info) {}
+};
+
 struct FunctionPrototype;
 struct FunctionDefinition;
 
@@ -144,14 +188,34 @@ inline bool is_err(const Declaration &decl) {
     return decl.which() == 2;
 }
 
+/**
+ * @brief Add the number of nodes of each kind in the declaration to
+ *        `counts`, keyed by node type name.
+ */
+void count_nodes(const Declaration &,
+                 std::map<std::string, uint64_t> &counts);
+
 /**
  * @brief Kaleidoscope function signature.
  */
 struct FunctionPrototype {
     std::string fname;
     std::vector<std::string> args;
-    FunctionPrototype(std::string fname, std::vector<std::string> args)
-        : fname(fname), args(args) {}
+    /** The type of each of `args`. */
+    std::vector<Type> arg_types;
+    /** Declared with `builtin`, so it must be a function LLVM knows. */
+    bool builtin = false;
+    ErrorInfo info;
+    FunctionPrototype(std::string fname, std::vector<std::string> args,
+                      std::vector<Type> arg_types, ErrorInfo info)
+        : fname(fname), args(args), arg_types(arg_types), info(info) {}
+
+    /** A prototype taking only numbers. */
+    FunctionPrototype(std::string fname, std::vector<std::string> args,
+                      ErrorInfo info)
+        : FunctionPrototype(fname, args,
+                            std::vector<Type>(args.size(), Type::number),
+                            info) {}
 };
 
 /**
@@ -160,6 +224,13 @@ struct FunctionPrototype {
 struct FunctionDefinition {
     std::unique_ptr<FunctionPrototype> proto;
     Expression body;
+    /** Declared `memo`: cache its results in a table. */
+    bool memo = false;
+    /** Entries in the table, or 0 for the compiler's default. */
+    unsigned memo_capacity = 0;
+    /** Declared `export`: callable from outside the module (see
+     *  `CodeGenOptions::exports`). */
+    bool exported = false;
     FunctionDefinition(std::unique_ptr<FunctionPrototype> proto,
                        Expression body)
         : proto(std::move(proto)), body(std::move(body)) {}
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/CallingConv.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+#include "Analysis.hh"
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+typedef std::map<const llvm::Function *, Effects> EffectMap;
+
+llvm::Function *parallel_body(const llvm::CallInst &call) {
+    auto *callee = call.getCalledFunction();
+    if (!callee || callee->getName() != "kalrt_parfor"
+     || callee->arg_size() < 3) {
+        return nullptr;
+    }
+    return llvm::dyn_cast<llvm::Function>(
+            call.getArgOperand(2)->stripPointerCasts());
+}
+
+/** The effects of calling a function (not defined in this module, or
+ *  outside the current SCC), as far as we know them. */
+static Effects callee_effects(const llvm::Function *callee,
+                              const EffectMap &known) {
+    auto it = known.find(callee);
+    if (it != known.end()) return it->second;
+    /* Intrinsics (e.g. those `sqrt` and friends become) say what they do. */
+    if (callee->isIntrinsic()) {
+        if (callee->doesNotAccessMemory()) return Effects::none;
+        if (callee->onlyReadsMemory()) return Effects::reads_arrays;
+    }
+    return Effects::unknown;
+}
+
+/**
+ * @brief The effects of the instructions in a function body, and of the
+ *        functions it calls outside of `scc`.
+ *
+ * Kaleidoscope code only ever stores to and loads from its own `alloca`s
+ * (which are invisible to its caller) and elements of arrays, which can
+ * only have come from its arguments.
+ */
+static Effects body_effects(const llvm::Function &f, const EffectMap &known,
+                            const std::set<llvm::Function *> &scc) {
+    Effects result = Effects::none;
+    for (auto &bb: f) {
+        for (auto &inst: bb) {
+            Effects e = Effects::none;
+            if (auto *load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+                if (!llvm::isa<llvm::AllocaInst>(load->getPointerOperand())) {
+                    e = Effects::reads_arrays;
+                }
+            } else if (auto *store = llvm::dyn_cast<llvm::StoreInst>(&inst)) {
+                if (!llvm::isa<llvm::AllocaInst>(
+                            store->getPointerOperand())) {
+                    e = Effects::writes_arrays;
+                }
+            } else if (auto *call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+                auto *callee = call->getCalledFunction();
+                if (auto *body = parallel_body(*call)) {
+                    /* The runtime just runs the body, on our behalf (and
+                     * only touches our own `alloca`s). */
+                    e = scc.count(body)? Effects::none
+                                       : callee_effects(body, known);
+                } else if (!callee) {
+                    e = Effects::unknown;
+                } else if (!scc.count(callee)) {
+                    e = callee_effects(callee, known);
+                }
+            } else if (inst.mayReadOrWriteMemory()) {
+                e = Effects::unknown;
+            }
+            result = std::max(result, e);
+        }
+    }
+    return result;
+}
+
+static void add_attributes(llvm::Function &f, Effects effects,
+                           bool recursive) {
+    switch (effects) {
+    case Effects::none:
+        f.addFnAttr(llvm::Attribute::ReadNone);
+        break;
+    case Effects::reads_arrays:
+        f.addFnAttr(llvm::Attribute::ReadOnly);
+        f.addFnAttr(llvm::Attribute::ArgMemOnly);
+        break;
+    case Effects::writes_arrays:
+        f.addFnAttr(llvm::Attribute::ArgMemOnly);
+        break;
+    case Effects::unknown:
+        /* An external function might throw, or call back into us. */
+        return;
+    }
+    f.addFnAttr(llvm::Attribute::NoUnwind);
+    if (!recursive) f.addFnAttr(llvm::Attribute::NoRecurse);
+}
+
+/** Can every use of the function see its definition? */
+static bool only_called_directly(const llvm::Function &f) {
+    if (!f.hasLocalLinkage()) return false;
+    for (auto *user: f.users()) {
+        auto *call = llvm::dyn_cast<llvm::CallInst>(user);
+        if (!call || call->getCalledFunction() != &f) return false;
+    }
+    return true;
+}
+
+static void use_fast_calls(llvm::Module &module) {
+    for (auto &f: module) {
+        if (f.isDeclaration() || !only_called_directly(f)) continue;
+        f.setCallingConv(llvm::CallingConv::Fast);
+        for (auto *user: f.users()) {
+            llvm::cast<llvm::CallInst>(user)->setCallingConv(
+                    llvm::CallingConv::Fast);
+        }
+    }
+
+    /* A guaranteed tail call needs both ends to agree on the convention. */
+    for (auto &f: module) {
+        for (auto &bb: f) {
+            for (auto &inst: bb) {
+                auto *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+                if (call && call->isMustTailCall()
+                 && call->getCallingConv() != f.getCallingConv()) {
+                    call->setTailCallKind(llvm::CallInst::TCK_Tail);
+                }
+            }
+        }
+    }
+}
+
+/*****************************************************************************
+ * Analysis implementation.
+ */
+
+void infer_attributes(llvm::Module &module) {
+    llvm::CallGraph graph(module);
+    EffectMap effects;
+
+    /* `parfor` loops call their bodies through the runtime.  Record that
+     * as a direct call, so that bodies are visited before their loops. */
+    for (auto &f: module) {
+        for (auto &bb: f) {
+            for (auto &inst: bb) {
+                auto *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+                auto *body = call? parallel_body(*call): nullptr;
+                if (body) {
+                    graph[&f]->addCalledFunction(llvm::CallSite(call),
+                                                 graph[body]);
+                }
+            }
+        }
+    }
+
+    /* The graph is walked from the outside world, which only sees
+     * functions that aren't internal.  Visit internal functions that
+     * nothing calls too (e.g. `memo` functions have to be shown pure
+     * before they are deleted). */
+    for (auto &f: module) {
+        if (!f.isDeclaration() && f.hasLocalLinkage()) {
+            graph.getExternalCallingNode()->addCalledFunction(
+                    llvm::CallSite(), graph[&f]);
+        }
+    }
+
+    /* Visit callees before callers.  Functions that (perhaps indirectly)
+     * call each other form an SCC, and share their effects. */
+    for (auto scc = llvm::scc_begin(&graph); !scc.isAtEnd(); ++scc) {
+        std::set<llvm::Function *> members;
+        for (auto *node: *scc) {
+            auto *f = node->getFunction();
+            if (f && !f->isDeclaration()) members.insert(f);
+        }
+        if (members.empty()) continue;
+
+        Effects e = Effects::none;
+        for (auto *f: members) {
+            e = std::max(e, body_effects(*f, effects, members));
+        }
+        bool recursive = scc.hasLoop();
+        for (auto *f: members) {
+            effects[f] = e;
+            add_attributes(*f, e, recursive);
+        }
+    }
+
+    use_fast_calls(module);
+}
+
+}
@@ -0,0 +1,51 @@
+/**
+ * @brief Whole-module analyses run between code generation and LLVM's
+ *        optimization passes.
+ */
+
+#pragma once
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief What a function may do other than compute its result, from least
+ *        to most.
+ */
+enum class Effects {
+    /** Nothing: the result depends only on the arguments. */
+    none,
+    /** Reads elements of arrays passed to it. */
+    reads_arrays,
+    /** Writes elements of arrays passed to it. */
+    writes_arrays,
+    /** Calls an external function, which could do anything. */
+    unknown,
+};
+
+/**
+ * @brief Infer the effects of each function defined in the module from its
+ *        body and those of the functions it calls, and record them as
+ *        attributes LLVM's passes understand.
+ *
+ * Functions found to have no effects are marked `readnone`, so that GVN can
+ * merge repeated calls, LICM hoist them out of loops, and unused calls be
+ * deleted.  Those that only access arrays they are passed are `readonly` or
+ * `argmemonly`; those that never reach an external function are `nounwind`,
+ * and also `norecurse` if they are not part of a cycle of calls.  A call to
+ * the runtime to run a `parfor` loop counts as a call to the loop's body.
+ *
+ * Functions with local linkage that are only ever called directly are
+ * switched to the `fastcc` calling convention.
+ */
+void infer_attributes(llvm::Module &);
+
+/**
+ * @brief The outlined body of the `parfor` loop that a call to the runtime
+ *        runs, or null if the call isn't to run one.
+ */
+llvm::Function *parallel_body(const llvm::CallInst &);
+
+}
@@ -0,0 +1,999 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <map>
+
+#include <boost/variant.hpp>
+
+#include "Bytecode.hh"
+#include "Lexer.hh"
+
+namespace Kaleidoscope {
+namespace Bytecode {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+[[noreturn]] static void _throw(std::string msg, ErrorInfo info) {
+    throw Error("Bytecode error", msg, info);
+}
+
+/** Calls nested deeper than this are an error, before the machine (a
+ *  native frame of a couple of hundred bytes per call) runs out of a
+ *  thread's stack. */
+static const unsigned MAX_CALL_DEPTH = 10000;
+
+/** Registers, instructions and functions are numbered with 16 bits. */
+static const size_t MAX_INDEX = UINT16_MAX;
+
+/**
+ * @brief A C math library function, callable as a `builtin`.
+ */
+template <typename F> struct MathFunction {
+    const char *name;
+    F *function;
+};
+
+typedef double Math1(double);
+typedef double Math2(double, double);
+typedef double Math3(double, double, double);
+
+/** By the index in `math1` (etc.) instructions.  (The same as
+ *  `math_intrinsic`'s.) */
+static const MathFunction<Math1> MATH1[] = {
+    {"sqrt", std::sqrt}, {"sin", std::sin}, {"cos", std::cos},
+    {"exp", std::exp}, {"exp2", std::exp2}, {"log", std::log},
+    {"log2", std::log2}, {"log10", std::log10}, {"fabs", std::fabs},
+    {"floor", std::floor}, {"ceil", std::ceil}, {"trunc", std::trunc},
+    {"rint", std::rint}, {"nearbyint", std::nearbyint},
+    {"round", std::round},
+};
+static const MathFunction<Math2> MATH2[] = {
+    {"pow", std::pow}, {"fmin", std::fmin}, {"fmax", std::fmax},
+    {"copysign", std::copysign},
+};
+static const MathFunction<Math3> MATH3[] = {
+    {"fma", std::fma},
+};
+
+/** Find a math function's entry in a table. */
+template <typename F, size_t N>
+static bool find_math(const MathFunction<F> (&table)[N],
+                      const std::string &name, uint16_t &index) {
+    for (size_t i = 0; i < N; ++i) {
+        if (name == table[i].name) {
+            index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Its bits, telling apart 0 and -0. */
+static uint64_t bits(double x) {
+    uint64_t result;
+    std::memcpy(&result, &x, sizeof result);
+    return result;
+}
+
+/** What a reduction starts from, as in `ExpressionGenerator`. */
+static double reduction_identity(char op) {
+    return op == '*'? 1.0
+         : op == '<'? HUGE_VAL
+         : op == '>'? -HUGE_VAL
+         : 0.0;
+}
+
+/** Collects the numbers an expression uses: its literals, and the
+ *  identities of its loops' reductions. */
+struct ConstantVisitor: public boost::static_visitor<void> {
+    std::vector<double> &constants;
+    ConstantVisitor(std::vector<double> &constants): constants(constants) {}
+
+    void operator()(const AST::NumberLiteral &num) {
+        constants.push_back(num.val);
+    }
+
+    void operator()(const AST::VariableName &) {}
+
+    void operator()(const std::unique_ptr<AST::BinaryOp> &op) {
+        boost::apply_visitor(*this, op->lhs);
+        boost::apply_visitor(*this, op->rhs);
+    }
+
+    void operator()(const std::unique_ptr<AST::FunctionCall> &call) {
+        for (auto &arg: call->args) boost::apply_visitor(*this, arg);
+    }
+
+    void operator()(const std::unique_ptr<AST::IfThenElse> &if_) {
+        boost::apply_visitor(*this, if_->cond);
+        boost::apply_visitor(*this, if_->then);
+        boost::apply_visitor(*this, if_->else_);
+    }
+
+    void operator()(const std::unique_ptr<AST::ForLoop> &loop) {
+        if (loop->reduce_op) {
+            constants.push_back(reduction_identity(loop->reduce_op));
+        }
+        for (auto &reduction: loop->reductions) {
+            constants.push_back(reduction_identity(reduction.op));
+        }
+        boost::apply_visitor(*this, loop->start);
+        boost::apply_visitor(*this, loop->end);
+        boost::apply_visitor(*this, loop->step);
+        boost::apply_visitor(*this, loop->body);
+    }
+
+    void operator()(const std::unique_ptr<AST::LocalVar> &local) {
+        for (auto &name: local->names) {
+            boost::apply_visitor(*this, name.second);
+        }
+        boost::apply_visitor(*this, local->body);
+    }
+
+    void operator()(const std::unique_ptr<AST::ArrayIndex> &elt) {
+        boost::apply_visitor(*this, elt->index);
+    }
+};
+
+/** Could evaluating an expression assign to a variable? */
+struct AssignsVisitor: public boost::static_visitor<bool> {
+    bool visit(const AST::Expression &expr) {
+        return boost::apply_visitor(*this, expr);
+    }
+
+    bool operator()(const AST::NumberLiteral &) { return false; }
+    bool operator()(const AST::VariableName &) { return false; }
+
+    bool operator()(const std::unique_ptr<AST::BinaryOp> &op) {
+        return op->op == '=' || visit(op->lhs) || visit(op->rhs);
+    }
+
+    bool operator()(const std::unique_ptr<AST::FunctionCall> &call) {
+        for (auto &arg: call->args) {
+            if (visit(arg)) return true;
+        }
+        return false;
+    }
+
+    bool operator()(const std::unique_ptr<AST::IfThenElse> &if_) {
+        return visit(if_->cond) || visit(if_->then) || visit(if_->else_);
+    }
+
+    bool operator()(const std::unique_ptr<AST::ForLoop> &loop) {
+        return !loop->reductions.empty() || visit(loop->start)
+            || visit(loop->end) || visit(loop->step) || visit(loop->body);
+    }
+
+    bool operator()(const std::unique_ptr<AST::LocalVar> &local) {
+        for (auto &name: local->names) {
+            if (visit(name.second)) return true;
+        }
+        return visit(local->body);
+    }
+
+    bool operator()(const std::unique_ptr<AST::ArrayIndex> &elt) {
+        return visit(elt->index);
+    }
+};
+
+/** A program's functions, as calls to them are compiled. */
+struct Callee {
+    /** `call`, or one of the `math` operations. */
+    Op op;
+    /** The function's index, in the program or its math table. */
+    uint16_t index;
+    unsigned args;
+};
+
+/*****************************************************************************
+ * Compiling a function.
+ */
+
+/**
+ * @brief Compiles the body of a function.
+ *
+ * Each expression's value goes in a register: a variable's or constant's
+ * own, or one allocated above those in use (and freed once the value has
+ * been used), unless it is asked to go in a particular one.
+ */
+class FunctionCompiler: public boost::static_visitor<uint16_t> {
+public:
+    FunctionCompiler(Function &function,
+                     const std::map<std::string, Callee> &callees,
+                     unsigned self)
+        : function(function), callees(callees), self(self) {}
+
+    /**
+     * @brief Compile a body, whose arguments are named `params`.
+     */
+    void compile(const std::vector<std::string> &params,
+                 const AST::Expression &body) {
+        /* The constants come right after the arguments, so that they
+         * aren't in the registers a call passes to its callee. */
+        next = params.size();
+        std::vector<double> numbers = {0.0, 1.0};
+        ConstantVisitor collector(numbers);
+        boost::apply_visitor(collector, body);
+        for (double x: numbers) {
+            if (constants.count(bits(x))) continue;
+            constants[bits(x)] = allocate();
+            function.constants.push_back(x);
+        }
+        for (size_t i = 0; i < params.size(); ++i) bind(params[i], i);
+
+        emit(Op::ret, value(body, -1, true));
+    }
+
+    /**
+     * @name Visitors
+     *
+     * Methods for visiting AST nodes.
+     */
+    /**@{*/
+
+    uint16_t operator()(const AST::NumberLiteral &num) {
+        return place(constants.at(bits(num.val)));
+    }
+
+    uint16_t operator()(const AST::VariableName &var) {
+        return place(variable(var.name, var.info).reg);
+    }
+
+    uint16_t operator()(const std::unique_ptr<AST::BinaryOp> &op) {
+        if (op->op == '=') return assign(*op);
+        uint16_t dest = result();
+        if (op->op == tok_and || op->op == tok_or) {
+            /* 1 or 0, like a comparison. */
+            std::vector<size_t> false_jumps, end_jumps;
+            branch_logical(*op, false, false_jumps);
+            emit(Op::mov, dest, constant(1.0));
+            end_jumps.push_back(emit(Op::jmp));
+            land(false_jumps);
+            emit(Op::mov, dest, constant(0.0));
+            land(end_jumps);
+            return dest;
+        }
+
+        Op arith;
+        switch (op->op) {
+        case '+':
+            arith = Op::add;
+            break;
+        case '-':
+            arith = Op::sub;
+            break;
+        case '*':
+            arith = Op::mul;
+            break;
+        case '/':
+            arith = Op::div;
+            break;
+        default: {
+            Op cmp;
+            bool swap;
+            if (!comparison(op->op, true, cmp, swap)) {
+                _throw(std::string("invalid binary operator (")
+                     + (char)op->op + ")", op->info);
+            }
+            uint16_t l, r;
+            operands(*op, l, r);
+            emit(value_of(cmp), dest, swap? r: l, swap? l: r);
+            return dest;
+        }
+        }
+        uint16_t l, r;
+        operands(*op, l, r);
+        emit(arith, dest, l, r);
+        return dest;
+    }
+
+    uint16_t operator()(const std::unique_ptr<AST::FunctionCall> &call) {
+        auto it = callees.find(call->fname);
+        if (it == callees.end()) {
+            _throw("unknown function referenced: " + call->fname,
+                   call->info);
+        }
+        const Callee &callee = it->second;
+        if (callee.args != call->args.size()) {
+            _throw("incorrect # of arguments passed", call->info);
+        }
+
+        bool tail = target.tail;
+        uint16_t dest = result();
+        /* The arguments go in consecutive registers, which are where the
+         * callee's start. */
+        uint16_t base = next;
+        for (size_t i = 0; i < call->args.size(); ++i) allocate();
+        for (size_t i = 0; i < call->args.size(); ++i) {
+            value(call->args[i], base + i);
+        }
+        if (callee.op == Op::call && callee.index == self && tail) {
+            /* A loop, as LLVM makes of it. */
+            for (size_t i = 0; i < call->args.size(); ++i) {
+                emit(Op::mov, i, base + i);
+            }
+            emit(Op::jmp, 0, 0, 0);
+        } else {
+            emit(callee.op, dest, base, callee.index);
+        }
+        return dest;
+    }
+
+    uint16_t operator()(const std::unique_ptr<AST::IfThenElse> &if_) {
+        bool tail = target.tail;
+        uint16_t dest = result();
+        std::vector<size_t> else_jumps, end_jumps;
+        branch(if_->cond, false, else_jumps);
+        value(if_->then, dest, tail);
+        end_jumps.push_back(emit(Op::jmp));
+        land(else_jumps);
+        value(if_->else_, dest, tail);
+        land(end_jumps);
+        return dest;
+    }
+
+    uint16_t operator()(const std::unique_ptr<AST::ForLoop> &loop) {
+        if (loop->parallel || loop->reduce_op) return counted_for(*loop);
+
+        uint16_t dest = result();
+        size_t outer = variables.size();
+        uint16_t index = allocate();
+        value(loop->start, index);
+        bind(loop->index_var, index);
+
+        /* The body runs before the condition is first tested. */
+        size_t top = function.code.size();
+        uint16_t mark = next;
+        value(loop->body);
+        next = mark;
+        emit(Op::add, index, index, value(loop->step));
+        next = mark;
+        std::vector<size_t> repeat;
+        branch(loop->end, true, repeat);
+        land(repeat, top);
+
+        variables.resize(outer);
+        emit(Op::mov, dest, constant(0.0));
+        return dest;
+    }
+
+    uint16_t operator()(const std::unique_ptr<AST::LocalVar> &local) {
+        bool tail = target.tail;
+        uint16_t dest = result();
+        size_t outer = variables.size();
+        for (auto &name: local->names) {
+            uint16_t reg = allocate();
+            value(name.second, reg);
+            bind(name.first, reg);
+        }
+        value(local->body, dest, tail);
+        variables.resize(outer);
+        return dest;
+    }
+
+    uint16_t operator()(const std::unique_ptr<AST::ArrayIndex> &elt) {
+        array_error(elt->info);
+    }
+
+    /**@}*/
+
+private:
+    struct Variable {
+        const std::string *name;
+        uint16_t reg;
+        /** Why it can't be assigned to, or null if it can. */
+        const char *read_only;
+    };
+
+    /** Where the expression being visited should go. */
+    struct Target {
+        /** Its register, or -1 for any. */
+        int reg;
+        /** In tail position. */
+        bool tail;
+    };
+
+    /**
+     * @brief Compile an expression, returning the register its value ends
+     *        up in.
+     */
+    uint16_t value(const AST::Expression &expr, int reg=-1,
+                   bool tail=false) {
+        Target outer = target;
+        target = {reg, tail};
+        uint16_t mark = next;
+        uint16_t result = boost::apply_visitor(*this, expr);
+        target = outer;
+        /* Free the registers it used, other than its value's. */
+        next = result >= mark? result + 1: mark;
+        return result;
+    }
+
+    /** The register the value being visited goes in: its target, or the
+     *  first one it allocates. */
+    uint16_t result(void) {
+        return target.reg >= 0? target.reg: allocate();
+    }
+
+    /** The value being visited, which is in `reg`, in its register. */
+    uint16_t place(uint16_t reg) {
+        if (target.reg < 0 || target.reg == reg) return reg;
+        emit(Op::mov, target.reg, reg);
+        return target.reg;
+    }
+
+    uint16_t allocate(void) {
+        if (next >= MAX_INDEX) {
+            _throw("too many values to compile to bytecode", function.info);
+        }
+        function.registers = std::max<unsigned>(function.registers,
+                                                next + 1);
+        return next++;
+    }
+
+    bool is_constant(uint16_t reg) const {
+        return reg >= function.params
+            && reg < function.params + function.constants.size();
+    }
+
+    uint16_t constant(double x) {
+        return constants.at(bits(x));
+    }
+
+    size_t emit(Op op, uint16_t a=0, uint16_t b=0, uint16_t c=0) {
+        if (function.code.size() >= MAX_INDEX) {
+            _throw("too long to compile to bytecode", function.info);
+        }
+        function.code.push_back({op, a, b, c});
+        return function.code.size() - 1;
+    }
+
+    /** Point jumps at the next instruction (or at `to`). */
+    void land(const std::vector<size_t> &jumps, size_t to=SIZE_MAX) {
+        if (to == SIZE_MAX) to = function.code.size();
+        for (size_t jump: jumps) function.code[jump].c = to;
+    }
+
+    void bind(const std::string &name, uint16_t reg,
+              const char *read_only=nullptr) {
+        variables.push_back({&name, reg, read_only});
+    }
+
+    /**
+     * @brief The innermost variable of this name in the function.
+     */
+    Variable &variable(const std::string &name, ErrorInfo info) {
+        for (auto it = variables.rbegin(); it != variables.rend(); ++it) {
+            if (*it->name == name) return *it;
+        }
+        _throw("unknown variable name (" + name + ")", info);
+    }
+
+    [[noreturn]] void array_error(ErrorInfo info) {
+        _throw("bytecode has no arrays", info);
+    }
+
+    uint16_t assign(const AST::BinaryOp &op) {
+        auto *var = boost::get<AST::VariableName>(&op.lhs);
+        if (!var) {
+            if (boost::get<std::unique_ptr<AST::ArrayIndex>>(&op.lhs)) {
+                array_error(AST::get_info(op.lhs));
+            }
+            _throw("left side of assignment must be lvalue",
+                   AST::get_info(op.lhs));
+        }
+        Variable *assigned = nullptr;
+        for (auto it = variables.rbegin(); it != variables.rend(); ++it) {
+            if (*it->name == var->name) {
+                assigned = &*it;
+                break;
+            }
+        }
+        if (!assigned) {
+            _throw("unknown variable " + var->name, var->info);
+        }
+        if (assigned->read_only) {
+            _throw("cannot assign to " + var->name + assigned->read_only,
+                   op.info);
+        }
+        uint16_t reg = assigned->reg;
+        value(op.rhs, reg);
+        return place(reg);
+    }
+
+    /**
+     * @brief Compile a binary operation's operands, left first.
+     */
+    void operands(const AST::BinaryOp &op, uint16_t &l, uint16_t &r) {
+        uint16_t mark = next;
+        l = value(op.lhs);
+        /* A variable on the left keeps its value from before the right
+         * assigns to it. */
+        AssignsVisitor assigns;
+        if (l < mark && !is_constant(l) && assigns.visit(op.rhs)) {
+            uint16_t copy = allocate();
+            emit(Op::mov, copy, l);
+            l = copy;
+        }
+        r = value(op.rhs);
+    }
+
+    /**
+     * @brief The comparison (or its negation) of a binary operator, as an
+     *        operation that jumps, or false if it isn't a comparison.
+     *
+     * @param swap Set if the operation compares the operands the other
+     *             way round.
+     */
+    static bool comparison(int token, bool holds, Op &op, bool &swap) {
+        swap = token == '>' || token == tok_ge;
+        switch (token) {
+        case '<':
+        case '>':
+            op = holds? Op::jlt: Op::jnlt;
+            return true;
+        case tok_le:
+        case tok_ge:
+            op = holds? Op::jle: Op::jnle;
+            return true;
+        /* == is ordered, and != unordered, so each is the other's
+         * negation. */
+        case tok_eq:
+            op = holds? Op::jeq: Op::jne;
+            return true;
+        case tok_ne:
+            op = holds? Op::jne: Op::jeq;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    /** The operation computing a jump's comparison as 1 or 0. */
+    static Op value_of(Op jump) {
+        switch (jump) {
+        case Op::jlt:
+            return Op::lt;
+        case Op::jle:
+            return Op::le;
+        case Op::jeq:
+            return Op::eq;
+        case Op::jne:
+        default:
+            return Op::ne;
+        }
+    }
+
+    /**
+     * @brief Compile a condition as jumps (to be landed) taken if its truth
+     *        is `when`; otherwise it falls through.
+     */
+    void branch(const AST::Expression &cond, bool when,
+                std::vector<size_t> &jumps) {
+        auto *op = boost::get<std::unique_ptr<AST::BinaryOp>>(&cond);
+        if (op && ((*op)->op == tok_and || (*op)->op == tok_or)) {
+            branch_logical(**op, when, jumps);
+            return;
+        }
+
+        uint16_t mark = next;
+        Op jump;
+        bool swap;
+        if (op && comparison((*op)->op, when, jump, swap)) {
+            uint16_t l, r;
+            operands(**op, l, r);
+            jumps.push_back(emit(jump, swap? r: l, swap? l: r));
+        } else {
+            uint16_t reg = value(cond);
+            jumps.push_back(emit(when? Op::jt: Op::jf, reg));
+        }
+        next = mark;
+    }
+
+    void branch_logical(const AST::BinaryOp &op, bool when,
+                        std::vector<size_t> &jumps) {
+        /* Either side being false makes `and` false, and either being true
+         * makes `or` true. */
+        if ((op.op == tok_and) != when) {
+            branch(op.lhs, when, jumps);
+            branch(op.rhs, when, jumps);
+        } else {
+            std::vector<size_t> skip;
+            branch(op.lhs, !when, skip);
+            branch(op.rhs, when, jumps);
+            land(skip);
+        }
+    }
+
+    /**
+     * @brief Compile a `parfor` or reducing loop, whose iterations are
+     *        counted before any of them run, to run one iteration after
+     *        another.
+     */
+    uint16_t counted_for(const AST::ForLoop &loop) {
+        auto *cond = boost::get<std::unique_ptr<AST::BinaryOp>>(&loop.end);
+        auto *cond_var = cond && (*cond)->op == '<'
+                       ? boost::get<AST::VariableName>(&(*cond)->lhs)
+                       : nullptr;
+        if (!cond_var || cond_var->name != loop.index_var) {
+            _throw(std::string("the condition of a ")
+                 + (loop.parallel? "parfor": "reducing") + " loop must be "
+                 + loop.index_var + " < limit", AST::get_info(loop.end));
+        }
+
+        uint16_t dest = result();
+        /* Copies, in case the body assigns to what they came from. */
+        uint16_t start = allocate(), iterations = allocate();
+        uint16_t step = allocate();
+        value(loop.start, start);
+        value((*cond)->rhs, iterations);
+        value(loop.step, step);
+        emit(Op::sub, iterations, iterations, start);
+        emit(Op::div, iterations, iterations, step);
+        emit(Op::count, iterations, iterations);
+
+        uint16_t total = allocate(), i = allocate();
+        emit(Op::mov, total, constant(reduction_identity(loop.reduce_op)));
+        emit(Op::mov, i, constant(0.0));
+
+        /* In a parfor, only the reduction variables can be assigned to. */
+        std::vector<Variable> saved = variables;
+        static const char *parallel_reason = " in the body of a parfor "
+            "loop, whose iterations run in parallel (unless it is a "
+            "reduction variable)";
+        std::vector<std::string> reduction_vars;
+        for (auto &reduction: loop.reductions) {
+            auto &var = variable(reduction.var, reduction.info);
+            if (reduction.var == loop.index_var) {
+                _throw("cannot reduce into the loop index", reduction.info);
+            }
+            if (std::count(reduction_vars.begin(), reduction_vars.end(),
+                           reduction.var)) {
+                _throw(reduction.var + " is reduced more than once",
+                       reduction.info);
+            }
+            if (var.read_only) {
+                _throw("cannot assign to " + reduction.var + var.read_only,
+                       reduction.info);
+            }
+            reduction_vars.push_back(reduction.var);
+        }
+        /* Like each thread running a parfor, the body reduces into copies
+         * of the variables starting from the identity, which are combined
+         * with the originals after the loop. */
+        std::vector<uint16_t> outer, copies;
+        for (auto &reduction: loop.reductions) {
+            outer.push_back(variable(reduction.var, reduction.info).reg);
+            copies.push_back(allocate());
+            emit(Op::mov, copies.back(),
+                 constant(reduction_identity(reduction.op)));
+        }
+        if (loop.parallel) {
+            for (auto &var: variables) var.read_only = parallel_reason;
+        }
+        for (size_t r = 0; r < copies.size(); ++r) {
+            bind(loop.reductions[r].var, copies[r]);
+        }
+
+        size_t test = emit(Op::jmp);
+        size_t top = function.code.size();
+        uint16_t index = allocate();
+        emit(Op::mul, index, i, step);
+        emit(Op::add, index, start, index);
+        bind(loop.index_var, index,
+             loop.parallel? parallel_reason
+                          : ", the index of a reducing loop (whose "
+                            "iterations are counted before any of them "
+                            "run)");
+        uint16_t mark = next;
+        uint16_t val = value(loop.body);
+        if (loop.reduce_op) combine(loop.reduce_op, total, val);
+        next = mark;
+        emit(Op::add, i, i, constant(1.0));
+        land({test});
+        emit(Op::jlt, i, iterations, top);
+
+        variables = saved;
+        for (size_t r = 0; r < copies.size(); ++r) {
+            combine(loop.reductions[r].op, outer[r], copies[r]);
+        }
+        emit(Op::mov, dest, loop.reduce_op? total: constant(0.0));
+        return dest;
+    }
+
+    /** r[into] = r[into] `op` r[val], for a reduction. */
+    void combine(char op, uint16_t into, uint16_t val) {
+        switch (op) {
+        case '*': emit(Op::mul, into, into, val); break;
+        case '<': emit(Op::min, into, val); break;
+        case '>': emit(Op::max, into, val); break;
+        default:  emit(Op::add, into, into, val); break;
+        }
+    }
+
+    Function &function;
+    const std::map<std::string, Callee> &callees;
+    /** The function's own index. */
+    unsigned self;
+
+    /** Registers of the constants, by their bits. */
+    std::map<uint64_t, uint16_t> constants;
+    /** The variables in scope, innermost last. */
+    std::vector<Variable> variables;
+    /** The lowest free register. */
+    unsigned next = 0;
+    Target target = {-1, false};
+};
+
+/*****************************************************************************
+ * Compiling a program.
+ */
+
+Program compile(const std::vector<AST::Declaration> &decls,
+                const std::vector<std::string> &inputs) {
+    using AST::FunctionDefinition;
+    using AST::FunctionPrototype;
+
+    /* What each name calls: the functions defined, then math functions,
+     * whether declared or not. */
+    std::map<std::string, Callee> callees;
+    std::vector<const FunctionDefinition *> definitions;
+    const FunctionDefinition *top_level = nullptr;
+    for (auto &decl: decls) {
+        auto *def = boost::get<std::unique_ptr<FunctionDefinition>>(&decl);
+        if (!def) continue;
+        auto &proto = *(*def)->proto;
+        if (proto.fname.empty()) {
+            if (!top_level) top_level = def->get();
+            continue;
+        }
+        if (callees.count(proto.fname)) {
+            _throw("redefinition of function " + proto.fname, proto.info);
+        }
+        if (std::count(proto.arg_types.begin(), proto.arg_types.end(),
+                       AST::Type::array)) {
+            _throw("bytecode has no arrays", proto.info);
+        }
+        if (definitions.size() + 1 > MAX_INDEX) {
+            _throw("too many functions to compile to bytecode", proto.info);
+        }
+        definitions.push_back(def->get());
+        callees[proto.fname] = {Op::call, (uint16_t)definitions.size(),
+                                (unsigned)proto.args.size()};
+    }
+    assert(top_level);
+
+    auto math = [&](const std::string &name) -> const Callee * {
+        Callee callee;
+        if (find_math(MATH1, name, callee.index)) {
+            callee = {Op::math1, callee.index, 1};
+        } else if (find_math(MATH2, name, callee.index)) {
+            callee = {Op::math2, callee.index, 2};
+        } else if (find_math(MATH3, name, callee.index)) {
+            callee = {Op::math3, callee.index, 3};
+        } else {
+            return nullptr;
+        }
+        return &(callees[name] = callee);
+    };
+    for (auto &decl: decls) {
+        auto *proto = boost::get<std::unique_ptr<FunctionPrototype>>(&decl);
+        if (!proto || !*proto) continue;
+        auto &fname = (*proto)->fname;
+        auto it = callees.find(fname);
+        const Callee *callee = it != callees.end()? &it->second
+                                                  : math(fname);
+        if ((*proto)->builtin && (!callee || callee->op == Op::call)) {
+            if (callee) {
+                _throw("cannot define builtin function " + fname,
+                       (*proto)->info);
+            }
+            _throw(fname + " is not a builtin function", (*proto)->info);
+        }
+        if (!callee) {
+            _throw("bytecode can only call the C library's math functions, "
+                   "not " + fname, (*proto)->info);
+        }
+        if (callee->op != Op::call
+            && (callee->args != (*proto)->args.size()
+                || std::count((*proto)->arg_types.begin(),
+                              (*proto)->arg_types.end(), AST::Type::array))) {
+            _throw(fname + " takes " + std::to_string(callee->args)
+                 + " numbers", (*proto)->info);
+        }
+        if (callee->args != (*proto)->args.size()) {
+            _throw("conflicting declaration of " + fname
+                 + " (previously declared with "
+                 + std::to_string(callee->args) + " arguments)",
+                   (*proto)->info);
+        }
+    }
+    for (auto &f: MATH1) if (!callees.count(f.name)) math(f.name);
+    for (auto &f: MATH2) if (!callees.count(f.name)) math(f.name);
+    for (auto &f: MATH3) if (!callees.count(f.name)) math(f.name);
+
+    Program program;
+    program.functions.emplace_back("", inputs.size(),
+                                   top_level->proto->info);
+    for (auto *def: definitions) {
+        program.functions.emplace_back(def->proto->fname,
+                                       def->proto->args.size(),
+                                       def->proto->info);
+    }
+    FunctionCompiler(program.functions[0], callees, 0)
+        .compile(inputs, top_level->body);
+    for (size_t i = 0; i < definitions.size(); ++i) {
+        FunctionCompiler(program.functions[i + 1], callees, i + 1)
+            .compile(definitions[i]->proto->args, definitions[i]->body);
+    }
+    return program;
+}
+
+/*****************************************************************************
+ * Running bytecode.
+ */
+
+Machine::Machine(const Program &program): program(program) {}
+
+double Machine::run(const double *inputs) {
+    auto &entry = program.functions[0];
+    if (stack.size() < entry.registers) stack.resize(entry.registers);
+    std::copy(inputs, inputs + entry.params, stack.begin());
+    depth = 0;
+    return call(0, 0);
+}
+
+/** Out of line, keeping its strings out of the frame of every call. */
+[[noreturn]] static void too_deep(const Function &f) {
+    throw Error("Runtime error", "calls to " + f.name + " nested more than "
+                + std::to_string(MAX_CALL_DEPTH) + " deep", f.info);
+}
+
+/* Computed gotos aren't standard C++, which the compiler will otherwise
+ * point out. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+double Machine::call(unsigned index, size_t base) {
+    const Function &f = program.functions[index];
+    if (depth == MAX_CALL_DEPTH) too_deep(f);
+    if (stack.size() < base + f.registers) {
+        stack.resize(2 * (base + f.registers));
+    }
+    ++depth;
+
+    /* Refreshed after each call, which may have moved the stack. */
+    double *r = stack.data() + base;
+    std::copy(f.constants.begin(), f.constants.end(), r + f.params);
+    const Instruction *code = f.code.data();
+    const Instruction *pc = code;
+
+#ifdef __GNUC__
+    /* Each instruction jumps straight to the next one's handler, so that
+     * the branch predictor sees one indirect jump per operation. */
+    static void *const handlers[] = {
+        &&do_mov, &&do_add, &&do_sub, &&do_mul, &&do_div, &&do_lt, &&do_le,
+        &&do_eq, &&do_ne, &&do_jmp, &&do_jt, &&do_jf, &&do_jlt, &&do_jle,
+        &&do_jeq, &&do_jne, &&do_jnlt, &&do_jnle, &&do_count, &&do_min,
+        &&do_max, &&do_math1, &&do_math2, &&do_math3, &&do_call, &&do_ret,
+    };
+    static_assert(sizeof handlers / sizeof *handlers
+                  == (size_t)Op::ret + 1, "a handler for each operation");
+#define HANDLER(op) do_##op
+#define DISPATCH() goto *handlers[(size_t)pc->op]
+#else
+#define HANDLER(op) case Op::op
+#define DISPATCH() goto dispatch
+#endif
+#define NEXT() do { ++pc; DISPATCH(); } while (0)
+#define JUMP_IF(cond) do { \
+        pc = (cond)? code + pc->c: pc + 1; DISPATCH(); \
+    } while (0)
+
+#ifdef __GNUC__
+    DISPATCH();
+#else
+dispatch:
+    switch (pc->op) {
+#endif
+    HANDLER(mov):
+        r[pc->a] = r[pc->b];
+        NEXT();
+    HANDLER(add):
+        r[pc->a] = r[pc->b] + r[pc->c];
+        NEXT();
+    HANDLER(sub):
+        r[pc->a] = r[pc->b] - r[pc->c];
+        NEXT();
+    HANDLER(mul):
+        r[pc->a] = r[pc->b] * r[pc->c];
+        NEXT();
+    HANDLER(div):
+        r[pc->a] = r[pc->b] / r[pc->c];
+        NEXT();
+    HANDLER(lt):
+        r[pc->a] = !(r[pc->b] >= r[pc->c]);
+        NEXT();
+    HANDLER(le):
+        r[pc->a] = !(r[pc->b] > r[pc->c]);
+        NEXT();
+    HANDLER(eq):
+        r[pc->a] = r[pc->b] == r[pc->c];
+        NEXT();
+    HANDLER(ne):
+        r[pc->a] = r[pc->b] != r[pc->c];
+        NEXT();
+    HANDLER(jmp):
+        JUMP_IF(true);
+    HANDLER(jt):
+        JUMP_IF(r[pc->a] < 0 || r[pc->a] > 0);
+    HANDLER(jf):
+        JUMP_IF(!(r[pc->a] < 0 || r[pc->a] > 0));
+    HANDLER(jlt):
+        JUMP_IF(!(r[pc->a] >= r[pc->b]));
+    HANDLER(jle):
+        JUMP_IF(!(r[pc->a] > r[pc->b]));
+    HANDLER(jeq):
+        JUMP_IF(r[pc->a] == r[pc->b]);
+    HANDLER(jne):
+        JUMP_IF(r[pc->a] != r[pc->b]);
+    HANDLER(jnlt):
+        JUMP_IF(r[pc->a] >= r[pc->b]);
+    HANDLER(jnle):
+        JUMP_IF(r[pc->a] > r[pc->b]);
+    HANDLER(count): {
+        double span = r[pc->b];
+        int64_t iterations = 0;
+        if (span > 0 && span < 4e18) {
+            iterations = (int64_t)span;
+            if ((double)iterations < span) ++iterations;
+        }
+        r[pc->a] = (double)iterations;
+        NEXT();
+    }
+    HANDLER(min): {
+        double acc = r[pc->a], val = r[pc->b];
+        r[pc->a] = val < acc || acc != acc? val: acc;
+        NEXT();
+    }
+    HANDLER(max): {
+        double acc = r[pc->a], val = r[pc->b];
+        r[pc->a] = val > acc || acc != acc? val: acc;
+        NEXT();
+    }
+    HANDLER(math1):
+        r[pc->a] = MATH1[pc->c].function(r[pc->b]);
+        NEXT();
+    HANDLER(math2):
+        r[pc->a] = MATH2[pc->c].function(r[pc->b], r[pc->b + 1]);
+        NEXT();
+    HANDLER(math3):
+        r[pc->a] = MATH3[pc->c].function(r[pc->b], r[pc->b + 1],
+                                         r[pc->b + 2]);
+        NEXT();
+    HANDLER(call): {
+        double result = call(pc->c, base + pc->b);
+        r = stack.data() + base;
+        r[pc->a] = result;
+        NEXT();
+    }
+    HANDLER(ret):
+        --depth;
+        return r[pc->a];
+#ifndef __GNUC__
+    }
+#endif
+
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef JUMP_IF
+}
+
+#pragma GCC diagnostic pop
+
+}
+}
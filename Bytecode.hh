@@ -0,0 +1,135 @@
+/**
+ * @brief Compiling programs to a compact, register-based bytecode, and
+ *        running it, for when LLVM would take far longer than the program.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "AST.hh"
+#include "Error.hh"
+
+namespace Kaleidoscope {
+namespace Bytecode {
+
+/**
+ * @brief What an instruction does, to registers `r` and the instruction
+ *        indices it jumps to.
+ */
+enum class Op: uint16_t {
+    /** r[a] = r[b] */
+    mov,
+    /** r[a] = r[b] + r[c], and so on. */
+    add, sub, mul, div,
+    /** r[a] = 1 if r[b] < r[c], else 0; then <=, == and !=.  As in
+     *  `ExpressionGenerator`, `<`, `<=` and `!=` hold if either side is NaN
+     *  (and `>` and `>=` are them with their operands swapped). */
+    lt, le, eq, ne,
+    /** Jump to c. */
+    jmp,
+    /** Jump to c if r[a] is true (neither 0 nor NaN), or if it is false. */
+    jt, jf,
+    /** Jump to c if r[a] < r[b] (as in `lt`), and so on; or if not. */
+    jlt, jle, jeq, jne, jnlt, jnle,
+    /** r[a] = the number of iterations of a counted loop spanning r[b]
+     *  steps, as `ExpressionGenerator::count_iterations` counts them. */
+    count,
+    /** r[a] = the smaller (or larger) of r[a] and r[b], ignoring a NaN in
+     *  r[a], as `min` (or `max`) loops reduce. */
+    min, max,
+    /** r[a] = C math library function c of r[b] (or of r[b] and r[b + 1],
+     *  or of r[b], r[b + 1] and r[b + 2]). */
+    math1, math2, math3,
+    /** r[a] = function c called with the arguments in r[b], r[b + 1], ...,
+     *  which are where the callee's registers start. */
+    call,
+    /** Return r[a]. */
+    ret,
+};
+
+/**
+ * @brief An operation and its (up to three) operands.
+ */
+struct Instruction {
+    Op op;
+    uint16_t a, b, c;
+};
+
+/**
+ * @brief A function's code, and how its registers are laid out.
+ */
+struct Function {
+    std::string name;
+    /** Registers [0, params) hold its arguments. */
+    unsigned params;
+    /** Loaded into the registers after the arguments on each call, and
+     *  never written to by the code. */
+    std::vector<double> constants;
+    /** The rest hold variables and intermediate values. */
+    unsigned registers = 0;
+    std::vector<Instruction> code;
+    /** Where it is defined. */
+    ErrorInfo info;
+
+    Function(std::string name, unsigned params, ErrorInfo info)
+        : name(name), params(params), info(info) {}
+};
+
+/**
+ * @brief Functions calling each other (and the C math library), starting
+ *        with the one that is run.
+ */
+struct Program {
+    std::vector<Function> functions;
+};
+
+/**
+ * @brief Compile a program's functions, and its one top-level expression
+ *        (which becomes `functions[0]`), to bytecode.
+ *
+ * @param decls  The program: `def`s, `extern` and `builtin` declarations
+ *               (of C math library functions, which are also usable
+ *               undeclared) and exactly one top-level expression.
+ * @param inputs Names of the top-level expression's variables, which are
+ *               its arguments.
+ *
+ * Throws an `Error` at the first thing in the program which compiled code
+ * wouldn't allow, or which bytecode can't do: arrays, and calls to other
+ * functions of the C library.
+ */
+Program compile(const std::vector<AST::Declaration> &decls,
+                const std::vector<std::string> &inputs);
+
+/**
+ * @brief Runs a program's bytecode, for one set of inputs after another.
+ *
+ * Its values are the same as compiled code's: floating-point operations
+ * happen in the same order, as do calls to the same math functions.  Each
+ * thread running a program needs a `Machine` of its own.
+ */
+class Machine {
+public:
+    explicit Machine(const Program &program);
+
+    /**
+     * @brief Evaluate the top-level expression for the given inputs.
+     *
+     * Throws an `Error` if calls nest too deeply for the stack (other than
+     * a function's calls to itself in tail position, which are jumps).
+     */
+    double run(const double *inputs);
+
+private:
+    double call(unsigned function, size_t base);
+
+    const Program &program;
+    /** Registers of the calls running, each call's after its caller's. */
+    std::vector<double> stack;
+    unsigned depth = 0;
+};
+
+}
+}
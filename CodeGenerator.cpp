@@ -1,5 +1,6 @@
 #include "CodeGenerator.hh"
 #include "CodeGeneratorImpl.hh"
+#include "Target.hh"
 
 namespace Kaleidoscope {
 
@@ -9,8 +10,22 @@ namespace Kaleidoscope {
  */
 
 CodeGenerator::CodeGenerator(std::string name,
-                             std::string triple)
-    : pimpl(std::make_unique<CodeGeneratorImpl>(name, triple)) {}
+                             std::string triple,
+                             CodeGenOptions opts)
+    : pimpl(std::make_unique<CodeGeneratorImpl>(
+                name, std::make_shared<Target>(triple, opts.opt_level),
+                opts)) {}
+
+static CodeGenOptions with_level(CodeGenOptions opts, unsigned level) {
+    opts.opt_level = level;
+    return opts;
+}
+
+CodeGenerator::CodeGenerator(std::string name,
+                             std::shared_ptr<Target> target,
+                             CodeGenOptions opts)
+    : pimpl(std::make_unique<CodeGeneratorImpl>(
+                name, target, with_level(opts, target->opt_level()))) {}
 
 CodeGenerator::~CodeGenerator() = default;
 
@@ -18,6 +33,26 @@ llvm::Function *CodeGenerator::operator()(const AST::Declaration &decl) {
     return boost::apply_visitor(*pimpl, decl);
 }
 
+llvm::Function *CodeGenerator::declare(const AST::Declaration &decl) {
+    return pimpl->declare(decl);
+}
+
+void CodeGenerator::use(const Library &library) {
+    return pimpl->use(library);
+}
+
+std::vector<Error> CodeGenerator::take_warnings(void) {
+    return pimpl->take_warnings();
+}
+
+void CodeGenerator::optimize(void) {
+    return pimpl->optimize();
+}
+
+std::map<std::string, uint64_t> CodeGenerator::statistics(void) {
+    return pimpl->statistics();
+}
+
 void CodeGenerator::emit_ir(std::ostream &out) {
     return pimpl->emit_ir(out);
 }
@@ -26,4 +61,29 @@ void CodeGenerator::emit_obj(int out) {
     return pimpl->emit_obj(out);
 }
 
+void CodeGenerator::emit_obj(std::ostream &out) {
+    return pimpl->emit_obj(out);
+}
+
+void CodeGenerator::emit_bc(int out, bool summary) {
+    return pimpl->emit_bc(out, summary);
+}
+
+void CodeGenerator::emit_bc(std::ostream &out, bool summary) {
+    return pimpl->emit_bc(out, summary);
+}
+
+void CodeGenerator::emit_kpm(int out) {
+    return pimpl->emit_kpm(out);
+}
+
+void CodeGenerator::emit_kpm(std::ostream &out) {
+    return pimpl->emit_kpm(out);
+}
+
+std::vector<void *> CodeGenerator::load(
+        const std::vector<std::string> &names) {
+    return pimpl->load(names);
+}
+
 }
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <string>
 #include <iostream>
+#include <vector>
 
 #include <boost/variant.hpp>
 #include "llvm/Support/Host.h"
@@ -11,7 +14,132 @@
 
 namespace Kaleidoscope {
 
+/**
+ * @brief Where `memo` functions keep their tables of results.
+ */
+enum class MemoTable {
+    /** A table per thread: no synchronization, but no sharing either. */
+    per_thread,
+    /** One table shared by every thread, updated without locks. */
+    shared,
+};
+
+/**
+ * @brief What to do with a result whose table slot is already taken.
+ */
+enum class MemoEviction {
+    /** Replace the older result, so that recent results are cached. */
+    replace,
+    /** Keep the older result, so that the first results are cached. */
+    keep,
+};
+
+/**
+ * @brief Where vectorized loops get vector versions of math functions.
+ */
+enum class VectorLibrary {
+    /** Nowhere: loops calling them are only vectorized if LLVM can expand
+     *  the calls inline (e.g. `sqrt`, `fabs`, `floor`). */
+    none,
+    /** The runtime library's (see runtime/vecmath.c), on x86-64. */
+    kalrt,
+};
+
+/**
+ * @brief Knobs controlling the tables of `memo` functions.
+ */
+struct MemoOptions {
+    /**
+     * @brief Entries in each table, unless given with `memo(N)`.  Rounded up
+     *        to a power of two.
+     */
+    unsigned capacity = 1024;
+
+    MemoTable table = MemoTable::per_thread;
+
+    MemoEviction eviction = MemoEviction::replace;
+};
+
+/**
+ * @brief Knobs controlling code generation and optimization.
+ */
+struct CodeGenOptions {
+    /**
+     * @brief How hard to optimize, from 0 (not at all) to 3, as for `-O`.
+     */
+    unsigned opt_level = 2;
+
+    /**
+     * @brief Warn about self-recursive calls that are not in tail position
+     *        (and so cannot be turned into loops).
+     */
+    bool warn_non_tail_recursion = false;
+
+    /**
+     * @brief Build variables' SSA values directly, rather than giving each
+     *        one a stack slot and leaving LLVM to turn the slots into SSA
+     *        values (which is slower, and pointless at `-O0`).
+     */
+    bool direct_ssa = true;
+
+    /**
+     * @brief Treat `extern` declarations of C math library functions (e.g.
+     *        `sqrt`, `sin`, `pow`) as LLVM's intrinsics, which can be
+     *        constant folded, hoisted out of loops and vectorized.
+     *
+     * Functions declared with `builtin` are treated this way regardless.
+     */
+    bool builtins = true;
+
+    MemoOptions memo;
+
+    /**
+     * @brief Let loops calling `exp`, `log`, `sin`, `cos`, `pow` and the
+     *        like be vectorized, calling vector versions of them from this
+     *        library (which the program must be linked with).
+     */
+    VectorLibrary vector_library = VectorLibrary::none;
+
+    /**
+     * @brief Let loop reductions combine values in any order (so that they
+     *        can be vectorized), though floating-point `+` and `*` aren't
+     *        associative, and assume that they never see NaNs.
+     */
+    bool associative_math = false;
+
+    /**
+     * @brief Functions to keep callable from outside the module, besides
+     *        those defined with `export`.
+     *
+     * If there are any, every other function gets internal linkage, so
+     * that it can be inlined into its callers and then deleted.  Otherwise
+     * every named function is exported.
+     */
+    std::vector<std::string> exports;
+
+    /**
+     * @brief Count calls to each function and which way each branch goes,
+     *        adding the counts to a profile when the program exits (see
+     *        runtime/kalrt.h).
+     */
+    bool profile_generate = false;
+
+    /**
+     * @brief A profile to optimize for (e.g. to lay out code so that the
+     *        usual way through it is straight), or empty for none.
+     */
+    std::string profile_use;
+
+    /**
+     * @brief Have LLVM time each pass it runs, and print a report on exit.
+     */
+    bool time_passes = false;
+};
+
 class CodeGeneratorImpl;
+class Target;
+struct Library;
+
 /**
  * @brief Visit AST nodes and convert them to an LLVM AST.
  */
@@ -23,7 +151,19 @@ public:
      *        the given name.
      */
     CodeGenerator(std::string name,
-                  std::string triple=llvm::sys::getDefaultTargetTriple());
+                  std::string triple=llvm::sys::getDefaultTargetTriple(),
+                  CodeGenOptions opts=CodeGenOptions());
+
+    /**
+     * @brief Create a `CodeGenerator` emitting code using an existing
+     *        target machine.
+     *
+     * The target is not thread-safe: it must not be used by any other
+     * `CodeGenerator` at the same time.  The target's optimization level
+     * overrides `opts.opt_level`.
+     */
+    CodeGenerator(std::string name, std::shared_ptr<Target> target,
+                  CodeGenOptions opts=CodeGenOptions());
 
     ~CodeGenerator();
 
@@ -38,6 +178,47 @@ public:
 
     /**@}*/
 
+    /**
+     * @brief Declare the function a declaration introduces, without
+     *        generating its body.
+     *
+     * Declaring everything up front lets definitions refer to functions
+     * defined later (in particular, in other files).  Throws an `Error` if
+     * the declaration conflicts with an earlier one.
+     */
+    llvm::Function *declare(const AST::Declaration &);
+
+    /**
+     * @brief Use a precompiled library: the bodies of its functions are
+     *        linked in when the module is optimized, to be inlined (but not
+     *        emitted; the program is linked with the library's object code).
+     *
+     * Its interface must be declared as well.  Must come before any
+     * definitions, so that redefining one of its functions is an error.
+     * Throws an `Error` if the library was compiled for another target, or
+     * if another library defines the same functions.
+     */
+    void use(const Library &);
+
+    /**
+     * @brief Return (and forget) the warnings produced since the last call.
+     */
+    std::vector<Error> take_warnings(void);
+
+    /**
+     * @brief Run the optimization passes over the module.
+     *
+     * Only the first call does anything.  The `emit_*` methods optimize the
+     * module if it has not been already.  Throws an `Error` if a `memo`
+     * function turns out not to be pure.
+     */
+    void optimize(void);
+
+    /**
+     * @brief Count the functions and IR instructions in the module.
+     */
+    std::map<std::string, uint64_t> statistics(void);
+
     /**
      * @brief Emit LLVM IR to the given output stream.
      */
@@ -51,6 +232,52 @@ public:
      */
     void emit_obj(int fd);
 
+    /**
+     * @brief Emit object code to the given output stream.
+     */
+    void emit_obj(std::ostream &);
+
+    /**
+     * @brief Emit LLVM bitcode, e.g. for link-time optimization with C code.
+     *
+     * @param fd A file descriptor to an open, writable file.  Will not be
+     *           closed upon completion.
+     * @param summary Also write a module summary, so that ThinLTO can import
+     *                (and inline) our functions into other modules.
+     */
+    void emit_bc(int fd, bool summary);
+
+    /**
+     * @brief Emit LLVM bitcode to the given output stream.
+     */
+    void emit_bc(std::ostream &, bool summary);
+
+    /**
+     * @brief Emit the module as a precompiled library (see Library.hh), for
+     *        other modules to `use`.
+     *
+     * @param fd A file descriptor to an open, writable file.  Will not be
+     *           closed upon completion.
+     */
+    void emit_kpm(int fd);
+
+    /**
+     * @brief Emit the module as a precompiled library to the given output
+     *        stream.
+     */
+    void emit_kpm(std::ostream &);
+
+    /**
+     * @brief Optimize the module and load its code into this process,
+     *        returning the addresses of the named functions (or null for
+     *        any it doesn't define).
+     *
+     * The code lasts as long as the `CodeGenerator`, which can't do anything
+     * else with the module afterwards.  Throws an `Error` if the module
+     * calls a function that the process doesn't have.
+     */
+    std::vector<void *> load(const std::vector<std::string> &names);
+
 private:
 
     std::unique_ptr<CodeGeneratorImpl> pimpl;
@@ -1,28 +1,46 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/raw_os_ostream.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
-#include "llvm/Support/TargetSelect.h"
-#include "llvm/Support/TargetRegistry.h"
-#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Vectorize.h"
 
+#include "Analysis.hh"
 #include "CodeGeneratorImpl.hh"
+#include "Lexer.hh"
+#include "Memo.hh"
+#include "Profile.hh"
 
 namespace Kaleidoscope {
 
@@ -34,21 +52,154 @@ namespace Kaleidoscope {
     throw Error("Codegen error", msg, info);
 }
 
-static llvm::Value *log_error(std::string str) {
-    std::cerr << "Kaleidoscope::CodeGenerator::log_error: "
-              << str << std::endl;
-    return nullptr;
-}
-
 /** Create a new `alloca` in the entry block of the given function, allocating
- *  a double-sized block of memory. */
+ *  space for a value of the given type. */
 static llvm::AllocaInst *create_alloca(
-        llvm::Function *f, const std::string &name, llvm::LLVMContext &ctxt) {
+        llvm::Function *f, const std::string &name, llvm::Type *type) {
     /* Get a new builder adding instructions to the beginning of the function.
     */
-    llvm::IRBuilder<> tmp(&f->getEntryBlock(), f->getEntryBlock().begin());
-    return tmp.CreateAlloca(llvm::Type::getDoubleTy(ctxt),
-                            0, name.c_str());
+    Builder tmp(&f->getEntryBlock(), f->getEntryBlock().begin());
+    return tmp.CreateAlloca(type, 0, name.c_str());
+}
+
+/** The LLVM type of values of a Kaleidoscope type. */
+static llvm::Type *llvm_type(AST::Type type, llvm::LLVMContext &ctxt) {
+    switch (type) {
+    case AST::Type::array:
+        return llvm::Type::getDoublePtrTy(ctxt);
+    case AST::Type::number:
+    default:
+        return llvm::Type::getDoubleTy(ctxt);
+    }
+}
+
+/** The LLVM intrinsic equivalent to the C math library function of the given
+ *  name, or `not_intrinsic`. */
+static llvm::Intrinsic::ID math_intrinsic(const std::string &name) {
+    static const std::map<std::string, llvm::Intrinsic::ID> intrinsics = {
+        {"sqrt", llvm::Intrinsic::sqrt},
+        {"sin", llvm::Intrinsic::sin},
+        {"cos", llvm::Intrinsic::cos},
+        {"pow", llvm::Intrinsic::pow},
+        {"exp", llvm::Intrinsic::exp},
+        {"exp2", llvm::Intrinsic::exp2},
+        {"log", llvm::Intrinsic::log},
+        {"log2", llvm::Intrinsic::log2},
+        {"log10", llvm::Intrinsic::log10},
+        {"fabs", llvm::Intrinsic::fabs},
+        {"fma", llvm::Intrinsic::fma},
+        {"fmin", llvm::Intrinsic::minnum},
+        {"fmax", llvm::Intrinsic::maxnum},
+        {"copysign", llvm::Intrinsic::copysign},
+        {"floor", llvm::Intrinsic::floor},
+        {"ceil", llvm::Intrinsic::ceil},
+        {"trunc", llvm::Intrinsic::trunc},
+        {"rint", llvm::Intrinsic::rint},
+        {"nearbyint", llvm::Intrinsic::nearbyint},
+        {"round", llvm::Intrinsic::round},
+    };
+    auto it = intrinsics.find(name);
+    return it == intrinsics.end()? llvm::Intrinsic::not_intrinsic: it->second;
+}
+
+/** The runtime library's vector versions of math intrinsics (see
+ *  runtime/vecmath.c), by vector width. */
+static const llvm::VecDesc KALRT_VECTOR_FUNCTIONS[] = {
+    {"llvm.sin.f64", "kalrt_sin_v2f64", 2},
+    {"llvm.sin.f64", "kalrt_sin_v4f64", 4},
+    {"llvm.sin.f64", "kalrt_sin_v8f64", 8},
+    {"llvm.cos.f64", "kalrt_cos_v2f64", 2},
+    {"llvm.cos.f64", "kalrt_cos_v4f64", 4},
+    {"llvm.cos.f64", "kalrt_cos_v8f64", 8},
+    {"llvm.exp.f64", "kalrt_exp_v2f64", 2},
+    {"llvm.exp.f64", "kalrt_exp_v4f64", 4},
+    {"llvm.exp.f64", "kalrt_exp_v8f64", 8},
+    {"llvm.exp2.f64", "kalrt_exp2_v2f64", 2},
+    {"llvm.exp2.f64", "kalrt_exp2_v4f64", 4},
+    {"llvm.exp2.f64", "kalrt_exp2_v8f64", 8},
+    {"llvm.log.f64", "kalrt_log_v2f64", 2},
+    {"llvm.log.f64", "kalrt_log_v4f64", 4},
+    {"llvm.log.f64", "kalrt_log_v8f64", 8},
+    {"llvm.log2.f64", "kalrt_log2_v2f64", 2},
+    {"llvm.log2.f64", "kalrt_log2_v4f64", 4},
+    {"llvm.log2.f64", "kalrt_log2_v8f64", 8},
+    {"llvm.log10.f64", "kalrt_log10_v2f64", 2},
+    {"llvm.log10.f64", "kalrt_log10_v4f64", 4},
+    {"llvm.log10.f64", "kalrt_log10_v8f64", 8},
+    {"llvm.pow.f64", "kalrt_pow_v2f64", 2},
+    {"llvm.pow.f64", "kalrt_pow_v4f64", 4},
+    {"llvm.pow.f64", "kalrt_pow_v8f64", 8},
+};
+
+/** Collects the variables that expressions assign to: with `=`, or as the
+ *  reduction variables of `parfor` loops. */
+struct AssignmentVisitor: public boost::static_visitor<void> {
+    std::set<std::string> &assigned;
+    AssignmentVisitor(std::set<std::string> &assigned): assigned(assigned) {}
+
+    void operator()(const AST::NumberLiteral &) {}
+    void operator()(const AST::VariableName &) {}
+
+    void operator()(const std::unique_ptr<AST::BinaryOp> &op) {
+        auto *var = boost::get<AST::VariableName>(&op->lhs);
+        if (op->op == '=' && var) assigned.insert(var->name);
+        boost::apply_visitor(*this, op->lhs);
+        boost::apply_visitor(*this, op->rhs);
+    }
+
+    void operator()(const std::unique_ptr<AST::FunctionCall> &call) {
+        for (auto &arg: call->args) boost::apply_visitor(*this, arg);
+    }
+
+    void operator()(const std::unique_ptr<AST::IfThenElse> &if_) {
+        boost::apply_visitor(*this, if_->cond);
+        boost::apply_visitor(*this, if_->then);
+        boost::apply_visitor(*this, if_->else_);
+    }
+
+    void operator()(const std::unique_ptr<AST::ForLoop> &loop) {
+        for (auto &reduction: loop->reductions) {
+            assigned.insert(reduction.var);
+        }
+        boost::apply_visitor(*this, loop->start);
+        boost::apply_visitor(*this, loop->end);
+        boost::apply_visitor(*this, loop->step);
+        boost::apply_visitor(*this, loop->body);
+    }
+
+    void operator()(const std::unique_ptr<AST::LocalVar> &local) {
+        for (auto &name: local->names) {
+            boost::apply_visitor(*this, name.second);
+        }
+        boost::apply_visitor(*this, local->body);
+    }
+
+    void operator()(const std::unique_ptr<AST::ArrayIndex> &elt) {
+        boost::apply_visitor(*this, elt->index);
+    }
+};
+
+/** The variables the expressions assign to (including any they declare
+ *  themselves, which are harmless). */
+static std::set<std::string> assignments(
+        std::initializer_list<const AST::Expression *> exprs) {
+    std::set<std::string> result;
+    AssignmentVisitor visitor(result);
+    for (auto *expr: exprs) boost::apply_visitor(visitor, *expr);
+    return result;
+}
+
+/** Describe a value's type, for error messages. */
+static std::string describe(llvm::Type *type) {
+    return type->isPointerTy()? "an array": "a number";
+}
+
+/** Is the value a constant whole number an integer variable could hold? */
+static bool is_small_whole(llvm::Value *v) {
+    auto *c = llvm::dyn_cast<llvm::ConstantFP>(v);
+    if (!c) return false;
+    double val = c->getValueAPF().convertToDouble();
+    return val == std::trunc(val) && std::fabs(val) <= max_integer_start;
 }
 
 
@@ -56,72 +207,401 @@ static llvm::AllocaInst *create_alloca(
  * ExpressionGenerator implementation.
  */
 
-llvm::Value *ExpressionGenerator::to_cond(llvm::Value *f) {
-    if (!f) return nullptr;
-    return builder.CreateFCmpONE(f,
+llvm::Value *ExpressionGenerator::visit(const AST::Expression &expr,
+                                        bool tail) {
+    bool old_tail = this->tail;
+    this->tail = tail;
+    auto result = boost::apply_visitor(*this, expr);
+    this->tail = old_tail;
+    return result;
+}
+
+llvm::Value *ExpressionGenerator::visit_scalar(const AST::Expression &expr,
+                                               bool tail) {
+    auto result = visit(expr, tail);
+    if (result && result->getType()->isPointerTy()) {
+        _throw("expected a number, not " + describe(result->getType()),
+               AST::get_info(expr));
+    }
+    return result;
+}
+
+llvm::Value *ExpressionGenerator::visit_number(const AST::Expression &expr,
+                                               bool tail) {
+    return to_double(visit_scalar(expr, tail));
+}
+
+llvm::Value *ExpressionGenerator::to_double(llvm::Value *v) {
+    if (!v) return nullptr;
+    auto *double_ty = llvm::Type::getDoubleTy(context);
+    if (v->getType()->isIntegerTy(1)) {
+        /* Convert bool 0/1 to double 0.0 or 1.0 */
+        return builder.CreateUIToFP(v, double_ty, "booltmp");
+    }
+    if (v->getType()->isIntegerTy()) {
+        return builder.CreateSIToFP(v, double_ty, "inttmp");
+    }
+    return v;
+}
+
+llvm::Value *ExpressionGenerator::to_integer(llvm::Value *v) {
+    auto *i64 = llvm::Type::getInt64Ty(context);
+    if (v->getType()->isIntegerTy(1)) return builder.CreateZExt(v, i64);
+    /* Only values `infer_integers` found to be whole get here. */
+    if (v->getType()->isDoubleTy()) return builder.CreateFPToSI(v, i64);
+    return v;
+}
+
+llvm::Value *ExpressionGenerator::convert(llvm::Value *v, llvm::Type *type) {
+    if (type->isDoubleTy()) return to_double(v);
+    if (type->isIntegerTy()) return to_integer(v);
+    return v;
+}
+
+bool ExpressionGenerator::integer_operands(llvm::Value *l, llvm::Value *r) {
+    auto integer = [](llvm::Value *v) {
+        return v->getType()->isIntegerTy() || is_small_whole(v);
+    };
+    /* Arithmetic on constants is folded as it always was. */
+    return integer(l) && integer(r)
+        && (l->getType()->isIntegerTy() || r->getType()->isIntegerTy());
+}
+
+llvm::Value *ExpressionGenerator::less_than(llvm::Value *l, llvm::Value *r) {
+    auto *double_ty = llvm::Type::getDoubleTy(context);
+    auto *i64 = llvm::Type::getInt64Ty(context);
+    if (integer_operands(l, r)) {
+        return builder.CreateICmpSLT(to_integer(l), to_integer(r), "cmptmp");
+    }
+    if (!l->getType()->isIntegerTy() || !r->getType()->isDoubleTy()) {
+        return builder.CreateFCmpULT(to_double(l), to_double(r), "cmptmp");
+    }
+
+    /* i < x exactly when i < ceil(x), which lets LLVM count the iterations
+     * of loops like `for i = 0, i < n`.  (Like `<` on doubles, it's true if
+     * x is NaN.) */
+    auto *whole = builder.CreateFPToSI(r, i64);
+    auto *bound = builder.CreateAdd(
+            whole,
+            builder.CreateZExt(builder.CreateFCmpOLT(
+                    builder.CreateSIToFP(whole, double_ty), r), i64),
+            "bound");
+    const double huge = 4611686018427387904.0;
+    bound = builder.CreateSelect(
+            builder.CreateFCmpOLE(r, llvm::ConstantFP::get(double_ty, -huge)),
+            llvm::ConstantInt::get(i64, INT64_MIN), bound);
+    bound = builder.CreateSelect(
+            builder.CreateFCmpUGE(r, llvm::ConstantFP::get(double_ty, huge)),
+            llvm::ConstantInt::get(i64, INT64_MAX), bound);
+    return builder.CreateICmpSLT(to_integer(l), bound, "cmptmp");
+}
+
+llvm::Value *ExpressionGenerator::compare(int op, llvm::Value *l,
+                                          llvm::Value *r) {
+    if (integer_operands(l, r)) {
+        auto pred = op == tok_le? llvm::CmpInst::ICMP_SLE
+                  : op == tok_ge? llvm::CmpInst::ICMP_SGE
+                  : op == tok_eq? llvm::CmpInst::ICMP_EQ
+                  : llvm::CmpInst::ICMP_NE;
+        return builder.CreateICmp(pred, to_integer(l), to_integer(r),
+                                  "cmptmp");
+    }
+    /* Like `<`, `<=` and `>=` are true if either side is NaN; `==` is false
+     * and `!=` true, as in C. */
+    auto pred = op == tok_le? llvm::CmpInst::FCMP_ULE
+              : op == tok_ge? llvm::CmpInst::FCMP_UGE
+              : op == tok_eq? llvm::CmpInst::FCMP_OEQ
+              : llvm::CmpInst::FCMP_UNE;
+    return builder.CreateFCmp(pred, to_double(l), to_double(r), "cmptmp");
+}
+
+llvm::Value *ExpressionGenerator::logical(const AST::BinaryOp &op) {
+    bool is_and = op.op == tok_and;
+    auto *lhs = to_cond(visit_scalar(op.lhs, false));
+    if (!lhs) return nullptr;
+
+    /* The right side is only evaluated if the left doesn't decide. */
+    llvm::Function *parent = builder.GetInsertBlock()->getParent();
+    auto *lhs_bb = builder.GetInsertBlock();
+    auto *rhs_bb = llvm::BasicBlock::Create(context, "rhs", parent);
+    auto *merge_bb = llvm::BasicBlock::Create(context, "merge");
+    builder.CreateCondBr(lhs, is_and? rhs_bb: merge_bb,
+                         is_and? merge_bb: rhs_bb);
+    auto before = names;
+
+    builder.SetInsertPoint(rhs_bb);
+    auto *rhs = to_cond(visit_scalar(op.rhs, false));
+    if (!rhs) return nullptr;
+    builder.CreateBr(merge_bb);
+    rhs_bb = builder.GetInsertBlock();
+
+    parent->getBasicBlockList().push_back(merge_bb);
+    builder.SetInsertPoint(merge_bb);
+    auto *result = builder.CreatePHI(builder.getInt1Ty(), 2,
+                                     is_and? "and": "or");
+    result->addIncoming(builder.getInt1(!is_and), lhs_bb);
+    result->addIncoming(rhs, rhs_bb);
+    merge(before, lhs_bb, rhs_bb);
+    return result;
+}
+
+/** Does the expression assign to variables that have no slots?  Then the
+ *  blocks its code leaves from may have different values for them. */
+bool ExpressionGenerator::changes_variables(const AST::Expression &expr) {
+    for (auto &name: assignments({&expr})) {
+        auto it = names.find(name);
+        if (it != names.end() && !it->second.slot) return true;
+    }
+    return false;
+}
+
+/** Generate code for a condition that jumps to `true_bb` if it holds, and
+ *  to `false_bb` if not, rather than producing a value: the operands of
+ *  `&&` and `||` each get a branch of their own, straight to wherever they
+ *  decide the condition goes. */
+bool ExpressionGenerator::gen_branch(const AST::Expression &cond,
+                                     llvm::BasicBlock *true_bb,
+                                     llvm::BasicBlock *false_bb) {
+    auto *op = boost::get<std::unique_ptr<AST::BinaryOp>>(&cond);
+    if (op && ((*op)->op == tok_and || (*op)->op == tok_or)
+     && !changes_variables(cond)) {
+        bool is_and = (*op)->op == tok_and;
+        llvm::Function *parent = builder.GetInsertBlock()->getParent();
+        auto *rhs_bb = llvm::BasicBlock::Create(context, "rhs");
+        if (!gen_branch((*op)->lhs, is_and? rhs_bb: true_bb,
+                        is_and? false_bb: rhs_bb)) {
+            return false;
+        }
+        parent->getBasicBlockList().push_back(rhs_bb);
+        builder.SetInsertPoint(rhs_bb);
+        return gen_branch((*op)->rhs, true_bb, false_bb);
+    }
+
+    auto *value = to_cond(visit_scalar(cond, false));
+    if (!value) return false;
+    builder.CreateCondBr(value, true_bb, false_bb);
+    return true;
+}
+
+llvm::Value *ExpressionGenerator::to_cond(llvm::Value *v) {
+    if (!v) return nullptr;
+    if (v->getType()->isIntegerTy(1)) return v;
+    if (v->getType()->isIntegerTy()) {
+        return builder.CreateICmpNE(
+                v, llvm::ConstantInt::get(v->getType(), 0), "cond");
+    }
+    return builder.CreateFCmpONE(v,
                                  llvm::ConstantFP::get(context,
                                                        llvm::APFloat(0.0)),
                                  "cond");
 }
 
+Variable ExpressionGenerator::bind(const std::string &name,
+                                   llvm::Value *value, llvm::Type *type,
+                                   const char *read_only) {
+    Variable var;
+    var.type = type;
+    var.read_only = read_only;
+    value = convert(value, type);
+    if (opts.direct_ssa) {
+        var.value = value;
+    } else {
+        var.slot = create_alloca(builder.GetInsertBlock()->getParent(), name,
+                                 type);
+        builder.CreateStore(value, var.slot);
+    }
+    return var;
+}
+
+llvm::Value *ExpressionGenerator::load(const std::string &name,
+                                       const Variable &var) {
+    return var.slot? builder.CreateLoad(var.slot, name.c_str()): var.value;
+}
+
+void ExpressionGenerator::store(Variable &var, llvm::Value *value) {
+    value = convert(value, var.type);
+    if (var.slot) {
+        builder.CreateStore(value, var.slot);
+    } else {
+        var.value = value;
+    }
+}
+
+void ExpressionGenerator::unbind(const std::string &name,
+                                 const Scope &shadowed) {
+    auto it = shadowed.find(name);
+    if (it != shadowed.end()) {
+        names[name] = it->second;
+    } else {
+        names.erase(name);
+    }
+}
+
+/** Join the variables' values at the end of `bb` (the current ones) with
+ *  those at the end of `other_bb`, in the block being generated, which
+ *  both jump to. */
+void ExpressionGenerator::merge(const Scope &other,
+                                llvm::BasicBlock *other_bb,
+                                llvm::BasicBlock *bb) {
+    for (auto &name: names) {
+        auto &var = name.second;
+        auto it = other.find(name.first);
+        if (var.slot || it == other.end()
+         || it->second.value == var.value) {
+            continue;
+        }
+        auto *phi = builder.CreatePHI(var.type, 2, name.first);
+        phi->addIncoming(it->second.value, other_bb);
+        phi->addIncoming(var.value, bb);
+        var.value = phi;
+    }
+}
+
+/** Give the variables a loop assigns to phis at the top of its header (the
+ *  block being generated), entered from `pre_bb`.  Their other incomings
+ *  are added by `close_loop`. */
+std::vector<std::pair<std::string, llvm::PHINode *>>
+ExpressionGenerator::loop_phis(const std::set<std::string> &assigned,
+                               llvm::BasicBlock *pre_bb) {
+    std::vector<std::pair<std::string, llvm::PHINode *>> phis;
+    for (auto &name: assigned) {
+        auto it = names.find(name);
+        if (it == names.end() || it->second.slot || it->second.read_only) {
+            continue;
+        }
+        auto *phi = builder.CreatePHI(it->second.type, 2, name);
+        phi->addIncoming(it->second.value, pre_bb);
+        it->second.value = phi;
+        phis.emplace_back(name, phi);
+    }
+    return phis;
+}
+
+/** Add the incomings from the loop's latches (every other predecessor of
+ *  its header, which all leave the variables alike) to its phis. */
+void ExpressionGenerator::close_loop(
+        const std::vector<std::pair<std::string, llvm::PHINode *>> &phis) {
+    for (auto &phi: phis) {
+        for (auto *pred: llvm::predecessors(phi.second->getParent())) {
+            if (phi.second->getBasicBlockIndex(pred) < 0) {
+                phi.second->addIncoming(names[phi.first].value, pred);
+            }
+        }
+    }
+
+    /* Variables that were only assigned in inner scopes that shadow them
+     * don't change, and so don't need phis; nor do any that were only
+     * assigned their values from those. */
+    std::set<llvm::PHINode *> removed;
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (auto &phi: phis) {
+            auto *same = removed.count(phi.second)
+                       ? nullptr
+                       : phi.second->hasConstantValue();
+            if (!same) continue;
+            phi.second->replaceAllUsesWith(same);
+            for (auto &name: names) {
+                if (name.second.value == phi.second) name.second.value = same;
+            }
+            phi.second->eraseFromParent();
+            removed.insert(phi.second);
+            changed = true;
+        }
+    }
+}
+
 llvm::Value *ExpressionGenerator::operator()(const AST::NumberLiteral &num) {
     /* Create a floating-point constant with this value in this context. */
     return llvm::ConstantFP::get(context, llvm::APFloat(num.val));
 }
 
 llvm::Value *ExpressionGenerator::operator()(const AST::VariableName &var) {
-    /* Just look up the value corresponding to this name (an address on the
-     * stack) */
-    auto result = names[var.name];
-    if (!result) {
+    /* Just look up the variable of this name, and get its value. */
+    auto it = names.find(var.name);
+    if (it == names.end()) {
         _throw("unknown variable name (" + var.name + ")", var.info);
     }
-    /* and load it. */
-    return builder.CreateLoad(result, var.name.c_str());
+    return load(var.name, it->second);
 }
 
 llvm::Value *ExpressionGenerator::operator()
        (const std::unique_ptr<AST::BinaryOp> &op) {
     if (op->op == '=') {
+        /* Storing into an array element. */
+        if (auto *elt = boost::get<std::unique_ptr<AST::ArrayIndex>>(
+                    &op->lhs)) {
+            auto addr = element_address(**elt);
+            auto val = visit_number(op->rhs, false);
+            if (!val) return nullptr;
+            builder.CreateStore(val, addr);
+            return val;
+        }
+
         auto *varname = boost::get<AST::VariableName>(&op->lhs);
         if (!varname) {
             _throw("left side of assignment must be lvalue",
                    AST::get_info(op->lhs));
         }
-        auto val = boost::apply_visitor(*this, op->rhs);
+        auto val = visit(op->rhs, false);
         if (!val) return nullptr;
 
-        auto var = names[varname->name];
-        if (!var) {
+        auto it = names.find(varname->name);
+        if (it == names.end()) {
             _throw("unknown variable " + varname->name, varname->info);
         }
+        auto &var = it->second;
+        check_assignable(varname->name, var, op->info);
+        auto *type = var.type;
+        if (val->getType()->isPointerTy() != type->isPointerTy()
+         || (type->isPointerTy() && val->getType() != type)) {
+            _throw("cannot assign " + describe(val->getType()) + " to "
+                 + varname->name + ", which is " + describe(type), op->info);
+        }
 
-        builder.CreateStore(val, var);
+        store(var, val);
         return val;
     }
 
-    /* Get the LLVM values for left and right. */
-    llvm::Value *l = boost::apply_visitor(*this, op->lhs);
-    llvm::Value *r = boost::apply_visitor(*this, op->rhs);
+    if (op->op == tok_and || op->op == tok_or) return logical(*op);
+
+    /* Get the LLVM values for left and right, which may be integers or
+     * booleans (see `infer_integers`). */
+    llvm::Value *l = visit_scalar(op->lhs, false);
+    llvm::Value *r = visit_scalar(op->rhs, false);
     if (!l || !r) return nullptr;
 
     switch(op->op) {
     case '+':
-        return builder.CreateFAdd(l, r, "addtmp");
+        if (integer_operands(l, r)) {
+            return builder.CreateAdd(to_integer(l), to_integer(r), "addtmp",
+                                     false, true);
+        }
+        return builder.CreateFAdd(to_double(l), to_double(r), "addtmp");
     case '-':
-        return builder.CreateFSub(l, r, "subtmp");
+        if (integer_operands(l, r)) {
+            return builder.CreateSub(to_integer(l), to_integer(r), "subtmp",
+                                     false, true);
+        }
+        return builder.CreateFSub(to_double(l), to_double(r), "subtmp");
     case '*':
-        return builder.CreateFMul(l, r, "multmp");
+        /* Products of integers can soon get too big for doubles to hold
+         * exactly. */
+        return builder.CreateFMul(to_double(l), to_double(r), "multmp");
     case '/':
-        return builder.CreateFDiv(l, r, "divtmp");
+        return builder.CreateFDiv(to_double(l), to_double(r), "divtmp");
     case '<':
-        l = builder.CreateFCmpULT(l, r, "cmptmp");
-        /* Convert bool 0/1 to double 0.0 or 1.0 */
-        return builder.CreateUIToFP(
-                l, llvm::Type::getDoubleTy(context), "booltmp");
+        return less_than(l, r);
+    case '>':
+        return less_than(r, l);
+    case tok_le:
+    case tok_ge:
+    case tok_eq:
+    case tok_ne:
+        return compare(op->op, l, r);
     default:
         _throw(std::string("invalid binary operator (")
-             + op->op + ")", op->info);
+             + (char)op->op + ")", op->info);
     }
 }
 
@@ -139,209 +619,719 @@ llvm::Value *ExpressionGenerator::operator()(
     }
 
     std::vector<llvm::Value *> llvm_args;
+    auto param_types = llvm_func->getFunctionType()->params();
     for (unsigned i = 0; i != call->args.size(); ++i) {
-        llvm_args.push_back(boost::apply_visitor(*this, call->args[i]));
-        if (!llvm_args.back()) return nullptr;
+        auto *arg = visit(call->args[i], false);
+        if (!arg) return nullptr;
+        /* Functions take numbers as doubles. */
+        if (!arg->getType()->isPointerTy()) arg = to_double(arg);
+        llvm_args.push_back(arg);
+        if (llvm_args.back()->getType() != param_types[i]) {
+            _throw("argument " + std::to_string(i + 1) + " of "
+                 + call->fname + " should be " + describe(param_types[i]),
+                   AST::get_info(call->args[i]));
+        }
+    }
+
+    auto *result = builder.CreateCall(llvm_func, llvm_args, "calltmp");
+    if (tail) {
+        /* Nothing happens between this call and the return, so the callee
+         * may reuse our frame (and TailCallElimination can turn
+         * self-recursion into a loop). */
+        result->setTailCall();
+    } else if (opts.warn_non_tail_recursion
+            && llvm_func == builder.GetInsertBlock()->getParent()) {
+        warnings.push_back(Error("Warning",
+                                 "recursive call to " + call->fname
+                               + " is not in tail position",
+                                 call->info, Severity::warning));
     }
 
-    return builder.CreateCall(llvm_func, llvm_args, "calltmp");
+    return result;
 }
 
 llvm::Value *ExpressionGenerator::operator()(
         const std::unique_ptr<AST::IfThenElse> &if_) {
 
-    /* Generate code for the condition. */
-    llvm::Value *cond = to_cond(boost::apply_visitor(*this, if_->cond));
-    if (!cond) return nullptr;
-
     /* Get the parent function (so that the builder knows where to do stuff).
     */
     llvm::Function *parent = builder.GetInsertBlock()->getParent();
 
     /* Create a then block (with nothing in it), so that we can reference it
-     * in the branch.  Note that this actually emits the block. */
-    auto *then_bb = llvm::BasicBlock::Create(context, "then", parent);
+     * in the branch. */
+    auto *then_bb = llvm::BasicBlock::Create(context, "then");
     /* Ditto with else. */
     auto *else_bb = llvm::BasicBlock::Create(context, "else");
     /* Block jumped to after `then_bb` or `else_bb`. */
     auto *merge_bb = llvm::BasicBlock::Create(context, "merge");
-    /* Create a conditional branch that jumps to one of the above blocks. */
-    builder.CreateCondBr(cond, then_bb, else_bb);
-
-    /* Generate code for the "then" block. */
+    /* Generate code for the condition, which jumps to one of the above
+     * blocks. */
+    if (!gen_branch(if_->cond, then_bb, else_bb)) return nullptr;
+    /* Each side starts with the variables as they are now. */
+    auto before = names;
+
+    /* Emit the "then" block, and generate code for it. */
+    parent->getBasicBlockList().push_back(then_bb);
     builder.SetInsertPoint(then_bb);
-    llvm::Value *then = boost::apply_visitor(*this, if_->then);
+    llvm::Value *then = visit_scalar(if_->then, tail);
     if (!then) return nullptr;
 
     /* After "then" is done, jump (past "else") to "merge". */
     builder.CreateBr(merge_bb);
     then_bb = builder.GetInsertBlock();
+    auto after_then = names;
+    names = before;
 
     /* Emit the "else" block. */
     parent->getBasicBlockList().push_back(else_bb);
 
     /* Generate code for the "then" block. */
     builder.SetInsertPoint(else_bb);
-    llvm::Value *else_ = boost::apply_visitor(*this, if_->else_);
+    llvm::Value *else_ = visit_scalar(if_->else_, tail);
     if (!else_) return nullptr;
 
     builder.CreateBr(merge_bb);
     else_bb = builder.GetInsertBlock();
 
+    /* Both sides have to be converted to the same type, at their ends. */
+    auto *type = llvm::Type::getDoubleTy(context);
+    if (then->getType()->isIntegerTy(1) && else_->getType()->isIntegerTy(1)) {
+        type = then->getType();
+    } else if (integer_operands(then, else_)) {
+        type = llvm::Type::getInt64Ty(context);
+    }
+    builder.SetInsertPoint(then_bb->getTerminator());
+    then = convert(then, type);
+    builder.SetInsertPoint(else_bb->getTerminator());
+    else_ = convert(else_, type);
+
     /* Emit the "merge" block. */
     parent->getBasicBlockList().push_back(merge_bb);
 
     /* Generate code for the "merge" block. */
     builder.SetInsertPoint(merge_bb);
     /* This block just returns the result of a phi node. */
-    llvm::PHINode *pn = builder.CreatePHI(llvm::Type::getDoubleTy(context),
-                                          2, "iftemp");
+    llvm::PHINode *pn = builder.CreatePHI(type, 2, "iftemp");
     pn->addIncoming(then, then_bb);
     pn->addIncoming(else_, else_bb);
+    merge(after_then, then_bb, else_bb);
 
     return pn;
 }
 
 llvm::Value *ExpressionGenerator::operator()(
         const std::unique_ptr<AST::ForLoop> &loop) {
+    if (loop->parallel) return parallel_for(*loop);
+    if (loop->reduce_op) return counted_for(*loop);
+
     llvm::Function *parent = builder.GetInsertBlock()->getParent();
     auto *loop_bb = llvm::BasicBlock::Create(context, "loop", parent);
     auto *exit_bb = llvm::BasicBlock::Create(context, "loop_exit");
-    auto start = boost::apply_visitor(*this, loop->start);
-
+    auto start = visit_scalar(loop->start, false);
+    if (!start) return nullptr;
+
+    /* An integer if it only takes whole values (see `infer_integers`). */
+    bool integer = integers.contains(*loop);
+    auto *index_type = integer? llvm::Type::getInt64Ty(context)
+                              : llvm::Type::getDoubleTy(context);
+    /* Bind the loop index to the starting value, once, before entering
+     * the loop. */
+    auto outer = names;
+    names[loop->index_var] = bind(loop->index_var, start, index_type);
+    auto *pre_bb = builder.GetInsertBlock();
     builder.CreateBr(loop_bb);
 
     builder.SetInsertPoint(loop_bb);
-    auto loop_idx_addr = create_alloca(parent, loop->index_var, context);
-    /* Store starting value into loop index. */
-    builder.CreateStore(start, loop_idx_addr);
-
-    auto old_val = names[loop->index_var];
-    /* Delay adding the other incoming until we finish "loop". */
-    names[loop->index_var] = loop_idx_addr;
+    /* Delay adding the other incomings until we finish "loop". */
+    auto assigned = assignments({&loop->body, &loop->step, &loop->end});
+    assigned.insert(loop->index_var);
+    auto phis = loop_phis(assigned, pre_bb);
 
     /* Discard value body evaluates to. */
-    if (!boost::apply_visitor(*this, loop->body)) return nullptr;
+    if (!visit(loop->body, false)) return nullptr;
 
     /* Get the loop increment. */
-    auto step = boost::apply_visitor(*this, loop->step);
+    auto step = visit_scalar(loop->step, false);
+    if (!step) return nullptr;
 
     /* Get the current value of the loop index. */
-    auto cur = builder.CreateLoad(loop_idx_addr);
+    auto &index = names[loop->index_var];
+    auto cur = load(loop->index_var, index);
 
     /* Add them to get the next index. */
-    auto next = builder.CreateFAdd(cur, step);
+    auto next = integer? builder.CreateAdd(cur, to_integer(step), "", false,
+                                           true)
+                       : builder.CreateFAdd(cur, to_double(step));
 
     /* Store that in the loop index. */
-    builder.CreateStore(next, loop_idx_addr);
+    store(index, next);
 
-    auto end = to_cond(boost::apply_visitor(*this, loop->end));
-    if (!end) return nullptr;
-
-    builder.CreateCondBr(end, loop_bb, exit_bb);
+    if (!gen_branch(loop->end, loop_bb, exit_bb)) return nullptr;
+    close_loop(phis);
 
     builder.SetInsertPoint(exit_bb);
 
     parent->getBasicBlockList().push_back(exit_bb);
 
     /* Delete the index variable from the environment. */
-    if (old_val) {
-        names[loop->index_var] = old_val;
-    } else {
-        names.erase(loop->index_var);
-    }
+    unbind(loop->index_var, outer);
     
     return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(context));
 }
 
+static const char *parallel_reason = " in the body of a parfor loop, whose "
+    "iterations run in parallel (unless it is a reduction variable)";
+
+void ExpressionGenerator::check_assignable(const std::string &name,
+                                           const Variable &var,
+                                           ErrorInfo info) {
+    if (var.read_only) {
+        _throw("cannot assign to " + name + var.read_only, info);
+    }
+}
+
+llvm::Value *ExpressionGenerator::count_iterations(const AST::ForLoop &loop,
+                                                   llvm::Value *&start,
+                                                   llvm::Value *&step) {
+    auto *double_ty = llvm::Type::getDoubleTy(context);
+    auto *i64 = llvm::Type::getInt64Ty(context);
+    auto *zero = llvm::ConstantFP::get(context, llvm::APFloat(0.0));
+
+    auto *cond = boost::get<std::unique_ptr<AST::BinaryOp>>(&loop.end);
+    auto *cond_var = cond && (*cond)->op == '<'
+                   ? boost::get<AST::VariableName>(&(*cond)->lhs)
+                   : nullptr;
+    if (!cond_var || cond_var->name != loop.index_var) {
+        _throw(std::string("the condition of a ")
+             + (loop.parallel? "parfor": "reducing") + " loop must be "
+             + loop.index_var + " < limit", AST::get_info(loop.end));
+    }
+    /* Left as they are, in case the index is an integer. */
+    start = visit_scalar(loop.start, false);
+    auto limit = visit_number((*cond)->rhs, false);
+    step = visit_scalar(loop.step, false);
+    if (!start || !limit || !step) return nullptr;
+
+    /* (limit - start) / step of them, rounded up (without calling `ceil`,
+     * which may need libm), unless that isn't a (sensibly sized) positive
+     * number. */
+    auto *span = builder.CreateFDiv(
+            builder.CreateFSub(limit, to_double(start)), to_double(step),
+            "span");
+    auto *countable = builder.CreateAnd(
+            builder.CreateFCmpOGT(span, zero),
+            builder.CreateFCmpOLT(span, llvm::ConstantFP::get(double_ty,
+                                                              4e18)));
+    auto *whole = builder.CreateFPToSI(span, i64);
+    auto *partial = builder.CreateFCmpOLT(
+            builder.CreateSIToFP(whole, double_ty), span);
+    return builder.CreateSelect(
+            countable, builder.CreateAdd(whole,
+                                         builder.CreateZExt(partial, i64)),
+            llvm::ConstantInt::get(i64, 0), "iterations");
+}
+
+llvm::Value *ExpressionGenerator::reduction_identity(char op) {
+    double identity = op == '*'? 1.0
+                    : op == '<'? HUGE_VAL
+                    : op == '>'? -HUGE_VAL
+                    : 0.0;
+    return llvm::ConstantFP::get(llvm::Type::getDoubleTy(context), identity);
+}
+
+llvm::Value *ExpressionGenerator::combine(char op, llvm::Value *acc,
+                                          llvm::Value *val) {
+    llvm::IRBuilderBase::FastMathFlagGuard guard(builder);
+    if (opts.associative_math) {
+        llvm::FastMathFlags fmf;
+        fmf.setUnsafeAlgebra();
+        builder.setFastMathFlags(fmf);
+    }
+    switch (op) {
+    case '*':
+        return builder.CreateFMul(acc, val, "product");
+    case '<':
+    case '>': {
+        auto *better = op == '<'? builder.CreateFCmpOLT(val, acc)
+                                : builder.CreateFCmpOGT(val, acc);
+        /* Like the runtime (and `fmin` and `fmax`), ignore NaNs.  With
+         * associative math, the fast-math flags on the compare and select
+         * tell LLVM it sees none instead, so that it recognizes the loop
+         * as a reduction (not "no-nans-fp-math", which would apply to the
+         * whole function). */
+        if (!opts.associative_math) {
+            better = builder.CreateOr(better, builder.CreateFCmpUNO(acc, acc));
+        }
+        return builder.CreateSelect(better, val, acc,
+                                    op == '<'? "min": "max");
+    }
+    case '+':
+    default:
+        return builder.CreateFAdd(acc, val, "sum");
+    }
+}
+
+llvm::Value *ExpressionGenerator::counted_index(const AST::ForLoop &loop,
+                                                llvm::Value *start,
+                                                llvm::Value *step,
+                                                llvm::Value *iteration) {
+    if (integers.contains(loop)) {
+        return builder.CreateAdd(
+                to_integer(start),
+                builder.CreateMul(iteration, to_integer(step), "", false,
+                                  true),
+                loop.index_var, false, true);
+    }
+    return builder.CreateFAdd(
+            to_double(start),
+            builder.CreateFMul(builder.CreateSIToFP(
+                                       iteration,
+                                       llvm::Type::getDoubleTy(context)),
+                               to_double(step)),
+            loop.index_var);
+}
+
+llvm::Value *ExpressionGenerator::counted_for(const AST::ForLoop &loop) {
+    auto *double_ty = llvm::Type::getDoubleTy(context);
+    auto *i64 = llvm::Type::getInt64Ty(context);
+    llvm::Function *parent = builder.GetInsertBlock()->getParent();
+
+    llvm::Value *start, *step;
+    auto *iterations = count_iterations(loop, start, step);
+    if (!iterations) return nullptr;
+    auto *identity = reduction_identity(loop.reduce_op);
+
+    auto *pre_bb = builder.GetInsertBlock();
+    auto *loop_bb = llvm::BasicBlock::Create(context, "loop", parent);
+    auto *exit_bb = llvm::BasicBlock::Create(context, "loop_exit");
+    auto before = names;
+    builder.CreateCondBr(
+            builder.CreateICmpSGT(iterations, llvm::ConstantInt::get(i64, 0)),
+            loop_bb, exit_bb);
+
+    /* Counting in integers gives LLVM a loop it can vectorize. */
+    builder.SetInsertPoint(loop_bb);
+    auto *iteration = builder.CreatePHI(i64, 2, "iteration");
+    auto *total = builder.CreatePHI(double_ty, 2, "total");
+    iteration->addIncoming(llvm::ConstantInt::get(i64, 0), pre_bb);
+    total->addIncoming(identity, pre_bb);
+    auto assigned = assignments({&loop.body});
+    assigned.erase(loop.index_var);
+    auto phis = loop_phis(assigned, pre_bb);
+    names[loop.index_var] = bind(
+            loop.index_var, counted_index(loop, start, step, iteration),
+            integers.contains(loop)? i64: double_ty,
+            ", the index of a reducing loop (whose iterations are counted "
+            "before any of them run)");
+
+    auto *val = visit_number(loop.body, false);
+    if (!val) return nullptr;
+    auto *next_total = combine(loop.reduce_op, total, val);
+    auto *next = builder.CreateAdd(iteration, llvm::ConstantInt::get(i64, 1),
+                                   "next", false, true);
+    auto *latch_bb = builder.GetInsertBlock();
+    iteration->addIncoming(next, latch_bb);
+    total->addIncoming(next_total, latch_bb);
+    builder.CreateCondBr(builder.CreateICmpSLT(next, iterations),
+                         loop_bb, exit_bb);
+    close_loop(phis);
+
+    parent->getBasicBlockList().push_back(exit_bb);
+    builder.SetInsertPoint(exit_bb);
+    auto *result = builder.CreatePHI(double_ty, 2, "reduction");
+    result->addIncoming(identity, pre_bb);
+    result->addIncoming(next_total, latch_bb);
+
+    /* The loop may not have run at all. */
+    unbind(loop.index_var, before);
+    merge(before, pre_bb, latch_bb);
+    return result;
+}
+
+llvm::Value *ExpressionGenerator::parallel_for(const AST::ForLoop &loop) {
+    auto *double_ty = llvm::Type::getDoubleTy(context);
+    auto *double_ptr = llvm::Type::getDoublePtrTy(context);
+    auto *i8_ptr = llvm::Type::getInt8PtrTy(context);
+    auto *i32 = llvm::Type::getInt32Ty(context);
+    auto *i64 = llvm::Type::getInt64Ty(context);
+    auto *zero = llvm::ConstantFP::get(context, llvm::APFloat(0.0));
+    llvm::Function *parent = builder.GetInsertBlock()->getParent();
+
+    /* The iterations have to be counted before any of them run. */
+    llvm::Value *start, *step;
+    auto *iterations = count_iterations(loop, start, step);
+    if (!iterations) return nullptr;
+
+    std::vector<std::string> reduction_vars;
+    std::string ops;
+    for (auto &reduction: loop.reductions) {
+        auto it = names.find(reduction.var);
+        if (it == names.end()) {
+            _throw("unknown reduction variable (" + reduction.var + ")",
+                   reduction.info);
+        }
+        if (reduction.var == loop.index_var) {
+            _throw("cannot reduce into the loop index", reduction.info);
+        }
+        if (!it->second.type->isDoubleTy()) {
+            _throw("reduction variable " + reduction.var
+                 + " must be a number", reduction.info);
+        }
+        if (std::count(reduction_vars.begin(), reduction_vars.end(),
+                       reduction.var)) {
+            _throw(reduction.var + " is reduced more than once",
+                   reduction.info);
+        }
+        check_assignable(reduction.var, it->second, reduction.info);
+        reduction_vars.push_back(reduction.var);
+        ops += reduction.op;
+    }
+
+    /* The body gets a copy of everything in scope (and LLVM deletes what it
+     * doesn't use), after the start and step. */
+    std::vector<std::string> captured;
+    std::vector<llvm::Type *> fields = {start->getType(), step->getType()};
+    for (auto &name: names) {
+        captured.push_back(name.first);
+        fields.push_back(name.second.type);
+    }
+    auto *env_type = llvm::StructType::get(context, fields);
+    auto *body = outline_parallel_body(loop, env_type, captured);
+    if (!body) return nullptr;
+
+    auto *env = create_alloca(parent, "env", env_type);
+    builder.CreateStore(start, builder.CreateStructGEP(env_type, env, 0));
+    builder.CreateStore(step, builder.CreateStructGEP(env_type, env, 1));
+    for (unsigned i = 0; i < captured.size(); ++i) {
+        builder.CreateStore(load(captured[i], names[captured[i]]),
+                            builder.CreateStructGEP(env_type, env, i + 2));
+    }
+
+    /* The loop's own value is reduced after the variables. */
+    std::vector<llvm::Value *> initial;
+    for (auto &var: reduction_vars) {
+        initial.push_back(load(var, names[var]));
+    }
+    if (loop.reduce_op) {
+        initial.push_back(reduction_identity(loop.reduce_op));
+        ops += loop.reduce_op;
+    }
+
+    llvm::Value *results = llvm::ConstantPointerNull::get(double_ptr);
+    llvm::Value *ops_str = llvm::ConstantPointerNull::get(i8_ptr);
+    if (!initial.empty()) {
+        auto *results_type = llvm::ArrayType::get(double_ty, initial.size());
+        auto *results_array = create_alloca(parent, "reductions",
+                                            results_type);
+        for (unsigned i = 0; i < initial.size(); ++i) {
+            builder.CreateStore(
+                    initial[i],
+                    builder.CreateConstInBoundsGEP2_32(results_type,
+                                                       results_array, 0, i));
+        }
+        results = builder.CreateConstInBoundsGEP2_32(results_type,
+                                                     results_array, 0, 0);
+        ops_str = builder.CreateGlobalStringPtr(ops, "reduce_ops");
+    }
+
+    /* See runtime/kalrt.h. */
+    auto *runtime_type = llvm::FunctionType::get(
+            llvm::Type::getVoidTy(context),
+            {i64, i64, body->getType(), i8_ptr, i32, i8_ptr, double_ptr},
+            false);
+    builder.CreateCall(
+            module.getOrInsertFunction("kalrt_parfor", runtime_type),
+            {iterations, llvm::ConstantInt::get(i64, loop.chunk), body,
+             builder.CreateBitCast(env, i8_ptr),
+             llvm::ConstantInt::get(i32, initial.size()), ops_str,
+             results});
+
+    for (unsigned i = 0; i < reduction_vars.size(); ++i) {
+        store(names[reduction_vars[i]],
+              builder.CreateLoad(builder.CreateConstInBoundsGEP1_32(
+                      double_ty, results, i)));
+    }
+
+    if (!loop.reduce_op) return zero;
+    return builder.CreateLoad(builder.CreateConstInBoundsGEP1_32(
+            double_ty, results, reduction_vars.size()), "reduction");
+}
+
+llvm::Function *ExpressionGenerator::outline_parallel_body(
+        const AST::ForLoop &loop, llvm::StructType *env_type,
+        const std::vector<std::string> &captured) {
+    auto *double_ty = llvm::Type::getDoubleTy(context);
+    auto *i64 = llvm::Type::getInt64Ty(context);
+    llvm::Function *parent = builder.GetInsertBlock()->getParent();
+
+    /* A `kalrt_body`, run on a range of iterations. */
+    auto *type = llvm::FunctionType::get(
+            llvm::Type::getVoidTy(context),
+            {llvm::Type::getInt8PtrTy(context), i64, i64,
+             llvm::Type::getDoublePtrTy(context)},
+            false);
+    auto *body = llvm::Function::Create(type,
+                                        llvm::Function::InternalLinkage,
+                                        parent->getName() + ".parfor",
+                                        &module);
+    auto arg = body->arg_begin();
+    llvm::Value *env_arg = &*arg++, *begin = &*arg++, *end = &*arg++,
+                *acc = &*arg++;
+    env_arg->setName("env");
+    begin->setName("begin");
+    end->setName("end");
+    acc->setName("acc");
+
+    llvm::IRBuilderBase::InsertPointGuard guard(builder);
+    auto outer_names = names;
+    llvm::Value *result = nullptr;
+    try {
+        auto *entry_bb = llvm::BasicBlock::Create(context, "entry", body);
+        auto *loop_bb = llvm::BasicBlock::Create(context, "loop", body);
+        auto *exit_bb = llvm::BasicBlock::Create(context, "loop_exit");
+        builder.SetInsertPoint(entry_bb);
+
+        /* Unpack the environment into variables of our own, which can't be
+         * assigned to (the loop's effects would depend on the order its
+         * iterations ran in). */
+        auto *env = builder.CreateBitCast(env_arg, env_type->getPointerTo(),
+                                          "env");
+        names.clear();
+        for (unsigned i = 0; i < captured.size(); ++i) {
+            names[captured[i]] = bind(
+                    captured[i],
+                    builder.CreateLoad(builder.CreateStructGEP(
+                            env_type, env, i + 2), captured[i].c_str()),
+                    env_type->getElementType(i + 2), parallel_reason);
+        }
+        auto *start = builder.CreateLoad(
+                builder.CreateStructGEP(env_type, env, 0), "start");
+        auto *step = builder.CreateLoad(
+                builder.CreateStructGEP(env_type, env, 1), "step");
+
+        /* Reduction variables accumulate this range's contributions. */
+        for (unsigned i = 0; i < loop.reductions.size(); ++i) {
+            auto &name = loop.reductions[i].var;
+            names[name] = bind(
+                    name,
+                    builder.CreateLoad(builder.CreateConstInBoundsGEP1_32(
+                            double_ty, acc, i)),
+                    double_ty);
+        }
+        /* As does the loop's own value, which has no name. */
+        unsigned named = loop.reductions.size();
+        llvm::Value *initial_total = nullptr;
+        if (loop.reduce_op) {
+            initial_total = builder.CreateLoad(
+                    builder.CreateConstInBoundsGEP1_32(double_ty, acc, named));
+        }
+        /* The runtime never passes an empty range. */
+        builder.CreateBr(loop_bb);
+
+        builder.SetInsertPoint(loop_bb);
+        auto *iteration = builder.CreatePHI(i64, 2, "iteration");
+        iteration->addIncoming(begin, entry_bb);
+        llvm::PHINode *total = nullptr;
+        if (initial_total) {
+            total = builder.CreatePHI(double_ty, 2, "total");
+            total->addIncoming(initial_total, entry_bb);
+        }
+        auto assigned = assignments({&loop.body});
+        assigned.erase(loop.index_var);
+        auto phis = loop_phis(assigned, entry_bb);
+        names[loop.index_var] = bind(
+                loop.index_var, counted_index(loop, start, step, iteration),
+                integers.contains(loop)? i64: double_ty, parallel_reason);
+
+        /* Discard value body evaluates to, unless it is reduced. */
+        llvm::Value *next_total = nullptr;
+        if (total) {
+            result = visit_number(loop.body, false);
+            if (result) next_total = combine(loop.reduce_op, total, result);
+        } else {
+            result = visit(loop.body, false);
+        }
+        if (result) {
+            auto *next = builder.CreateAdd(
+                    iteration, llvm::ConstantInt::get(i64, 1), "next",
+                    false, true);
+            auto *latch_bb = builder.GetInsertBlock();
+            iteration->addIncoming(next, latch_bb);
+            if (total) total->addIncoming(next_total, latch_bb);
+            builder.CreateCondBr(builder.CreateICmpSLT(next, end),
+                                 loop_bb, exit_bb);
+            close_loop(phis);
+
+            body->getBasicBlockList().push_back(exit_bb);
+            builder.SetInsertPoint(exit_bb);
+            for (unsigned i = 0; i < loop.reductions.size(); ++i) {
+                auto &name = loop.reductions[i].var;
+                builder.CreateStore(
+                        load(name, names[name]),
+                        builder.CreateConstInBoundsGEP1_32(double_ty, acc,
+                                                           i));
+            }
+            if (total) {
+                builder.CreateStore(
+                        next_total,
+                        builder.CreateConstInBoundsGEP1_32(double_ty, acc,
+                                                           named));
+            }
+            builder.CreateRetVoid();
+        } else {
+            delete exit_bb;
+        }
+    } catch (Error) {
+        names = outer_names;
+        body->eraseFromParent();
+        throw;
+    }
+    names = outer_names;
+
+    if (!result) {
+        body->eraseFromParent();
+        return nullptr;
+    }
+    llvm::verifyFunction(*body);
+    parallel_bodies.push_back({body, loop.info});
+    return body;
+}
+
 llvm::Value *ExpressionGenerator::operator()
         (const std::unique_ptr<AST::LocalVar> &local) {
-    std::vector<llvm::AllocaInst *>old_bindings;
-    auto parent = builder.GetInsertBlock()->getParent();
+    /* The bindings these shadow, as they were when shadowed. */
+    Scope shadowed;
+    std::set<std::string> bound;
 
     for (auto &name: local->names) {
-        /* Store the old value. */
-        old_bindings.push_back(names[name.first]);
-        /* Allocate space for the new value. */
-        auto new_addr = create_alloca(parent, name.first, context);
         /* Get the new value as an instruction. */
-        auto start = boost::apply_visitor(*this, name.second);
-        /* Store it in the space. */
-        builder.CreateStore(start, new_addr);
-        /* Put the address in the names map. */
-        names[name.first] = new_addr;
+        auto start = visit(name.second, false);
+        if (!start) return nullptr;
+        /* Store the old binding. */
+        auto old = names.find(name.first);
+        if (bound.insert(name.first).second && old != names.end()) {
+            shadowed.insert(*old);
+        }
+        /* Bind the new value (which may be an array, or an integer; see
+         * `infer_integers`). */
+        auto *type = start->getType()->isPointerTy()
+                   ? start->getType()
+                   : integers.contains(name)
+                   ? llvm::Type::getInt64Ty(context)
+                   : llvm::Type::getDoubleTy(context);
+        names[name.first] = bind(name.first, start, type);
     }
 
-    auto ret = boost::apply_visitor(*this, local->body);
+    auto ret = visit(local->body, tail);
 
-    for (unsigned i = 0; i < local->names.size(); ++i) {
-        auto &name = local->names[i];
-        if (old_bindings[i]) {
-            names[name.first] = old_bindings[i];
-        } else {
-            names.erase(name.first);
-        }
-    }
+    for (auto &name: bound) unbind(name, shadowed);
 
     return ret; //std::move(ret);
 }
 
+llvm::Value *ExpressionGenerator::element_address(
+        const AST::ArrayIndex &elt) {
+    auto it = names.find(elt.array);
+    if (it == names.end()) {
+        _throw("unknown variable name (" + elt.array + ")", elt.info);
+    }
+    if (!it->second.type->isPointerTy()) {
+        _throw(elt.array + " is not an array", elt.info);
+    }
+    auto array = load(elt.array, it->second);
+    auto index = visit_scalar(elt.index, false);
+    if (!index) return nullptr;
+    /* Indices are truncated to integers, as by a C cast (unless they are
+     * integers already). */
+    auto offset = index->getType()->isIntegerTy()
+                ? to_integer(index)
+                : builder.CreateFPToSI(
+                        index, llvm::Type::getInt64Ty(context), "idx");
+    /* Kaleidoscope can't index outside of an array without undefined
+     * behaviour anyway, so let LLVM assume it doesn't. */
+    return builder.CreateInBoundsGEP(array, offset, "eltaddr");
+}
+
+llvm::Value *ExpressionGenerator::operator()
+        (const std::unique_ptr<AST::ArrayIndex> &elt) {
+    return builder.CreateLoad(element_address(*elt), "elt");
+}
+
 /*****************************************************************************
  * CodeGeneratorImpl implementations.
  */
 
-CodeGeneratorImpl::CodeGeneratorImpl(std::string name, std::string triple)
+CodeGeneratorImpl::CodeGeneratorImpl(std::string name,
+                                     std::shared_ptr<Target> target,
+                                     CodeGenOptions opts)
     : builder(context),
       module(llvm::make_unique<llvm::Module>(name, context)),
-      expr_gen(ExpressionGenerator(context, builder, *module, names)) {
-    llvm::InitializeAllTargetInfos();
-    llvm::InitializeAllTargets();
-    llvm::InitializeAllTargetMCs();
-    llvm::InitializeAllAsmParsers();
-    llvm::InitializeAllAsmPrinters();
-
-	std::string error;
-	auto target_triple = llvm::Triple(triple);
-	/* TODO: Allow target-specific information. */
-    auto llvm_target =
-        llvm::TargetRegistry::lookupTarget("", target_triple, error);
-
-	// Print an error and exit if we couldn't find the requested target.
-	// This generally occurs if we've forgotten to initialise the
-	// TargetRegistry or we have a bogus target triple.
-
-	/* TODO: fix this to properly handle the error. */
-	if (!llvm_target) {
-	    llvm::errs() << error;
-	}
-
-    /* TODO: give a more specific CPU. */
-    auto cpu = "generic";
-    auto features = "";
-    llvm::TargetOptions options;
-    auto reloc_model = llvm::Reloc::Model();
-    
-    target = llvm_target->createTargetMachine(triple, cpu, features,
-                                              options, reloc_model);
-    module->setDataLayout(target->createDataLayout());
-    module->setTargetTriple(triple);
+      target(target),
+      opts(opts),
+      optimized(false),
+      expr_gen(ExpressionGenerator(context, builder, *module, names,
+                                   this->opts, warnings, parallel_bodies,
+                                   integers)) {
+    if (opts.time_passes) llvm::TimePassesIsEnabled = true;
+
+    module->setDataLayout(target->machine().createDataLayout());
+    module->setTargetTriple(target->triple());
 }
 
 llvm::Function *CodeGeneratorImpl::operator()
        (const std::unique_ptr<AST::FunctionPrototype> &func) {
     assert(func);
-    std::vector<llvm::Type *> doubles(func->args.size(),
-                                      llvm::Type::getDoubleTy(context));
+    /* Declaring a function more than once (e.g. in several files) is fine,
+     * as long as the declarations agree. */
+    std::vector<llvm::Type *> arg_types;
+    for (auto type: func->arg_types) {
+        arg_types.push_back(llvm_type(type, context));
+    }
     llvm::FunctionType *ft =
         llvm::FunctionType::get(llvm::Type::getDoubleTy(context),
-                                doubles, false);
+                                arg_types, false);
+
+    if (func->builtin) {
+        auto id = math_intrinsic(func->fname);
+        if (id == llvm::Intrinsic::not_intrinsic) {
+            _throw(func->fname + " is not a builtin function", func->info);
+        }
+        auto *intrinsic_type = llvm::Intrinsic::getType(
+                context, id, llvm::Type::getDoubleTy(context));
+        if (intrinsic_type != ft) {
+            _throw("builtin " + func->fname + " takes "
+                 + std::to_string(intrinsic_type->getNumParams())
+                 + " numbers", func->info);
+        }
+        builtins.insert(func->fname);
+    }
+
+    llvm::Function *existing = module->getFunction(func->fname);
+    if (existing && !func->fname.empty()) {
+        if (existing->arg_size() != func->args.size()) {
+            _throw("conflicting declaration of " + func->fname
+                 + " (previously declared with "
+                 + std::to_string(existing->arg_size()) + " arguments)",
+                   func->info);
+        }
+        if (existing->getFunctionType() != ft) {
+            _throw("conflicting declaration of " + func->fname
+                 + " (previously declared with different array arguments)",
+                   func->info);
+        }
+        return existing;
+    }
 
+    /* Anonymous top-level expressions can't be called from outside. */
     llvm::Function *result =
-            llvm::Function::Create(ft, llvm::Function::ExternalLinkage,
+            llvm::Function::Create(ft, func->fname.empty()
+                                           ? llvm::Function::InternalLinkage
+                                           : llvm::Function::ExternalLinkage,
                                    func->fname, module.get());
     unsigned i = 0;
     for (auto &arg: result->args())
         arg.setName(func->args[i++]);
+    if (!func->fname.empty()) declared.push_back(*func);
 
     return result;
 }
@@ -350,31 +1340,66 @@ llvm::Function *CodeGeneratorImpl::operator()
             (const std::unique_ptr<AST::FunctionDefinition> &f) {
     const AST::FunctionPrototype &proto = *f->proto;
     assert(module != nullptr);
-    // Check if the function is defined `extern`.
-    llvm::Function *result = module->getFunction(proto.fname);
-
-    if (!result) result = (*this)(f->proto);
+    /* Reuses any earlier (e.g. `extern`) declaration. */
+    llvm::Function *result = (*this)(f->proto);
 
     if (!result) return nullptr;
 
+    auto library = imported.find(proto.fname);
+    if (library != imported.end()) {
+        _throw("redefinition of function " + proto.fname + ", which "
+             + library->second + " defines", proto.info);
+    }
     if (!result->empty()) {
-        return (llvm::Function *)log_error("Function cannot be redefined.");
+        _throw("redefinition of function " + proto.fname, proto.info);
     }
+    if (builtins.count(proto.fname)) {
+        _throw("cannot define builtin function " + proto.fname, proto.info);
+    }
+    if (f->exported) exported.insert(proto.fname);
 
     llvm::BasicBlock *bb = llvm::BasicBlock::Create(context, "entry", result);
     builder.SetInsertPoint(bb);
 
     names.clear();
+    unsigned i = 0;
     for (auto &arg: result->args()) {
-        auto arg_addr = create_alloca(result, arg.getName(), context);
-        builder.CreateStore(&arg, arg_addr);
-        names[arg.getName()] = arg_addr;
+        /* Use this definition's names, not the declaration's. */
+        const std::string &name = proto.args[i++];
+        arg.setName(name);
+        names[name] = expr_gen.bind(name, &arg, arg.getType());
     }
 
-    if (llvm::Value *ret = boost::apply_visitor(expr_gen, f->body)) {
-        builder.CreateRet(ret);
+    integers = infer_integers(*f);
+    llvm::Value *ret;
+    try {
+        ret = expr_gen.visit_number(f->body, true);
+    } catch (Error) {
+        /* Leave the declaration, so that later uses don't cause spurious
+         * errors. */
+        result->deleteBody();
+        throw;
+    }
+
+    if (ret) {
+        auto *ret_inst = builder.CreateRet(ret);
+
+        /* A call whose result is returned immediately, to a function with
+         * our signature, can be *guaranteed* to reuse our frame. */
+        auto *call = llvm::dyn_cast<llvm::CallInst>(ret);
+        if (call && call->getNextNode() == ret_inst) {
+            auto *callee = call->getCalledFunction();
+            if (callee->getFunctionType() == result->getFunctionType()
+             && callee->getCallingConv() == result->getCallingConv()) {
+                call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+            }
+        }
+
         llvm::verifyFunction(*result);
 
+        if (f->memo) {
+            memo_functions.push_back({result, f->memo_capacity, proto.info});
+        }
         return result;
     }
 
@@ -382,43 +1407,361 @@ llvm::Function *CodeGeneratorImpl::operator()
     return nullptr;
 }
 
+llvm::Function *CodeGeneratorImpl::declare(const AST::Declaration &decl) {
+    using AST::FunctionPrototype;
+    using AST::FunctionDefinition;
+    if (auto *proto = boost::get<std::unique_ptr<FunctionPrototype>>(&decl)) {
+        return (*this)(*proto);
+    }
+    if (auto *def = boost::get<std::unique_ptr<FunctionDefinition>>(&decl)) {
+        /* Anonymous top-level expressions can't be referenced anyway. */
+        if ((*def)->proto->fname.empty()) return nullptr;
+        return (*this)((*def)->proto);
+    }
+    return nullptr;
+}
+
+void CodeGeneratorImpl::use(const Library &library) {
+    const std::string &path = library.interface->name();
+    ErrorInfo info(library.interface, 0, 0);
+    if (library.triple != module->getTargetTriple()) {
+        _throw(path + " was compiled for " + library.triple + ", not "
+             + module->getTargetTriple(), info);
+    }
+    auto code = llvm::parseBitcodeFile(
+            llvm::MemoryBufferRef(library.bitcode, path), context);
+    if (!code) {
+        _throw("cannot read the code in " + path + ": "
+             + code.getError().message(), info);
+    }
+    for (auto &f: **code) {
+        if (f.isDeclaration()) continue;
+        auto name = f.getName().str();
+        auto other = imported.find(name);
+        if (other != imported.end()) {
+            _throw("both " + other->second + " and " + path + " define "
+                 + name, info);
+        }
+        imported[name] = path;
+    }
+    libraries.push_back(std::move(*code));
+}
+
 void CodeGeneratorImpl::run_passes(void) {
+    llvm::raw_os_ostream ll_stderr(std::cerr);
+    llvm::verifyModule(*module, &ll_stderr);
+
+    if (opts.opt_level == 0) return;
+
     auto fpm = std::make_unique<llvm::legacy::PassManager>();
+    // Tell the loop passes what the target's instructions cost (and how wide
+    // its vectors are).
+    fpm->add(llvm::createTargetTransformInfoWrapperPass(
+            target->machine().getTargetIRAnalysis()));
+    // Tell the vectorizer which math functions have vector versions (only
+    // the widths the target's registers hold get used, so each width's
+    // instruction set is there when it's called).
+    llvm::TargetLibraryInfoImpl library_info(
+            llvm::Triple(module->getTargetTriple()));
+    if (opts.vector_library == VectorLibrary::kalrt
+     && llvm::Triple(module->getTargetTriple()).getArch()
+            == llvm::Triple::x86_64) {
+        library_info.addVectorizableFunctions(KALRT_VECTOR_FUNCTIONS);
+    }
+    fpm->add(new llvm::TargetLibraryInfoWrapperPass(library_info));
     // Iterated dominance frontier to convert most `alloca`s to SSA register
-    // accesses.
-    fpm->add(llvm::createPromoteMemoryToRegisterPass());
+    // accesses (unless there are none to convert).
+    if (!opts.direct_ssa) {
+        fpm->add(llvm::createPromoteMemoryToRegisterPass());
+    }
     fpm->add(llvm::createInstructionCombiningPass());
-    // Reassociate expressions.
-    fpm->add(llvm::createReassociatePass());
-    // Eliminate Common SubExpressions.
-    fpm->add(llvm::createGVNPass());
+    // Turn self-recursive tail calls into loops.
+    fpm->add(llvm::createTailCallEliminationPass());
+    if (opts.opt_level >= 2) {
+        // Merge repeated calls to functions without side effects, before
+        // inlining makes copies of their bodies.
+        fpm->add(llvm::createEarlyCSEPass());
+        // Propagate constant arguments into internal functions, and
+        // constant results out of them.
+        fpm->add(llvm::createIPSCCPPass());
+        // Inline small functions, including across source files.
+        fpm->add(llvm::createFunctionInliningPass(opts.opt_level, 0));
+        // Delete internal functions that are no longer called.
+        fpm->add(llvm::createGlobalDCEPass());
+        // Hoist loop-invariant code (including calls to functions without
+        // side effects) out of loops.
+        fpm->add(llvm::createLICMPass());
+        // Reassociate expressions.
+        fpm->add(llvm::createReassociatePass());
+        // Eliminate Common SubExpressions.
+        fpm->add(llvm::createGVNPass());
+        // Put loops into the form the vectorizers want, with their exit
+        // tests at the bottom and integer induction variables.
+        fpm->add(llvm::createLoopRotatePass());
+        fpm->add(llvm::createIndVarSimplifyPass());
+        // Vectorize loops (including reductions, if they may be reordered),
+        // then straight-line code.
+        fpm->add(llvm::createLoopVectorizePass());
+        fpm->add(llvm::createSLPVectorizerPass());
+        fpm->add(llvm::createInstructionCombiningPass());
+        // Unroll what's left of small loops.
+        fpm->add(llvm::createLoopUnrollPass());
+    }
     // Simplify the control flow graph (deleting unreachable
     // blocks, etc).
     fpm->add(llvm::createCFGSimplificationPass());
-    llvm::raw_os_ostream ll_stderr(std::cerr);
-    llvm::verifyModule(*module, &ll_stderr);
 
     fpm->run(*module);
 }
 
+void CodeGeneratorImpl::lower_builtins(void) {
+    auto *double_ty = llvm::Type::getDoubleTy(context);
+    std::vector<std::pair<llvm::Function *, llvm::Intrinsic::ID>> lowered;
+    for (auto &f: *module) {
+        /* Functions defined here are the user's own, not the library's. */
+        if (!f.empty() || f.isIntrinsic()) continue;
+        auto name = f.getName().str();
+        if (!opts.builtins && !builtins.count(name)) continue;
+        auto id = math_intrinsic(name);
+        if (id == llvm::Intrinsic::not_intrinsic) continue;
+        /* E.g. `extern pow(x)` isn't the function we know. */
+        if (llvm::Intrinsic::getType(context, id, double_ty)
+                != f.getFunctionType()) {
+            continue;
+        }
+        lowered.push_back({&f, id});
+    }
+
+    for (auto &l: lowered) {
+        auto *intrinsic =
+            llvm::Intrinsic::getDeclaration(module.get(), l.second, double_ty);
+        for (auto *user: l.first->users()) {
+            /* Intrinsics don't have frames to reuse. */
+            auto *call = llvm::dyn_cast<llvm::CallInst>(user);
+            if (call && call->isMustTailCall()) {
+                call->setTailCallKind(llvm::CallInst::TCK_Tail);
+            }
+        }
+        l.first->replaceAllUsesWith(intrinsic);
+        l.first->eraseFromParent();
+    }
+}
+
+void CodeGeneratorImpl::internalize(void) {
+    for (auto &name: opts.exports) {
+        auto *f = module->getFunction(name);
+        if (f && !f->isDeclaration()) {
+            exported.insert(name);
+            continue;
+        }
+        auto option = "--export=" + name;
+        warnings.push_back(Error("Warning",
+                                 "cannot export " + name + ", which is not "
+                                 "defined",
+                                 ErrorInfo(std::make_shared<Source>(
+                                               "<command line>", option),
+                                           0, option.size()),
+                                 Severity::warning));
+    }
+    if (exported.empty()) return;
+
+    for (auto &f: *module) {
+        if (!f.isDeclaration() && !exported.count(f.getName().str())) {
+            f.setLinkage(llvm::GlobalValue::InternalLinkage);
+        }
+    }
+    /* Nor are they part of our library's interface. */
+    auto internal = [this](const AST::FunctionPrototype &proto) {
+        auto *f = module->getFunction(proto.fname);
+        return f && f->hasLocalLinkage();
+    };
+    declared.erase(std::remove_if(declared.begin(), declared.end(), internal),
+                   declared.end());
+}
+
+void CodeGeneratorImpl::link_libraries(void) {
+    for (auto &code: libraries) {
+        auto name = code->getModuleIdentifier();
+        if (llvm::Linker::linkModules(*module, std::move(code))) {
+            _throw("cannot link in the code of " + name,
+                   ErrorInfo(std::make_shared<Source>(name, ""), 0, 0));
+        }
+    }
+    libraries.clear();
+    /* Their own object code defines them. */
+    for (auto &i: imported) {
+        auto *f = module->getFunction(i.first);
+        if (f && !f->isDeclaration()) {
+            f->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        }
+    }
+}
+
+void CodeGeneratorImpl::memoize_functions(void) {
+    for (auto &memo: memo_functions) {
+        if (!memo.function->doesNotAccessMemory()) {
+            _throw("memo function " + memo.function->getName().str()
+                 + " must be pure, but it may call an extern or use an "
+                   "array", memo.info);
+        }
+    }
+    for (auto &memo: memo_functions) {
+        memoize(*memo.function,
+                memo.capacity? memo.capacity: opts.memo.capacity, opts.memo);
+    }
+    memo_functions.clear();
+}
+
+void CodeGeneratorImpl::check_parallel_bodies(void) {
+    for (auto &body: parallel_bodies) {
+        auto *f = body.function;
+        if (!f->doesNotAccessMemory() && !f->onlyAccessesArgMemory()) {
+            _throw("the body of a parfor loop may call an extern, so its "
+                   "iterations cannot safely run in parallel", body.info);
+        }
+    }
+    parallel_bodies.clear();
+}
+
+void CodeGeneratorImpl::optimize(void) {
+    if (optimized) return;
+    lower_builtins();
+    /* First, so that the functions made internal can use `fastcc`. */
+    internalize();
+    /* After, so that the libraries' functions aren't exported from here. */
+    link_libraries();
+    infer_attributes(*module);
+    check_parallel_bodies();
+    memoize_functions();
+    if (opts.profile_generate) instrument(*module);
+    if (!opts.profile_use.empty()) {
+        for (auto &w: apply_profile(*module, read_profile(opts.profile_use))) {
+            warnings.push_back(w);
+        }
+    }
+    run_passes();
+    optimized = true;
+}
+
+std::map<std::string, uint64_t> CodeGeneratorImpl::statistics(void) {
+    uint64_t functions = 0, instructions = 0;
+    for (auto &f: *module) {
+        if (f.empty()) continue;
+        ++functions;
+        for (auto &bb: f) instructions += bb.size();
+    }
+    return { {"functions", functions}, {"IR instructions", instructions} };
+}
+
+std::vector<Error> CodeGeneratorImpl::take_warnings(void) {
+    std::vector<Error> result;
+    result.swap(warnings);
+    return result;
+}
+
 void CodeGeneratorImpl::emit_ir(std::ostream &out) {
     llvm::raw_os_ostream llvm_out(out);
-    run_passes();
+    optimize();
     module->print(llvm_out, nullptr);
 }
 
-void CodeGeneratorImpl::emit_obj(int out) {
-    llvm::raw_fd_ostream llvm_out(out, false);
+/* Shared by both `emit_obj`s: the stream must support `pwrite`-style
+ * seeking, which `raw_fd_ostream` and `raw_svector_ostream` both do. */
+static void emit_obj_to(llvm::TargetMachine &machine, llvm::Module &module,
+                        llvm::raw_pwrite_stream &out) {
     llvm::legacy::PassManager pass;
-    run_passes();
     auto ft = llvm::TargetMachine::CGFT_ObjectFile;
 
-    if (target->addPassesToEmitFile(pass, llvm_out, ft)) {
+    if (machine.addPassesToEmitFile(pass, out, ft)) {
         llvm::errs() << "TargetMachine can't emit a file of this type";
     }
 
-    pass.run(*module);
+    pass.run(module);
+}
+
+void CodeGeneratorImpl::emit_obj(int out) {
+    llvm::raw_fd_ostream llvm_out(out, false);
+    optimize();
+    emit_obj_to(target->machine(), *module, llvm_out);
+    llvm_out.flush();
+}
+
+void CodeGeneratorImpl::emit_obj(std::ostream &out) {
+    llvm::SmallVector<char, 0> buffer;
+    llvm::raw_svector_ostream llvm_out(buffer);
+    optimize();
+    emit_obj_to(target->machine(), *module, llvm_out);
+    out.write(buffer.data(), buffer.size());
+}
+
+void CodeGeneratorImpl::emit_bc(int out, bool summary) {
+    llvm::raw_fd_ostream llvm_out(out, false);
+    optimize();
+    llvm::WriteBitcodeToFile(module.get(), llvm_out, false, summary);
+    llvm_out.flush();
+}
+
+void CodeGeneratorImpl::emit_bc(std::ostream &out, bool summary) {
+    llvm::SmallVector<char, 0> buffer;
+    llvm::raw_svector_ostream llvm_out(buffer);
+    optimize();
+    llvm::WriteBitcodeToFile(module.get(), llvm_out, false, summary);
+    out.write(buffer.data(), buffer.size());
+}
+
+void CodeGeneratorImpl::emit_kpm(int out) {
+    llvm::raw_fd_ostream llvm_out(out, false);
+    optimize();
+    write_library(llvm_out, *module, declared);
     llvm_out.flush();
 }
 
+void CodeGeneratorImpl::emit_kpm(std::ostream &out) {
+    llvm::raw_os_ostream llvm_out(out);
+    optimize();
+    write_library(llvm_out, *module, declared);
+}
+
+std::vector<void *> CodeGeneratorImpl::load(
+        const std::vector<std::string> &names) {
+    /* Calls to the C library are resolved to this process's copy. */
+    static std::once_flag process_loaded;
+    std::call_once(process_loaded, []() {
+        llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+    });
+    optimize();
+
+    ErrorInfo info(std::make_shared<Source>(module->getModuleIdentifier(),
+                                            ""), 0, 0);
+    /* MCJIT would abort the whole process on a call it couldn't resolve. */
+    for (auto &f: *module) {
+        if (!f.isDeclaration() || f.isIntrinsic() || f.use_empty()) continue;
+        auto name = f.getName().str();
+        if (!llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(name)) {
+            _throw("cannot load code calling " + name + ", which this "
+                   "process doesn't define", info);
+        }
+    }
+
+    std::string error;
+    engine.reset(llvm::EngineBuilder(std::move(module))
+                     .setErrorStr(&error)
+                     .setEngineKind(llvm::EngineKind::JIT)
+                     .setMCJITMemoryManager(
+                             llvm::make_unique<llvm::SectionMemoryManager>())
+                     .setOptLevel(target->machine().getOptLevel())
+                     /* It only ever runs here. */
+                     .setMCPU(llvm::sys::getHostCPUName())
+                     .create());
+    if (!engine) _throw("cannot load the code: " + error, info);
+    engine->finalizeObject();
+
+    std::vector<void *> result;
+    for (auto &name: names) {
+        result.push_back(reinterpret_cast<void *>(
+                engine->getFunctionAddress(name)));
+    }
+    return result;
+}
+
 }
@@ -1,11 +1,15 @@
 #pragma once
 
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <iostream>
+#include <vector>
 
 #include <boost/variant.hpp>
 #include "llvm/ADT/Triple.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
@@ -14,9 +18,56 @@
 #include "llvm/Target/TargetMachine.h"
 
 #include "AST.hh"
+#include "CodeGenerator.hh"
+#include "Library.hh"
+#include "Target.hh"
+#include "Types.hh"
 
 namespace Kaleidoscope {
 
+/**
+ * @brief The IR builder code generation uses.  Release builds (with
+ *        `NDEBUG`) don't name the values it creates (e.g. "addtmp"), which
+ *        only matter to people reading the IR.
+ */
+#ifdef NDEBUG
+typedef llvm::IRBuilder<false> Builder;
+#else
+typedef llvm::IRBuilder<> Builder;
+#endif
+
+/**
+ * @brief A variable in scope.
+ *
+ * Normally a variable lives in a stack slot, which LLVM's mem2reg pass turns
+ * into SSA values.  With `CodeGenOptions::direct_ssa` it is only its current
+ * value instead: assigning to it just changes which value that is, and phis
+ * merge its values where control flow joins.
+ */
+struct Variable {
+    /** Its slot, or null if it doesn't have one. */
+    llvm::AllocaInst *slot = nullptr;
+    /** Its current value, if it doesn't have a slot. */
+    llvm::Value *value = nullptr;
+    llvm::Type *type = nullptr;
+    /** Why it can't be assigned to (e.g. it is the index of a counted
+     *  loop), or null if it can. */
+    const char *read_only = nullptr;
+};
+
+/**
+ * @brief The variables in scope, by name.
+ */
+typedef std::map<std::string, Variable> Scope;
+
+/**
+ * @brief A function outlined from the body of a `parfor` loop.
+ */
+struct ParallelBody {
+    llvm::Function *function;
+    ErrorInfo info;
+};
+
 /**
  * @brief Visitor for AST nodes that evaluate directly to llvm::Values.
  */
@@ -36,10 +87,46 @@ public:
      * to the outside world) it is no problem.
      */
     ExpressionGenerator(llvm::LLVMContext &context,
-                        llvm::IRBuilder<> &builder,
+                        Builder &builder,
                         llvm::Module &module,
-                        std::map<std::string, llvm::AllocaInst *> &names) 
-        : context(context), builder(builder), module(module), names(names) {}
+                        Scope &names,
+                        const CodeGenOptions &opts,
+                        std::vector<Error> &warnings,
+                        std::vector<ParallelBody> &parallel_bodies,
+                        const IntegerVariables &integers)
+        : context(context), builder(builder), module(module), names(names),
+          opts(opts), warnings(warnings), parallel_bodies(parallel_bodies),
+          integers(integers), tail(false) {}
+
+    /**
+     * @brief Generate code for an expression.
+     *
+     * @param tail Whether the expression is in tail position, i.e. its value
+     *             is returned directly from the enclosing function.
+     */
+    llvm::Value *visit(const AST::Expression &, bool tail);
+
+    /**
+     * @brief Generate code for an expression, which must be a number (not
+     *        an array), as a `double`.
+     */
+    llvm::Value *visit_number(const AST::Expression &, bool tail);
+
+    /**
+     * @brief Generate code for an expression, which must be a number (not
+     *        an array), but may be an `i64` or `i1` if it is known to be
+     *        whole or boolean.
+     */
+    llvm::Value *visit_scalar(const AST::Expression &, bool tail);
+
+    /**
+     * @brief Make a new variable holding a value (of the given type), to be
+     *        put in scope.
+     *
+     * @param read_only Why it can't be assigned to, or null if it can.
+     */
+    Variable bind(const std::string &name, llvm::Value *, llvm::Type *,
+                  const char *read_only=nullptr);
 
     /**
      * @name Visitors
@@ -55,16 +142,61 @@ public:
     llvm::Value *operator() (const std::unique_ptr<AST::IfThenElse> &);
     llvm::Value *operator() (const std::unique_ptr<AST::ForLoop> &);
     llvm::Value *operator() (const std::unique_ptr<AST::LocalVar> &);
+    llvm::Value *operator() (const std::unique_ptr<AST::ArrayIndex> &);
 
     /**@}*/
 
 private:
-    llvm::Value *to_cond(llvm::Value *f);
+    llvm::Value *to_cond(llvm::Value *);
+    llvm::Value *to_double(llvm::Value *);
+    llvm::Value *to_integer(llvm::Value *);
+    llvm::Value *convert(llvm::Value *, llvm::Type *);
+    bool integer_operands(llvm::Value *l, llvm::Value *r);
+    llvm::Value *less_than(llvm::Value *l, llvm::Value *r);
+    llvm::Value *compare(int op, llvm::Value *l, llvm::Value *r);
+    llvm::Value *logical(const AST::BinaryOp &);
+    bool gen_branch(const AST::Expression &cond, llvm::BasicBlock *true_bb,
+                    llvm::BasicBlock *false_bb);
+    bool changes_variables(const AST::Expression &);
+    llvm::Value *element_address(const AST::ArrayIndex &);
+    llvm::Value *load(const std::string &name, const Variable &);
+    void store(Variable &, llvm::Value *);
+    void unbind(const std::string &name, const Scope &shadowed);
+    void merge(const Scope &other, llvm::BasicBlock *other_bb,
+               llvm::BasicBlock *bb);
+    std::vector<std::pair<std::string, llvm::PHINode *>> loop_phis(
+            const std::set<std::string> &assigned, llvm::BasicBlock *pre_bb);
+    void close_loop(
+            const std::vector<std::pair<std::string, llvm::PHINode *>> &);
+    void check_assignable(const std::string &name, const Variable &var,
+                          ErrorInfo info);
+    llvm::Value *count_iterations(const AST::ForLoop &, llvm::Value *&start,
+                                  llvm::Value *&step);
+    llvm::Value *reduction_identity(char op);
+    llvm::Value *combine(char op, llvm::Value *acc, llvm::Value *val);
+    llvm::Value *counted_index(const AST::ForLoop &, llvm::Value *start,
+                               llvm::Value *step, llvm::Value *iteration);
+    llvm::Value *counted_for(const AST::ForLoop &);
+    llvm::Value *parallel_for(const AST::ForLoop &);
+    llvm::Function *outline_parallel_body(
+            const AST::ForLoop &, llvm::StructType *env_type,
+            const std::vector<std::string> &captured);
 
     llvm::LLVMContext &context;
-    llvm::IRBuilder<> &builder;
+    Builder &builder;
     llvm::Module &module;
-    std::map<std::string, llvm::AllocaInst *> &names;
+    Scope &names;
+    const CodeGenOptions &opts;
+    std::vector<Error> &warnings;
+    std::vector<ParallelBody> &parallel_bodies;
+    /** The current function's, which are kept in `i64`s. */
+    const IntegerVariables &integers;
+
+    /**
+     * @brief Is the node currently being visited in tail position?  Set by
+     *        `visit`.
+     */
+    bool tail;
 };
 
 /**
@@ -76,7 +208,8 @@ public:
 
     /* See CodeGenerator.hh for documentation on these methods.  CodeGenerator
      * exposes thin wrappers over them. */
-    CodeGeneratorImpl(std::string name, std::string triple);
+    CodeGeneratorImpl(std::string name, std::shared_ptr<Target> target,
+                      CodeGenOptions opts);
     llvm::Function *operator()
         (const std::unique_ptr<AST::FunctionPrototype> &);
     llvm::Function *operator()
@@ -84,35 +217,146 @@ public:
     llvm::Function *operator()(const AST::Error &) {
         return nullptr;
     }
+    llvm::Function *declare(const AST::Declaration &);
+    void use(const Library &);
 
     void run_passes(void);
+    void optimize(void);
+    std::map<std::string, uint64_t> statistics(void);
+
+    std::vector<Error> take_warnings(void);
 
     void emit_ir(std::ostream &);
     void emit_obj(int fd);
+    void emit_obj(std::ostream &);
+    void emit_bc(int fd, bool summary);
+    void emit_bc(std::ostream &, bool summary);
+    void emit_kpm(int fd);
+    void emit_kpm(std::ostream &);
+    std::vector<void *> load(const std::vector<std::string> &names);
 
 private:
 
+    /**
+     * @brief Replace calls to math functions that are only declared with
+     *        calls to the equivalent intrinsics.
+     */
+    void lower_builtins(void);
+
+    /**
+     * @brief Give every function that isn't exported internal linkage, if
+     *        any are.
+     */
+    void internalize(void);
+
+    /**
+     * @brief Link in the bodies of the libraries' functions, to be inlined
+     *        but not emitted.
+     */
+    void link_libraries(void);
+
+    /**
+     * @brief Route calls to `memo` functions through tables of their
+     *        results, once they are known to be pure.
+     */
+    void memoize_functions(void);
+
+    /**
+     * @brief Check that the bodies of `parfor` loops have no effects beyond
+     *        the arrays they are passed.
+     */
+    void check_parallel_bodies(void);
+
     llvm::LLVMContext context;
 
     /**
      * @brief LLVM's helper for emitting IR.
      */
-    llvm::IRBuilder<> builder;
+    Builder builder;
 
     /**
      * @brief The module we are constructing.
      */
     std::unique_ptr<llvm::Module> module;
 
+    /**
+     * @brief Runs the module's code in this process, once it is `load`ed
+     *        (and then owns the module).
+     */
+    std::unique_ptr<llvm::ExecutionEngine> engine;
+
     /**
      * @brief Current namespace.
      */
-    std::map<std::string, llvm::AllocaInst *> names;
+    Scope names;
+
+    /**
+     * @brief Functions declared with `builtin`.
+     */
+    std::set<std::string> builtins;
+
+    /**
+     * @brief Functions defined with `export`.
+     */
+    std::set<std::string> exported;
+
+    /**
+     * @brief Every named function declared (or defined), in order, for the
+     *        interface of our library; less those made internal.
+     */
+    std::vector<AST::FunctionPrototype> declared;
+
+    /**
+     * @brief The code of the libraries used, until it is linked in.
+     */
+    std::vector<std::unique_ptr<llvm::Module>> libraries;
+
+    /**
+     * @brief Functions whose bodies come from a library, and the library's
+     *        path.
+     */
+    std::map<std::string, std::string> imported;
+
+    /**
+     * @brief A function defined with `memo`.
+     */
+    struct MemoFunction {
+        llvm::Function *function;
+        /** Or 0 for the default. */
+        unsigned capacity;
+        ErrorInfo info;
+    };
+
+    std::vector<MemoFunction> memo_functions;
+
+    /**
+     * @brief Bodies of `parfor` loops, to be checked once their effects are
+     *        known.
+     */
+    std::vector<ParallelBody> parallel_bodies;
+
+    /**
+     * @brief Variables of the function being generated that only hold
+     *        whole numbers.
+     */
+    IntegerVariables integers;
 
     /**
      * @brief The target machine (target triple + CPU information).
      */
-	llvm::TargetMachine *target;
+    std::shared_ptr<Target> target;
+
+    CodeGenOptions opts;
+
+    /**
+     * @brief Have we run the optimization passes yet?
+     */
+    bool optimized;
+
+    /**
+     * @brief Warnings accumulated since the last `take_warnings`.
+     */
+    std::vector<Error> warnings;
 
     /**
      * @brief A visitor for value nodes; see above.
@@ -0,0 +1,177 @@
+#include "Diagnostics.hh"
+#include "Json.hh"
+
+#include <algorithm>
+#include <sstream>
+#include <tuple>
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+static const std::string &source_name(const Error &e) {
+    static const std::string unknown = "<unknown>";
+    auto &source = e.get_info().source;
+    return source? source->name(): unknown;
+}
+
+typedef std::tuple<const std::string &, uint32_t, uint32_t, Severity,
+                   const std::string &, const std::string &> SortKey;
+
+/** Order diagnostics by file and position (then arbitrarily, but
+ *  deterministically, so that identical ones end up next to each other). */
+static SortKey sort_key(const Error &e) {
+    return SortKey(source_name(e), e.get_info().start, e.get_info().end,
+                   e.get_severity(), e.get_header(), e.get_message());
+}
+
+static const char *severity_name(Severity severity) {
+    return severity == Severity::warning? "warning": "error";
+}
+
+/** A position as a JSON object, with one-based line and column. */
+static std::string position_json(const Source &source, uint32_t offset) {
+    auto loc = source.location(offset);
+    std::ostringstream out;
+    out << "{\"offset\": " << offset << ", \"line\": " << loc.line + 1
+        << ", \"column\": " << loc.column + 1 << "}";
+    return out.str();
+}
+
+/*****************************************************************************
+ * Diagnostics implementation.
+ */
+
+Diagnostics::Diagnostics(DiagnosticOptions opts): opts(opts), errors(0) {}
+
+void Diagnostics::report(const Error &e) {
+    std::lock_guard<std::mutex> guard(lock);
+    diagnostics.push_back(e);
+    if (e.get_severity() == Severity::error) ++errors;
+}
+
+bool Diagnostics::has_errors(void) const {
+    std::lock_guard<std::mutex> guard(lock);
+    return errors > 0;
+}
+
+std::vector<Error> Diagnostics::sorted(size_t &omitted) const {
+    /* Called with `lock` held. */
+    std::vector<const Error *> order;
+    for (auto &e: diagnostics) order.push_back(&e);
+    std::stable_sort(order.begin(), order.end(),
+                     [](const Error *a, const Error *b) {
+                         return sort_key(*a) < sort_key(*b);
+                     });
+
+    std::vector<Error> result;
+    unsigned n_errors = 0;
+    omitted = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (i > 0 && sort_key(*order[i]) == sort_key(*order[i - 1])) continue;
+        if (omitted || (order[i]->get_severity() == Severity::error
+                     && opts.max_errors && n_errors++ == opts.max_errors)) {
+            ++omitted;
+        } else {
+            result.push_back(*order[i]);
+        }
+    }
+    return result;
+}
+
+void Diagnostics::render_human(std::ostream &out) const {
+    size_t omitted;
+    for (auto &e: sorted(omitted)) e.emit(out, opts.color);
+    if (omitted) {
+        out << "too many errors (limit " << opts.max_errors << "); "
+            << omitted << " more not shown\n";
+    }
+}
+
+void Diagnostics::render_json(std::ostream &out) const {
+    size_t omitted;
+    out << "{\"diagnostics\": [";
+    bool first = true;
+    for (auto &e: sorted(omitted)) {
+        auto &info = e.get_info();
+        out << (first? "\n": ",\n")
+            << "  {\"severity\": \"" << severity_name(e.get_severity())
+            << "\", \"category\": " << json_string(e.get_header())
+            << ", \"message\": " << json_string(e.get_message())
+            << ", \"file\": " << json_string(source_name(e));
+        if (info.source) {
+            out << ", \"start\": " << position_json(*info.source, info.start)
+                << ", \"end\": " << position_json(*info.source, info.end);
+        }
+        out << "}";
+        first = false;
+    }
+    out << "\n], \"omitted\": " << omitted << "}\n";
+}
+
+void Diagnostics::render_sarif(std::ostream &out) const {
+    size_t omitted;
+    out << "{\"$schema\": \"https://json.schemastore.org/sarif-2.1.0.json\",\n"
+        << " \"version\": \"2.1.0\",\n"
+        << " \"runs\": [{\"tool\": {\"driver\": {\"name\": \"kalc\"}},\n"
+        << "  \"results\": [";
+    bool first = true;
+    for (auto &e: sorted(omitted)) {
+        auto &info = e.get_info();
+        out << (first? "\n": ",\n")
+            << "   {\"level\": \"" << severity_name(e.get_severity())
+            << "\", \"message\": {\"text\": " << json_string(e.get_message())
+            << "}, \"properties\": {\"category\": "
+            << json_string(e.get_header()) << "}";
+        if (info.source) {
+            /* SARIF lines and columns are one-based, and the end column is
+             * exclusive. */
+            auto start = info.source->location(info.start);
+            auto end = info.source->location(info.end);
+            out << ", \"locations\": [{\"physicalLocation\": "
+                << "{\"artifactLocation\": {\"uri\": "
+                << json_string(info.source->name()) << "}, \"region\": "
+                << "{\"startLine\": " << start.line + 1
+                << ", \"startColumn\": " << start.column + 1
+                << ", \"endLine\": " << end.line + 1
+                << ", \"endColumn\": " << end.column + 1
+                << ", \"charOffset\": " << info.start
+                << ", \"charLength\": " << info.end - info.start << "}}}]";
+        }
+        out << "}";
+        first = false;
+    }
+    out << "\n  ],\n  \"invocations\": [{\"executionSuccessful\": "
+        << (errors? "false": "true");
+    if (omitted) {
+        out << ", \"toolExecutionNotifications\": [{\"level\": \"note\", "
+            << "\"message\": {\"text\": \"" << omitted
+            << " more diagnostics not shown (limit " << opts.max_errors
+            << " errors)\"}}]";
+    }
+    out << "}]}]}\n";
+}
+
+std::string Diagnostics::render(void) const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::ostringstream out;
+    switch (opts.format) {
+    case DiagnosticFormat::human: render_human(out); break;
+    case DiagnosticFormat::json:  render_json(out);  break;
+    case DiagnosticFormat::sarif: render_sarif(out); break;
+    }
+    return out.str();
+}
+
+void Diagnostics::flush(std::ostream &out) {
+    auto text = render();
+    out.write(text.data(), text.size());
+    out.flush();
+    std::lock_guard<std::mutex> guard(lock);
+    diagnostics.clear();
+    errors = 0;
+}
+
+}
@@ -0,0 +1,81 @@
+/**
+ * @brief Collects errors and warnings, and prints them all at once.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Error.hh"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief How to print diagnostics.
+ */
+enum class DiagnosticFormat {
+    /** Messages with source snippets, as from `Error::emit`. */
+    human,
+    /** A single JSON object listing every diagnostic. */
+    json,
+    /** A SARIF 2.1.0 log, as understood by code-scanning tools. */
+    sarif,
+};
+
+struct DiagnosticOptions {
+    DiagnosticFormat format = DiagnosticFormat::human;
+
+    /** Print at most this many errors (0 for no limit).  Warnings don't
+     *  count towards the limit, but are dropped along with errors once it is
+     *  reached. */
+    unsigned max_errors = 0;
+
+    /** Highlight human-readable output with ANSI escape codes. */
+    bool color = false;
+};
+
+/**
+ * @brief Buffers diagnostics until `render` or `flush`, then prints them
+ *        sorted by position with duplicates removed.
+ *
+ * Safe to report to from several threads at once.
+ */
+class Diagnostics {
+public:
+    Diagnostics(DiagnosticOptions opts=DiagnosticOptions());
+
+    void report(const Error &);
+
+    /**
+     * @brief Has any error (as opposed to warning) been reported?
+     */
+    bool has_errors(void) const;
+
+    /**
+     * @brief Return every diagnostic reported so far, in the chosen format.
+     */
+    std::string render(void) const;
+
+    /**
+     * @brief Write every diagnostic reported so far in one go, and forget
+     *        them.
+     */
+    void flush(std::ostream &);
+
+private:
+    std::vector<Error> sorted(size_t &omitted) const;
+    void render_human(std::ostream &) const;
+    void render_json(std::ostream &) const;
+    void render_sarif(std::ostream &) const;
+
+    DiagnosticOptions opts;
+    mutable std::mutex lock;
+    std::vector<Error> diagnostics;
+    size_t errors;
+};
+
+}
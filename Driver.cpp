@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <thread>
+
+#include <boost/variant.hpp>
+
+#include "AST.hh"
+#include "Driver.hh"
+#include "Library.hh"
+#include "Parser.hh"
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+/**
+ * @brief Everything the parser got out of one source file.
+ */
+struct ParsedFile {
+    std::vector<AST::Declaration> decls;
+    std::vector<Error> errors;
+};
+
+/**
+ * @brief Pull ASTs out of a parser on the given source until EOF.
+ */
+static ParsedFile parse_file(const SourceFile &source, Report &report,
+                             bool time_lexer) {
+    auto span = report.span(source.name, "parse");
+    ParsedFile result;
+    Parser parser(source.in_memory
+                      ? std::make_shared<Source>(source.name, source.text)
+                      : Source::read_file(source.name),
+                  time_lexer);
+    while (!parser.reached_end()) {
+        try {
+            result.decls.push_back(parser.parse());
+        } catch (Error e) {
+            result.errors.push_back(e);
+        }
+    }
+    report.count("tokens", parser.token_count());
+    if (time_lexer) {
+        report.add_time("lexing (all threads)", parser.lexer_time());
+    }
+    return result;
+}
+
+/**
+ * @brief Parse all of the given sources, using up to `max_threads` threads.
+ */
+static std::vector<ParsedFile> parse_files(
+        const std::vector<SourceFile> &sources, Report &report,
+        bool time_lexer, unsigned max_threads) {
+    std::vector<ParsedFile> result(sources.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < sources.size(); i = next++) {
+            result[i] = parse_file(sources[i], report, time_lexer);
+        }
+    };
+
+    if (max_threads == 0) {
+        max_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t n_threads = std::min<size_t>(sources.size(), max_threads);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n_threads; ++i) threads.emplace_back(worker);
+    worker();
+    for (auto &t: threads) t.join();
+
+    return result;
+}
+
+/**
+ * @brief Have the code generator visit a single AST.
+ *
+ * @param define Generate the body too, rather than just declaring it.
+ */
+static bool handle_decl(const AST::Declaration &decl, CodeGenerator &c,
+                        bool define, Report &report, Diagnostics &diag) {
+    try {
+        if (define) {
+            auto *def =
+                boost::get<std::unique_ptr<AST::FunctionDefinition>>(&decl);
+            if (!def) return true;
+            auto &fname = (*def)->proto->fname;
+            auto span = report.span(fname.empty()? "(top level)": fname,
+                                    "codegen");
+            c(decl);
+        } else {
+            c.declare(decl);
+        }
+        for (auto &w: c.take_warnings()) diag.report(w);
+        return true;
+    } catch (Error e) {
+        diag.report(e);
+        return false;
+    }
+}
+
+/**
+ * @brief Declare a precompiled library's functions, and hand its code to
+ *        the code generator.
+ */
+static bool use_library(const std::string &path, CodeGenerator &c,
+                        Diagnostics &diag) {
+    Library library;
+    try {
+        library = read_library(path);
+        c.use(library);
+    } catch (Error e) {
+        diag.report(e);
+        return false;
+    }
+    bool successful = true;
+    Parser parser(library.interface);
+    while (!parser.reached_end()) {
+        try {
+            c.declare(parser.parse());
+        } catch (Error e) {
+            diag.report(e);
+            successful = false;
+        }
+    }
+    return successful;
+}
+
+/*****************************************************************************
+ * Driver implementation.
+ */
+
+bool compile(const std::vector<SourceFile> &sources, CodeGenerator &codegen,
+             Report &report, Diagnostics &diag, const DriverOptions &opts) {
+    std::vector<AST::Declaration> decls;
+    return compile(sources, codegen, report, diag, opts, decls);
+}
+
+bool compile(const std::vector<SourceFile> &sources, CodeGenerator &codegen,
+             Report &report, Diagnostics &diag, const DriverOptions &opts,
+             std::vector<AST::Declaration> &decls) {
+    std::vector<ParsedFile> files;
+    {
+        auto phase = report.span("parse");
+        /* Parse the source files (in parallel). */
+        files = parse_files(sources, report, opts.time_lexer,
+                            opts.parse_threads);
+    }
+    bool successful = true;
+    for (auto &file: files) {
+        for (auto &e: file.errors) diag.report(e);
+        if (!file.errors.empty()) successful = false;
+    }
+
+    if (opts.stats) {
+        std::map<std::string, uint64_t> nodes;
+        for (auto &file: files) {
+            for (auto &decl: file.decls) AST::count_nodes(decl, nodes);
+        }
+        for (auto &n: nodes) report.count("AST nodes: " + n.first, n.second);
+    }
+
+    /* Declarations that conflict with earlier ones. */
+    std::set<const AST::Declaration *> undeclared;
+    {
+        auto phase = report.span("declare");
+        /* Libraries' declarations first, so that conflicting ones in the
+         * sources are pointed out there. */
+        for (auto &path: opts.libraries) {
+            if (!use_library(path, codegen, diag)) successful = false;
+        }
+        /* Declare every function before generating any bodies, so that
+         * files may call functions defined in later files. */
+        for (auto &file: files) {
+            for (auto &decl: file.decls) {
+                if (!handle_decl(decl, codegen, false, report, diag)) {
+                    undeclared.insert(&decl);
+                    successful = false;
+                }
+            }
+        }
+    }
+    {
+        auto phase = report.span("codegen");
+        for (auto &file: files) {
+            for (auto &decl: file.decls) {
+                /* Its declaration's error has been reported already. */
+                if (undeclared.count(&decl)) continue;
+                if (!handle_decl(decl, codegen, true, report, diag)) {
+                    successful = false;
+                }
+            }
+        }
+    }
+
+    for (auto &file: files) {
+        for (auto &decl: file.decls) decls.push_back(std::move(decl));
+    }
+    if (!successful) return false;
+
+    if (opts.stats) {
+        for (auto &s: codegen.statistics()) {
+            report.count(s.first + " (before optimization)", s.second);
+        }
+    }
+    {
+        auto phase = report.span("optimize");
+        try {
+            codegen.optimize();
+        } catch (Error e) {
+            diag.report(e);
+            return false;
+        }
+        for (auto &w: codegen.take_warnings()) diag.report(w);
+    }
+    if (opts.stats) {
+        for (auto &s: codegen.statistics()) {
+            report.count(s.first + " (after optimization)", s.second);
+        }
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,74 @@
+/**
+ * @brief Runs the compiler's front and middle end over a set of source
+ *        files, shared by the command-line compiler and the compile server.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "CodeGenerator.hh"
+#include "Diagnostics.hh"
+#include "Report.hh"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief One input to the compiler: either a file on disk or text already in
+ *        memory (e.g. read from stdin, or sent to a compile server).
+ */
+struct SourceFile {
+    /** Name used in error messages (and the path, if not `in_memory`). */
+    std::string name;
+    bool in_memory;
+    std::string text;
+
+    static SourceFile file(std::string path) {
+        return SourceFile { path, false, "" };
+    }
+
+    static SourceFile memory(std::string name, std::string text) {
+        return SourceFile { name, true, text };
+    }
+};
+
+/**
+ * @brief Knobs controlling a single compilation, other than code generation.
+ */
+struct DriverOptions {
+    /** Parse files on up to this many threads (0 for one per core). */
+    unsigned parse_threads = 0;
+
+    /** Add the time spent lexing to the report. */
+    bool time_lexer = false;
+
+    /** Record token, AST node, function and instruction counts. */
+    bool stats = false;
+
+    /** Precompiled libraries (`.kpm` files) whose functions the sources
+     *  may call. */
+    std::vector<std::string> libraries;
+};
+
+/**
+ * @brief Parse the given sources, generate code for them into `codegen` and
+ *        optimize it, ready to be emitted.
+ *
+ * Errors and warnings are reported to `diagnostics`.
+ *
+ * @return Whether compilation succeeded.
+ */
+bool compile(const std::vector<SourceFile> &sources, CodeGenerator &codegen,
+             Report &report, Diagnostics &diagnostics,
+             const DriverOptions &opts=DriverOptions());
+
+/**
+ * @brief As above, also handing back every declaration parsed, in order
+ *        (e.g. for `--run` to interpret).
+ */
+bool compile(const std::vector<SourceFile> &sources, CodeGenerator &codegen,
+             Report &report, Diagnostics &diagnostics,
+             const DriverOptions &opts, std::vector<AST::Declaration> &decls);
+
+}
@@ -5,35 +5,56 @@
 #include <ostream>
 #include <string>
 
+#include "Source.hh"
+
 namespace Kaleidoscope {
 
 /* It's very important to keep these small, as they are used by every leaf in
- * the AST.  Currently 128 bits.  (clang somehow gets its equivalent structure
- * down to 32 bits...) */
+ * the AST.  Positions are byte offsets into the source, which is shared with
+ * the lexer: line and column numbers are only worked out when an error is
+ * printed. */
 struct ErrorInfo {
-    std::shared_ptr<std::string> filename;
-    uint16_t lineno_start;
-    uint16_t charno_start;
-    uint16_t lineno_end;
-    uint16_t charno_end;
-
-    ErrorInfo(std::shared_ptr<std::string> f, uint16_t cs, uint16_t ls,
-                                              uint16_t ce, uint16_t le)
-        : filename(f), lineno_start(ls), charno_start(cs),
-                       lineno_end(le), charno_end(ce) {}
+    std::shared_ptr<const Source> source;
+    /** Offset of the first character. */
+    uint32_t start;
+    /** Offset one past the last character. */
+    uint32_t end;
+
+    ErrorInfo(std::shared_ptr<const Source> source, uint32_t start,
+                                                    uint32_t end)
+        : source(source), start(start), end(end) {}
 };
 
 template <typename T> using Annotated = std::pair<ErrorInfo, T>;
 
+/**
+ * @brief How seriously to take a diagnostic.  Warnings are reported but do
+ *        not stop compilation.
+ */
+enum class Severity { error, warning };
+
 class Error {
 public:
-    Error(std::string, std::string, ErrorInfo);
-    void emit(std::ostream &);
+    Error(std::string, std::string, ErrorInfo,
+          Severity severity=Severity::error);
+
+    /**
+     * @brief Print the error for humans, with a source snippet.
+     *
+     * @param color Highlight it with ANSI escape codes.
+     */
+    void emit(std::ostream &, bool color=true) const;
+
+    const std::string &get_header(void) const { return header; }
+    const std::string &get_message(void) const { return msg; }
+    const ErrorInfo &get_info(void) const { return info; }
+    Severity get_severity(void) const { return severity; }
 
 private:
     std::string header;
     std::string msg;
     ErrorInfo info;
+    Severity severity;
 };
 
 }
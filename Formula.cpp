@@ -0,0 +1,57 @@
+#include <boost/variant.hpp>
+
+#include "Bytecode.hh"
+#include "Formula.hh"
+#include "Parser.hh"
+
+namespace Kaleidoscope {
+
+Formula::Formula(const std::string &source, std::vector<std::string> inputs)
+    : names(std::move(inputs)) {
+    auto text = std::make_shared<Source>("formula", source);
+    Parser parser(text);
+    std::vector<AST::Declaration> decls;
+    unsigned top_level = 0;
+    while (!parser.reached_end()) {
+        decls.push_back(parser.parse());
+        using AST::FunctionDefinition;
+        auto *def =
+            boost::get<std::unique_ptr<FunctionDefinition>>(&decls.back());
+        if (!def || !(*def)->proto->fname.empty()) continue;
+        if (++top_level > 1) {
+            throw Error("Formula error", "a formula is one top-level "
+                        "expression", (*def)->proto->info);
+        }
+    }
+    if (top_level == 0) {
+        throw Error("Formula error", "no formula (a top-level expression)",
+                    ErrorInfo(text, 0, source.size()));
+    }
+    program = std::make_shared<const Bytecode::Program>(
+            Bytecode::compile(decls, names));
+}
+
+Formula::~Formula() = default;
+
+double Formula::operator()(const std::vector<double> &values) const {
+    if (values.size() != names.size()) {
+        throw Error("Formula error", "given " + std::to_string(values.size())
+                    + " values for " + std::to_string(names.size())
+                    + " inputs", program->functions[0].info);
+    }
+    return Bytecode::Machine(*program).run(values.data());
+}
+
+void Formula::evaluate(size_t n, const double *const *columns,
+                       double *results) const {
+    Bytecode::Machine machine(*program);
+    std::vector<double> values(names.size());
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < values.size(); ++j) {
+            values[j] = columns[j][i];
+        }
+        results[i] = machine.run(values.data());
+    }
+}
+
+}
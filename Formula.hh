@@ -0,0 +1,68 @@
+/**
+ * @brief Evaluating small expressions, such as formulas users type in,
+ *        without compiling them with LLVM.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Kaleidoscope {
+
+namespace Bytecode {
+struct Program;
+}
+
+/**
+ * @brief An expression in some named inputs, compiled to bytecode.
+ *
+ * Compiling one takes microseconds rather than LLVM's milliseconds, and it
+ * evaluates to the same values compiled code would (if more slowly), so it
+ * suits expressions that are each evaluated a few thousand times.  A
+ * `Formula` may be evaluated on several threads at once.
+ */
+class Formula {
+public:
+    /**
+     * @param source Kaleidoscope: `def`s of any functions the formula
+     *               calls, then the formula, as a top-level expression.
+     *               The C math library's functions (those that can be
+     *               `builtin`s) need no declarations.
+     * @param inputs The variables it is in.
+     *
+     * Throws an `Error` if the source has anything but exactly one
+     * top-level expression, or has an error, or uses arrays.
+     */
+    Formula(const std::string &source, std::vector<std::string> inputs);
+
+    ~Formula();
+
+    const std::vector<std::string> &inputs(void) const { return names; }
+
+    /**
+     * @brief Evaluate it for one value of each input (in order).
+     *
+     * Throws an `Error` if there are more or fewer values than inputs, or
+     * if calls nest too deeply.
+     */
+    double operator()(const std::vector<double> &values) const;
+
+    /**
+     * @brief Evaluate it for `n` values of each input: `columns[j][i]` is
+     *        the `i`th value of input `j`, and the formula's value for the
+     *        `i`th values goes in `results[i]`.
+     *
+     * Throws an `Error` if calls nest too deeply.
+     */
+    void evaluate(size_t n, const double *const *columns,
+                  double *results) const;
+
+private:
+    std::vector<std::string> names;
+    std::shared_ptr<const Bytecode::Program> program;
+};
+
+}
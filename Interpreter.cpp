@@ -0,0 +1,526 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+#include <boost/variant.hpp>
+#include "llvm/Support/DynamicLibrary.h"
+
+#include "Interpreter.hh"
+#include "Jit.hh"
+#include "Lexer.hh"
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+[[noreturn]] static void _throw(std::string msg, ErrorInfo info) {
+    throw Error("Runtime error", msg, info);
+}
+
+/** Interpreted calls nested deeper than this wait for the function's code
+ *  instead, before the interpreter (whose frames are far bigger than
+ *  compiled code's) runs out of stack.  For a function without code, they
+ *  are an error. */
+static const unsigned MAX_INTERPRETED_DEPTH = 1000;
+
+/** The most arguments `call_code` can pass: as many as x86-64 and AArch64
+ *  pass doubles in registers. */
+static const size_t MAX_CODE_ARGS = 8;
+
+/** Call compiled code (or the C library) taking and returning numbers. */
+static double call_code(void *code, const std::vector<double> &a) {
+    typedef double D;
+    switch (a.size()) {
+    case 0:
+        return reinterpret_cast<D (*)()>(code)();
+    case 1:
+        return reinterpret_cast<D (*)(D)>(code)(a[0]);
+    case 2:
+        return reinterpret_cast<D (*)(D, D)>(code)(a[0], a[1]);
+    case 3:
+        return reinterpret_cast<D (*)(D, D, D)>(code)(a[0], a[1], a[2]);
+    case 4:
+        return reinterpret_cast<D (*)(D, D, D, D)>(code)(a[0], a[1], a[2],
+                                                         a[3]);
+    case 5:
+        return reinterpret_cast<D (*)(D, D, D, D, D)>(code)(
+                a[0], a[1], a[2], a[3], a[4]);
+    case 6:
+        return reinterpret_cast<D (*)(D, D, D, D, D, D)>(code)(
+                a[0], a[1], a[2], a[3], a[4], a[5]);
+    case 7:
+        return reinterpret_cast<D (*)(D, D, D, D, D, D, D)>(code)(
+                a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+    default:
+        return reinterpret_cast<D (*)(D, D, D, D, D, D, D, D)>(code)(
+                a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+    }
+}
+
+/** Is the number true as a condition: neither zero nor NaN? */
+static bool truth(double x) {
+    return x < 0 || x > 0;
+}
+
+/** What a reduction starts from, as in `ExpressionGenerator`. */
+static double identity(char op) {
+    return op == '*'? 1.0
+         : op == '<'? HUGE_VAL
+         : op == '>'? -HUGE_VAL
+         : 0.0;
+}
+
+/** Combine a loop's value so far with an iteration's, as
+ *  `ExpressionGenerator::combine` does. */
+static double combine(char op, double acc, double val) {
+    switch (op) {
+    case '*':
+        return acc * val;
+    case '<':
+        /* NaNs are ignored. */
+        return val < acc || acc != acc? val: acc;
+    case '>':
+        return val > acc || acc != acc? val: acc;
+    case '+':
+    default:
+        return acc + val;
+    }
+}
+
+/** A value to print: as few digits as read back as the same number. */
+static std::string format_number(double x) {
+    char buffer[32];
+    snprintf(buffer, sizeof buffer, "%.15g", x);
+    if (std::strtod(buffer, nullptr) != x) {
+        snprintf(buffer, sizeof buffer, "%.17g", x);
+    }
+    return buffer;
+}
+
+/**
+ * @brief A function, and how calls to it are run.
+ */
+struct Function {
+    std::string name;
+    /** Or null if it is only declared. */
+    const AST::FunctionDefinition *definition = nullptr;
+    /** Only numbers in and out, so its code can be called directly. */
+    bool compilable = false;
+    /** Its code (or the C library's, if it is only declared), once there
+     *  is any; until then it is interpreted. */
+    std::atomic<void *> code{nullptr};
+    /** Interpreted calls plus loop iterations. */
+    uint64_t heat = 0;
+    /** Sent to be compiled. */
+    bool requested = false;
+    /** Compiled, or found not to be compilable.  Guarded by the
+     *  interpreter's lock. */
+    bool settled = false;
+};
+
+/*****************************************************************************
+ * InterpreterImpl.
+ */
+
+class InterpreterImpl {
+public:
+    InterpreterImpl(const std::vector<AST::Declaration> &decls,
+                    RunOptions opts, Report &report);
+
+    void run(std::ostream &out);
+    std::map<std::string, uint64_t> statistics(void);
+
+    /**
+     * @brief The function of this name, which the program must declare.
+     */
+    Function &function(const std::string &name, ErrorInfo info);
+
+    /**
+     * @brief Run a call, with compiled code if there is any.
+     */
+    double call(Function &, const std::vector<double> &args, ErrorInfo info);
+
+    /**
+     * @brief Count calls to or loop iterations in a function (or nothing,
+     *        for a top-level expression), compiling it once there are
+     *        enough.
+     */
+    void heat(Function *, uint64_t n=1);
+
+private:
+    void request(Function &);
+    void wait_for(Function &);
+
+    const std::vector<AST::Declaration> &decls;
+    RunOptions opts;
+    std::map<std::string, Function> functions;
+    /** Of interpreted calls. */
+    unsigned depth = 0;
+    uint64_t interpreted_calls = 0;
+    uint64_t compiled_calls = 0;
+    std::atomic<uint64_t> compiled{0};
+    std::atomic<uint64_t> failed{0};
+
+    std::mutex lock;
+    std::condition_variable settled;
+
+    /** Last, so that it stops before anything it reports to goes. */
+    std::unique_ptr<Jit> jit;
+};
+
+/**
+ * @brief Evaluates the body of a function, for one call.
+ *
+ * The program has compiled, so names and types are known to be right.
+ */
+class Evaluator: public boost::static_visitor<double> {
+public:
+    /**
+     * @param function The function being called, or null for a top-level
+     *                 expression.
+     */
+    Evaluator(InterpreterImpl &interpreter, Function *function)
+        : interpreter(interpreter), function(function) {}
+
+    double visit(const AST::Expression &expr) {
+        return boost::apply_visitor(*this, expr);
+    }
+
+    /**
+     * @brief Put a new variable in scope, shadowing any of the same name.
+     */
+    void bind(const std::string &name, double value) {
+        variables.emplace_back(&name, value);
+    }
+
+    /**
+     * @name Visitors
+     *
+     * Methods for visiting AST nodes.
+     */
+    /**@{*/
+
+    double operator()(const AST::NumberLiteral &num) {
+        return num.val;
+    }
+
+    double operator()(const AST::VariableName &var) {
+        return variable(var.name, var.info);
+    }
+
+    double operator()(const std::unique_ptr<AST::BinaryOp> &op) {
+        if (op->op == '=') {
+            auto *var = boost::get<AST::VariableName>(&op->lhs);
+            if (!var) array_error(AST::get_info(op->lhs));
+            double val = visit(op->rhs);
+            return variable(var->name, var->info) = val;
+        }
+        if (op->op == tok_and) {
+            return truth(visit(op->lhs)) && truth(visit(op->rhs));
+        }
+        if (op->op == tok_or) {
+            return truth(visit(op->lhs)) || truth(visit(op->rhs));
+        }
+
+        double l = visit(op->lhs);
+        double r = visit(op->rhs);
+        /* Comparisons are as in `ExpressionGenerator`: `<`, `>`, `<=` and
+         * `>=` hold if either side is NaN, as does `!=`. */
+        switch (op->op) {
+        case '+':
+            return l + r;
+        case '-':
+            return l - r;
+        case '*':
+            return l * r;
+        case '/':
+            return l / r;
+        case '<':
+            return !(l >= r);
+        case '>':
+            return !(r >= l);
+        case tok_le:
+            return !(l > r);
+        case tok_ge:
+            return !(l < r);
+        case tok_eq:
+            return l == r;
+        case tok_ne:
+        default:
+            return l != r;
+        }
+    }
+
+    double operator()(const std::unique_ptr<AST::FunctionCall> &call) {
+        std::vector<double> args;
+        args.reserve(call->args.size());
+        for (auto &arg: call->args) args.push_back(visit(arg));
+        return interpreter.call(interpreter.function(call->fname, call->info),
+                                args, call->info);
+    }
+
+    double operator()(const std::unique_ptr<AST::IfThenElse> &if_) {
+        return truth(visit(if_->cond))? visit(if_->then): visit(if_->else_);
+    }
+
+    double operator()(const std::unique_ptr<AST::ForLoop> &loop) {
+        if (loop->parallel || loop->reduce_op) return counted_for(*loop);
+
+        /* The body runs before the condition is first tested. */
+        size_t index = variables.size();
+        bind(loop->index_var, visit(loop->start));
+        do {
+            visit(loop->body);
+            double step = visit(loop->step);
+            variables[index].second += step;
+            interpreter.heat(function);
+        } while (truth(visit(loop->end)));
+        variables.resize(index);
+        return 0;
+    }
+
+    double operator()(const std::unique_ptr<AST::LocalVar> &local) {
+        size_t outer = variables.size();
+        for (auto &name: local->names) {
+            double value = visit(name.second);
+            bind(name.first, value);
+        }
+        double result = visit(local->body);
+        variables.resize(outer);
+        return result;
+    }
+
+    double operator()(const std::unique_ptr<AST::ArrayIndex> &elt) {
+        array_error(elt->info);
+    }
+
+    /**@}*/
+
+private:
+    /**
+     * @brief The innermost variable of this name in the function.
+     */
+    double &variable(const std::string &name, ErrorInfo info) {
+        for (auto it = variables.rbegin(); it != variables.rend(); ++it) {
+            if (*it->first == name) return it->second;
+        }
+        _throw("unknown variable name (" + name + ")", info);
+    }
+
+    /**
+     * @brief Arrays only come from C code calling the program's functions,
+     *        so a program that is run never has any.
+     */
+    [[noreturn]] void array_error(ErrorInfo info) {
+        _throw("a program that is run has no arrays", info);
+    }
+
+    /**
+     * @brief Run a `parfor` or reducing loop, whose iterations are counted
+     *        before any of them run, one iteration after another.
+     */
+    double counted_for(const AST::ForLoop &loop) {
+        auto &cond = boost::get<std::unique_ptr<AST::BinaryOp>>(loop.end);
+        double start = visit(loop.start);
+        double limit = visit(cond->rhs);
+        double step = visit(loop.step);
+
+        /* As `ExpressionGenerator::count_iterations` counts them. */
+        double span = (limit - start) / step;
+        int64_t iterations = 0;
+        if (span > 0 && span < 4e18) {
+            iterations = (int64_t)span;
+            if ((double)iterations < span) ++iterations;
+        }
+
+        /* Like each thread running a parfor, the body reduces into copies
+         * of the variables starting from the identity, which are combined
+         * with the originals after the loop. */
+        size_t outer = variables.size();
+        for (auto &reduction: loop.reductions) {
+            bind(reduction.var, identity(reduction.op));
+        }
+        double total = identity(loop.reduce_op);
+        for (int64_t i = 0; i < iterations; ++i) {
+            bind(loop.index_var, start + (double)i * step);
+            double val = visit(loop.body);
+            variables.pop_back();
+            if (loop.reduce_op) total = combine(loop.reduce_op, total, val);
+            interpreter.heat(function);
+        }
+        std::vector<double> copies;
+        for (size_t r = 0; r < loop.reductions.size(); ++r) {
+            copies.push_back(variables[outer + r].second);
+        }
+        variables.resize(outer);
+        for (size_t r = 0; r < copies.size(); ++r) {
+            auto &reduction = loop.reductions[r];
+            double &var = variable(reduction.var, reduction.info);
+            var = combine(reduction.op, var, copies[r]);
+        }
+        return loop.reduce_op? total: 0;
+    }
+
+    InterpreterImpl &interpreter;
+    Function *function;
+    /** The variables in scope, innermost last. */
+    std::vector<std::pair<const std::string *, double>> variables;
+};
+
+InterpreterImpl::InterpreterImpl(const std::vector<AST::Declaration> &decls,
+                                 RunOptions opts, Report &report)
+    : decls(decls), opts(opts) {
+    /* So that declared functions can be found in the C library. */
+    llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+
+    for (auto &decl: decls) {
+        using AST::FunctionPrototype;
+        using AST::FunctionDefinition;
+        if (auto *proto =
+                boost::get<std::unique_ptr<FunctionPrototype>>(&decl)) {
+            functions[(*proto)->fname].name = (*proto)->fname;
+            continue;
+        }
+        auto *def = boost::get<std::unique_ptr<FunctionDefinition>>(&decl);
+        if (!def || (*def)->proto->fname.empty()) continue;
+        auto &proto = *(*def)->proto;
+        auto &f = functions[proto.fname];
+        f.name = proto.fname;
+        f.definition = def->get();
+        f.compilable = opts.jit_threshold > 0
+                    && proto.args.size() <= MAX_CODE_ARGS
+                    && std::count(proto.arg_types.begin(),
+                                  proto.arg_types.end(),
+                                  AST::Type::array) == 0;
+    }
+
+    if (opts.jit_threshold > 0) {
+        jit = std::make_unique<Jit>(decls, opts.codegen, report);
+    }
+}
+
+void InterpreterImpl::run(std::ostream &out) {
+    for (auto &decl: decls) {
+        auto *def =
+            boost::get<std::unique_ptr<AST::FunctionDefinition>>(&decl);
+        if (!def || !(*def)->proto->fname.empty()) continue;
+        Evaluator evaluator(*this, nullptr);
+        out << format_number(evaluator.visit((*def)->body)) << std::endl;
+    }
+}
+
+std::map<std::string, uint64_t> InterpreterImpl::statistics(void) {
+    return {
+        {"calls interpreted", interpreted_calls},
+        {"calls to compiled code", compiled_calls},
+        {"functions compiled", compiled},
+        {"functions that could not be compiled", failed},
+    };
+}
+
+Function &InterpreterImpl::function(const std::string &name,
+                                    ErrorInfo info) {
+    auto it = functions.find(name);
+    if (it == functions.end()) {
+        _throw("unknown function referenced: " + name, info);
+    }
+    return it->second;
+}
+
+double InterpreterImpl::call(Function &f, const std::vector<double> &args,
+                             ErrorInfo info) {
+    if (void *code = f.code.load(std::memory_order_acquire)) {
+        if (f.definition) ++compiled_calls;
+        return call_code(code, args);
+    }
+    if (!f.definition) {
+        void *code =
+            llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(f.name);
+        if (!code) {
+            _throw("cannot call " + f.name + ", which is only declared, "
+                   "and isn't in the C library", info);
+        }
+        if (args.size() > MAX_CODE_ARGS) {
+            _throw("cannot call " + f.name + " with more than "
+                 + std::to_string(MAX_CODE_ARGS) + " arguments", info);
+        }
+        f.code.store(code, std::memory_order_release);
+        return call_code(code, args);
+    }
+
+    heat(&f);
+    if (depth >= MAX_INTERPRETED_DEPTH) {
+        if (f.compilable) wait_for(f);
+        if (void *code = f.code.load(std::memory_order_acquire)) {
+            ++compiled_calls;
+            return call_code(code, args);
+        }
+        _throw("calls to " + f.name + " nested more than "
+               + std::to_string(MAX_INTERPRETED_DEPTH) + " deep", info);
+    }
+
+    ++interpreted_calls;
+    Evaluator evaluator(*this, &f);
+    auto &params = f.definition->proto->args;
+    for (size_t i = 0; i < params.size(); ++i) {
+        evaluator.bind(params[i], args[i]);
+    }
+    ++depth;
+    double result = evaluator.visit(f.definition->body);
+    --depth;
+    return result;
+}
+
+void InterpreterImpl::heat(Function *f, uint64_t n) {
+    if (!f) return;
+    f->heat += n;
+    if (f->heat >= opts.jit_threshold && f->compilable && !f->requested) {
+        request(*f);
+    }
+}
+
+void InterpreterImpl::request(Function &f) {
+    f.requested = true;
+    jit->compile(f.name, [this, &f](void *code) {
+        ++(code? compiled: failed);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            /* Calls from now on go straight to it. */
+            f.code.store(code, std::memory_order_release);
+            f.settled = true;
+        }
+        settled.notify_all();
+    });
+}
+
+void InterpreterImpl::wait_for(Function &f) {
+    if (!f.requested) request(f);
+    std::unique_lock<std::mutex> guard(lock);
+    settled.wait(guard, [&]() { return f.settled; });
+}
+
+/*****************************************************************************
+ * Interpreter: a thin wrapper over InterpreterImpl.
+ */
+
+Interpreter::Interpreter(const std::vector<AST::Declaration> &decls,
+                         RunOptions opts, Report &report)
+    : pimpl(std::make_unique<InterpreterImpl>(decls, opts, report)) {}
+
+Interpreter::~Interpreter() = default;
+
+void Interpreter::run(std::ostream &out) {
+    pimpl->run(out);
+}
+
+std::map<std::string, uint64_t> Interpreter::statistics(void) {
+    return pimpl->statistics();
+}
+
+}
@@ -0,0 +1,79 @@
+/**
+ * @brief Running a program straight from its AST (`kalc --run`), compiling
+ *        only the functions that turn out to be hot.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "AST.hh"
+#include "CodeGenerator.hh"
+#include "Report.hh"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief Knobs controlling how a program is run.
+ */
+struct RunOptions {
+    /**
+     * @brief Calls to a function plus iterations of its loops after which
+     *        it is compiled (in the background), and its code called from
+     *        then on; or 0 to only ever interpret.
+     */
+    uint64_t jit_threshold = 10000;
+
+    /**
+     * @brief How hot functions are compiled.
+     */
+    CodeGenOptions codegen;
+};
+
+class InterpreterImpl;
+
+/**
+ * @brief Runs a program's top-level expressions.
+ *
+ * Functions are interpreted at first, which costs nothing up front but is
+ * slow.  Each one counts its calls and loop iterations, and once there are
+ * enough of them it is compiled on another thread, at full optimization;
+ * calls to it then go straight to its code, whenever that is ready.  (A
+ * call already being interpreted carries on being interpreted.)
+ */
+class Interpreter {
+public:
+    /**
+     * @param decls The program, which must already have compiled without
+     *              errors, and must outlive the `Interpreter`.
+     */
+    Interpreter(const std::vector<AST::Declaration> &decls, RunOptions opts,
+                Report &report);
+
+    ~Interpreter();
+
+    /**
+     * @brief Evaluate the top-level expressions in order, writing each one's
+     *        value to `out` on a line of its own.
+     *
+     * Throws an `Error` on a call to a function that is only declared, and
+     * isn't in this process (e.g. in the C library) either.
+     */
+    void run(std::ostream &out);
+
+    /**
+     * @brief Count the calls interpreted and made to compiled code, and the
+     *        functions compiled.
+     */
+    std::map<std::string, uint64_t> statistics(void);
+
+private:
+    std::unique_ptr<InterpreterImpl> pimpl;
+};
+
+}
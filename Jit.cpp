@@ -0,0 +1,118 @@
+#include <mutex>
+
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+
+#include "Jit.hh"
+#include "runtime/kalrt.h"
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+/**
+ * Let compiled `parfor` loops find the runtime, which kalc is linked with
+ * (but doesn't export), once per process.
+ */
+static void add_runtime_symbols(void) {
+    static std::once_flag added;
+    std::call_once(added, []() {
+        llvm::sys::DynamicLibrary::AddSymbol(
+                "kalrt_parfor", reinterpret_cast<void *>(&kalrt_parfor));
+    });
+}
+
+/** A definition's name, or empty for a top-level expression (or anything
+ *  else). */
+static const std::string &defined_name(const AST::Declaration &decl) {
+    static const std::string none;
+    auto *def = boost::get<std::unique_ptr<AST::FunctionDefinition>>(&decl);
+    return def? (*def)->proto->fname: none;
+}
+
+/*****************************************************************************
+ * Jit implementation.
+ */
+
+Jit::Jit(const std::vector<AST::Declaration> &decls, CodeGenOptions opts,
+         Report &report)
+    : decls(decls), opts(opts), report(report) {
+    add_runtime_symbols();
+    /* Per-thread tables would need thread-local storage, which MCJIT
+     * doesn't support. */
+    this->opts.memo.table = MemoTable::shared;
+    /* Neither is linked with the runtime. */
+    this->opts.profile_generate = false;
+    this->opts.vector_library = VectorLibrary::none;
+    thread = std::thread([this]() { work(); });
+}
+
+Jit::~Jit() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        requests.clear();
+    }
+    ready.notify_one();
+    thread.join();
+}
+
+void Jit::compile(const std::string &name, Done done) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        requests.push_back({name, done});
+    }
+    ready.notify_one();
+}
+
+void Jit::work(void) {
+    for (;;) {
+        std::vector<Request> batch;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ready.wait(guard, [&]() {
+                return stopping || !requests.empty();
+            });
+            if (stopping) return;
+            batch.assign(requests.begin(), requests.end());
+            requests.clear();
+        }
+        compile_batch(batch);
+    }
+}
+
+void Jit::compile_batch(const std::vector<Request> &batch) {
+    std::vector<std::string> names;
+    for (auto &request: batch) names.push_back(request.name);
+    auto span = report.span(names.front(), "jit");
+
+    auto batch_opts = opts;
+    /* Everything else is only there to be inlined. */
+    batch_opts.exports = names;
+    auto codegen = std::make_unique<CodeGenerator>(
+            "jit " + names.front(), llvm::sys::getProcessTriple(),
+            batch_opts);
+    std::vector<void *> addresses;
+    try {
+        for (auto &decl: decls) codegen->declare(decl);
+        for (auto &decl: decls) {
+            if (!defined_name(decl).empty()) (*codegen)(decl);
+        }
+        addresses = codegen->load(names);
+        modules.push_back(std::move(codegen));
+    } catch (Error) {
+        /* E.g. one calls an extern this process doesn't have, which
+         * shouldn't keep the rest from being compiled. */
+        if (batch.size() > 1) {
+            for (auto &request: batch) compile_batch({request});
+            return;
+        }
+        /* It stays interpreted. */
+        addresses.assign(names.size(), nullptr);
+    }
+    for (size_t i = 0; i < batch.size(); ++i) batch[i].done(addresses[i]);
+}
+
+}
@@ -0,0 +1,84 @@
+/**
+ * @brief Compiling functions into the running process in the background,
+ *        for `--run` to swap in for the interpreter.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AST.hh"
+#include "CodeGenerator.hh"
+#include "Report.hh"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief Compiles functions on a thread of its own, as they are asked for.
+ *
+ * Each batch of functions asked for while the last one was compiling is
+ * compiled into a module of its own, along with every function they might
+ * call (which can then be inlined into them).  Their code lasts as long as
+ * the `Jit`.
+ */
+class Jit {
+public:
+    /**
+     * @brief Called on the compiling thread with a function's address, or
+     *        null if it couldn't be compiled.
+     */
+    typedef std::function<void(void *)> Done;
+
+    /**
+     * @param decls The program, which must already have compiled without
+     *              errors, and must outlive the `Jit`.
+     * @param opts  How to compile it.  (Functions are exported as they are
+     *              asked for, and `memo` tables are shared between threads.)
+     */
+    Jit(const std::vector<AST::Declaration> &decls, CodeGenOptions opts,
+        Report &report);
+
+    /**
+     * @brief Stop compiling (after the current batch), and free the code.
+     *
+     * None of it may still be running.
+     */
+    ~Jit();
+
+    /**
+     * @brief Ask for a function to be compiled.
+     */
+    void compile(const std::string &name, Done done);
+
+private:
+    struct Request {
+        std::string name;
+        Done done;
+    };
+
+    void work(void);
+    void compile_batch(const std::vector<Request> &batch);
+
+    const std::vector<AST::Declaration> &decls;
+    CodeGenOptions opts;
+    Report &report;
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Request> requests;
+    bool stopping = false;
+
+    /** Holding the code compiled so far. */
+    std::vector<std::unique_ptr<CodeGenerator>> modules;
+
+    std::thread thread;
+};
+
+}
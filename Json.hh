@@ -0,0 +1,38 @@
+/**
+ * @brief Helpers for writing JSON by hand.
+ */
+
+#pragma once
+
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+namespace Kaleidoscope {
+
+/**
+ * @brief Quote and escape a string for inclusion in JSON.
+ */
+inline std::string json_string(const std::string &s) {
+    std::ostringstream out;
+    out << '"';
+    for (char c: s) {
+        switch (c) {
+        case '"':  out << "\\\""; break;
+        case '\\': out << "\\\\"; break;
+        case '\n': out << "\\n";  break;
+        case '\t': out << "\\t";  break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                    << (int)c << std::dec;
+            } else {
+                out << c;
+            }
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+}
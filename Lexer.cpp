@@ -5,14 +5,22 @@
 namespace Kaleidoscope {
 
 Annotated<int> Lexer::get_token(void) {
-    static int last_char = ' ';
+    ++tokens;
+    if (!timed) return lex_token();
 
+    auto start = std::chrono::steady_clock::now();
+    auto result = lex_token();
+    time_spent += std::chrono::steady_clock::now() - start;
+    return result;
+}
+
+Annotated<int> Lexer::lex_token(void) {
     // Skip any whitespace.
     while (isspace(last_char)) {
         last_char = get_char();
     }
 
-    ErrorInfo info(fname, old_charno, old_lineno, old_charno, old_lineno);
+    ErrorInfo info(source, old_offset, old_offset);
 
     /* An identifier starts with an alphanumeric character, */
     if (isalpha(last_char)) {
@@ -25,19 +33,23 @@ Annotated<int> Lexer::get_token(void) {
             identifier += last_char;
         }
 
-        info.lineno_end = old_lineno;
-        info.charno_end = old_charno;
+        info.end = old_offset;
 
         /* Could be a definition, */
         if (identifier == "def")    return Annotated<int>(info, tok_def);
+        if (identifier == "memo")   return Annotated<int>(info, tok_memo);
+        if (identifier == "export") return Annotated<int>(info, tok_export);
         /* an extern declaration, */
         if (identifier == "extern") return Annotated<int>(info, tok_extern);
+        if (identifier == "builtin") return Annotated<int>(info, tok_builtin);
         /* one of the bits of an "if" block, */
         if (identifier == "if")     return Annotated<int>(info, tok_if);
         if (identifier == "then")   return Annotated<int>(info, tok_then);
         if (identifier == "else")   return Annotated<int>(info, tok_else);
         /* one of the bits of a "for" loop, */
         if (identifier == "for")    return Annotated<int>(info, tok_for);
+        if (identifier == "parfor") return Annotated<int>(info, tok_parfor);
+        if (identifier == "reduce") return Annotated<int>(info, tok_reduce);
         if (identifier == "in")     return Annotated<int>(info, tok_in);
         if (identifier == "var")    return Annotated<int>(info, tok_var);
         /* or an identifier. */
@@ -52,8 +64,7 @@ Annotated<int> Lexer::get_token(void) {
             last_char = get_char();
         } while (isdigit(last_char) || last_char == '.');
 
-        info.lineno_end = old_lineno;
-        info.charno_end = old_charno;
+        info.end = old_offset;
 
         /* Store the lexed number as a float. */
         number = strtod(number_string.c_str(), 0);
@@ -67,31 +78,38 @@ Annotated<int> Lexer::get_token(void) {
         } while (last_char != EOF && last_char != '\n' && last_char != '\r');
 
         if (last_char != EOF) {
-            return get_token();
+            return lex_token();
         }
     }
 
     if (last_char == EOF) return Annotated<int>(info, tok_eof);
 
-    /* If unknown, just return the character. */
     int this_char = last_char;
     last_char = get_char();
+
+    /* Operators of two characters, */
+    int op = this_char == '<' && last_char == '='? tok_le
+           : this_char == '>' && last_char == '='? tok_ge
+           : this_char == '=' && last_char == '='? tok_eq
+           : this_char == '!' && last_char == '='? tok_ne
+           : this_char == '&' && last_char == '&'? tok_and
+           : this_char == '|' && last_char == '|'? tok_or
+           : 0;
+    if (op) {
+        last_char = get_char();
+        info.end = old_offset;
+        return Annotated<int>(info, op);
+    }
+
+    /* otherwise, if unknown, just return the character. */
     return Annotated<int>(info, this_char);
 }
 
 int Lexer::get_char(void) {
-    int next = input->get();
-    old_lineno = lineno;
-    old_charno = charno;
-
-    if (next == '\n' || next == '\r') {
-        ++lineno;
-        charno = 0;
-    } else {
-        ++charno;
-    }
-
-    return next;
+    auto &text = source->text();
+    old_offset = offset;
+    if (offset >= text.size()) return EOF;
+    return (unsigned char)text[offset++];
 }
 
 }
@@ -1,12 +1,11 @@
 #pragma once
 
-#include <fstream>
-#include <istream>
-#include <iostream>
+#include <chrono>
 #include <memory>
 #include <string>
 
 #include "Error.hh"
+#include "Source.hh"
 
 namespace Kaleidoscope {
 
@@ -46,25 +45,62 @@ enum Token {
 
     /** Local variable declaration. */
     tok_var = -11,
+
+    /** Declaration of a function LLVM knows (e.g. `sqrt`). */
+    tok_builtin = -12,
+
+    /** Memoized function definition. */
+    tok_memo = -13,
+
+    /** Parallel for loop. */
+    tok_parfor = -14,
+
+    /** Reduction clause of a parallel for loop. */
+    tok_reduce = -15,
+
+    /** Definition of a function callable from outside the module. */
+    tok_export = -16,
+
+    /** Operators of two characters: `<=`, */
+    tok_le = -17,
+
+    /** `>=`, */
+    tok_ge = -18,
+
+    /** `==`, */
+    tok_eq = -19,
+
+    /** `!=`, */
+    tok_ne = -20,
+
+    /** `&&` */
+    tok_and = -21,
+
+    /** and `||`. */
+    tok_or = -22,
 };
 
 /**
- * @brief Lexer over an input stream.
+ * @brief Lexer over a source held in memory.
  */
 class Lexer {
 public:
 
     /**
-     * @brief Create a new lexer based on the given input stream.
+     * @brief Create a new lexer over the given source.
      *
-     * @param input Input stream to lex.
+     * @param source Source to lex.
+     * @param timed  Keep track of the time spent lexing; see `time_spent`.
      */
-    inline Lexer(std::string f)
-        : identifier(), number(0.0), old_lineno(0),
-          old_charno(0), lineno(0), charno(0) {
-        fname = std::make_shared<std::string>(f);
-        input = std::make_unique<std::ifstream>(f);
-    }
+    inline Lexer(std::shared_ptr<const Source> source, bool timed=false)
+        : identifier(), number(0.0), last_char(' '), source(source),
+          offset(0), old_offset(0), tokens(0), timed(timed), time_spent(0) {}
+
+    /**
+     * @brief Create a new lexer over the named file, read in whole.
+     */
+    inline Lexer(std::string f, bool timed=false)
+        : Lexer(Source::read_file(f), timed) {}
 
     /**
      * @brief Lex the next token from the input stream.
@@ -87,17 +123,35 @@ public:
      */
     inline double get_number(void) const { return number; }
 
+    /**
+     * @brief Return the number of tokens lexed so far.
+     */
+    inline uint64_t token_count(void) const { return tokens; }
+
+    /**
+     * @brief Return the total time spent in `get_token`, if the lexer was
+     *        constructed with `timed` set (and zero otherwise).
+     */
+    inline std::chrono::nanoseconds get_time_spent(void) const {
+        return time_spent;
+    }
+
 private:
+    Annotated<int> lex_token(void);
     int get_char(void);
 
     std::string identifier;
     double number;
-    std::shared_ptr<std::string> fname;
-    std::unique_ptr<std::istream> input;
-    int old_lineno;
-    int old_charno;
-    int lineno;
-    int charno;
+    /** One character of lookahead. */
+    int last_char;
+    std::shared_ptr<const Source> source;
+    /** Offset of the next character to read. */
+    uint32_t offset;
+    /** Offset of `last_char`. */
+    uint32_t old_offset;
+    uint64_t tokens;
+    bool timed;
+    std::chrono::nanoseconds time_spent;
 };
 
 }
@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "Library.hh"
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+/** The first line of a library. */
+static const char *const LIBRARY_HEADER = "# kalc library 1";
+
+/** Starts the line giving the target triple. */
+static const char *const TARGET_PREFIX = "# target ";
+
+/** Starts the line giving the size of the bitcode, which follows it. */
+static const char *const BITCODE_PREFIX = "# bitcode ";
+
+[[noreturn]] static void _throw(std::string msg, ErrorInfo info) {
+    throw Error("Library error", msg, info);
+}
+
+/** Does the value refer to something private to its module, which a copy
+ *  of a function in another module couldn't share: an internal function,
+ *  or an internal global that isn't constant? */
+static bool private_to_module(const llvm::Value *v) {
+    if (auto *global = llvm::dyn_cast<llvm::GlobalValue>(v)) {
+        auto *var = llvm::dyn_cast<llvm::GlobalVariable>(global);
+        return global->hasLocalLinkage() && !(var && var->isConstant());
+    }
+    if (auto *expr = llvm::dyn_cast<llvm::ConstantExpr>(v)) {
+        for (auto &op: expr->operands()) {
+            if (private_to_module(op)) return true;
+        }
+    }
+    return false;
+}
+
+/** Can a copy of the function's body stand in for it in another module? */
+static bool importable(const llvm::Function &f) {
+    for (auto &bb: f) {
+        for (auto &inst: bb) {
+            for (auto &op: inst.operands()) {
+                if (private_to_module(op)) return false;
+            }
+        }
+    }
+    return true;
+}
+
+/** A prototype as it would be written in a source file. */
+static std::string declaration(const AST::FunctionPrototype &proto) {
+    std::string result = proto.builtin? "builtin ": "extern ";
+    result += proto.fname + "(";
+    for (size_t i = 0; i < proto.args.size(); ++i) {
+        if (i) result += " ";
+        result += proto.args[i];
+        if (proto.arg_types[i] == AST::Type::array) result += "[]";
+    }
+    return result + ")";
+}
+
+/*****************************************************************************
+ * Reading and writing libraries.
+ */
+
+Library read_library(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        _throw("cannot read " + path,
+               ErrorInfo(std::make_shared<Source>(path, ""), 0, 0));
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    const std::string text = contents.str();
+
+    /* The interface is everything up to the bitcode's line. */
+    size_t marker = text.find(std::string("\n") + BITCODE_PREFIX);
+    size_t first_line = std::min(text.find('\n'), text.size());
+    if (text.compare(0, first_line, LIBRARY_HEADER) != 0
+     || marker == std::string::npos) {
+        auto source = std::make_shared<Source>(path,
+                                               text.substr(0, first_line));
+        _throw("not a library written by kalc --emit-kpm",
+               ErrorInfo(source, 0, first_line));
+    }
+    Library result;
+    result.interface = std::make_shared<Source>(path,
+                                                text.substr(0, marker + 1));
+
+    size_t target = first_line + 1;
+    size_t target_end = text.find('\n', target);
+    if (text.compare(target, strlen(TARGET_PREFIX), TARGET_PREFIX) != 0) {
+        _throw("expected the library's target triple",
+               ErrorInfo(result.interface, target, target_end));
+    }
+    target += strlen(TARGET_PREFIX);
+    result.triple = text.substr(target, target_end - target);
+
+    size_t size_start = marker + 1 + strlen(BITCODE_PREFIX);
+    size_t size_end = text.find('\n', size_start);
+    std::istringstream size_in(text.substr(size_start,
+                                           size_end - size_start));
+    size_t size;
+    if (size_end == std::string::npos || !(size_in >> size)
+     || size != text.size() - size_end - 1) {
+        _throw(path + " is truncated or corrupt",
+               ErrorInfo(result.interface, 0, first_line));
+    }
+    result.bitcode = text.substr(size_end + 1);
+    return result;
+}
+
+void write_library(llvm::raw_ostream &out, const llvm::Module &module,
+                   const std::vector<AST::FunctionPrototype> &declared) {
+    auto code = llvm::CloneModule(&module);
+    for (auto &f: *code) {
+        if (!f.isDeclaration() && !f.hasLocalLinkage() && !importable(f)) {
+            f.deleteBody();
+        }
+    }
+    /* E.g. the registration of profile counters, which belongs to the
+     * library's own object code. */
+    if (auto *ctors = code->getNamedGlobal("llvm.global_ctors")) {
+        ctors->eraseFromParent();
+    }
+    /* Drop whatever is private to the module and no longer used. */
+    llvm::legacy::PassManager passes;
+    passes.add(llvm::createGlobalDCEPass());
+    passes.run(*code);
+
+    llvm::SmallVector<char, 0> bitcode;
+    llvm::raw_svector_ostream bitcode_out(bitcode);
+    llvm::WriteBitcodeToFile(code.get(), bitcode_out);
+
+    out << LIBRARY_HEADER << "\n"
+        << TARGET_PREFIX << module.getTargetTriple() << "\n";
+    for (auto &proto: declared) out << declaration(proto) << "\n";
+    out << BITCODE_PREFIX << bitcode.size() << "\n";
+    out.write(bitcode.data(), bitcode.size());
+}
+
+}
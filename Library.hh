@@ -0,0 +1,53 @@
+/**
+ * @brief Precompiled libraries (`.kpm` files): a library's interface and
+ *        optimized code, so that programs using it can call (and inline) its
+ *        functions without compiling its sources again.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "AST.hh"
+#include "Error.hh"
+#include "Source.hh"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief A precompiled library, as read from a `.kpm` file.
+ *
+ * The file starts with a header, the target triple it was compiled for and
+ * its interface: a declaration of each of its functions (and of those it
+ * declares itself, e.g. the C library's), as Kaleidoscope source.  The
+ * bitcode of its optimized module follows, after a line giving its size.
+ */
+struct Library {
+    /** The header and declarations, named after the file. */
+    std::shared_ptr<const Source> interface;
+    std::string triple;
+    std::string bitcode;
+};
+
+/**
+ * @brief Read a library written by `write_library`.
+ */
+Library read_library(const std::string &path);
+
+/**
+ * @brief Write a module's library: the declarations of the functions
+ *        callable from outside it, and its code.
+ *
+ * Only the bodies of functions that stand alone are kept: one that uses
+ * anything private to the module (e.g. an internal function, or the table of
+ * a `memo` function) is left declared, and can only be called.
+ */
+void write_library(llvm::raw_ostream &, const llvm::Module &,
+                   const std::vector<AST::FunctionPrototype> &declared);
+
+}
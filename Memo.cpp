@@ -0,0 +1,241 @@
+#include <string>
+#include <vector>
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MathExtras.h"
+
+#include "Memo.hh"
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+/** 2^64 divided by the golden ratio.  Multiplying by it mixes every bit of
+ *  a key into the high bits of the product (Fibonacci hashing). */
+static const uint64_t HASH_MULTIPLIER = 0x9e3779b97f4a7c15ull;
+
+/** Entries are arrays of i64s (so that they can be accessed atomically):
+ *  the state, the bit patterns of the arguments, then that of the result.
+ *
+ *  The state is 0 while the entry is empty.  In per-thread tables it is
+ *  then 2; in shared tables it is a sequence number, odd while the entry is
+ *  being written. */
+static const unsigned STATE = 0;
+
+/**
+ * @brief Loads and stores of the words of one table entry.
+ *
+ * Shared tables are accessed atomically.  Per-thread accesses are volatile
+ * instead: callers of the memoized function claim not to touch memory, so
+ * LLVM must not reason about the table across calls to them.
+ */
+class Entry {
+public:
+    Entry(llvm::IRBuilder<> &builder, llvm::Value *entry, bool shared)
+        : builder(builder), entry(entry), shared(shared) {}
+
+    llvm::Value *load(unsigned word, const char *name,
+                      llvm::AtomicOrdering ordering=llvm::Monotonic) {
+        auto *result = builder.CreateLoad(address(word), name);
+        if (shared) {
+            result->setAlignment(8);
+            result->setAtomic(ordering);
+        } else {
+            result->setVolatile(true);
+        }
+        return result;
+    }
+
+    void store(unsigned word, llvm::Value *value,
+               llvm::AtomicOrdering ordering=llvm::Monotonic) {
+        auto *result = builder.CreateStore(value, address(word));
+        if (shared) {
+            result->setAlignment(8);
+            result->setAtomic(ordering);
+        } else {
+            result->setVolatile(true);
+        }
+    }
+
+    llvm::Value *address(unsigned word) {
+        auto *i32 = llvm::Type::getInt32Ty(builder.getContext());
+        return builder.CreateInBoundsGEP(
+                entry, {llvm::ConstantInt::get(i32, 0),
+                        llvm::ConstantInt::get(i32, word)});
+    }
+
+private:
+    llvm::IRBuilder<> &builder;
+    llvm::Value *entry;
+    bool shared;
+};
+
+/*****************************************************************************
+ * Memoization implementation.
+ */
+
+llvm::Function *memoize(llvm::Function &f, unsigned capacity,
+                        const MemoOptions &opts) {
+    auto &module = *f.getParent();
+    auto &context = f.getContext();
+    auto *i64 = llvm::Type::getInt64Ty(context);
+    bool shared = opts.table == MemoTable::shared;
+    unsigned result_word = f.arg_size() + 1;
+
+    unsigned bits = llvm::Log2_32_Ceil(capacity);
+    auto *entry_type = llvm::ArrayType::get(i64, f.arg_size() + 2);
+    auto *table_type = llvm::ArrayType::get(entry_type, 1ull << bits);
+
+    std::string name = f.getName();
+    auto linkage = f.getLinkage();
+    f.setName(name + ".uncached");
+    f.setLinkage(llvm::GlobalValue::InternalLinkage);
+
+    auto *table = new llvm::GlobalVariable(
+            module, table_type, false, llvm::GlobalValue::InternalLinkage,
+            llvm::ConstantAggregateZero::get(table_type), name + ".memo");
+    table->setThreadLocal(!shared);
+    /* Line up entries with cache lines, as far as their size allows. */
+    table->setAlignment(64);
+
+    auto *memo = llvm::Function::Create(f.getFunctionType(), linkage, name,
+                                        &module);
+    /* Callers of an internal f may already use `fastcc`. */
+    memo->setCallingConv(f.getCallingConv());
+    /* Including f's recursive calls to itself. */
+    f.replaceAllUsesWith(memo);
+    /* `memo` reads and writes its table, so unlike f it isn't `readnone`.
+     * But it is as pure as f to its callers, which were marked `readnone`
+     * when f was; keeping it out of line keeps the table's accesses out of
+     * their bodies, so that they still don't access memory. */
+    memo->addFnAttr(llvm::Attribute::NoInline);
+    memo->addFnAttr(llvm::Attribute::NoUnwind);
+
+    auto *entry_bb = llvm::BasicBlock::Create(context, "entry", memo);
+    auto *check_bb = llvm::BasicBlock::Create(context, "check", memo);
+    auto *hit_bb = llvm::BasicBlock::Create(context, "hit", memo);
+    auto *miss_bb = llvm::BasicBlock::Create(context, "miss", memo);
+    auto *write_bb = llvm::BasicBlock::Create(context, "write", memo);
+    auto *done_bb = llvm::BasicBlock::Create(context, "done", memo);
+    llvm::IRBuilder<> builder(entry_bb);
+
+    /* Hash the arguments' bit patterns. */
+    std::vector<llvm::Value *> args, keys;
+    llvm::Value *hash = llvm::ConstantInt::get(i64, 0);
+    auto f_arg = f.arg_begin();
+    for (auto &arg: memo->args()) {
+        arg.setName(f_arg++->getName());
+        args.push_back(&arg);
+        keys.push_back(arg.getType()->isPointerTy()
+                ? builder.CreatePtrToInt(&arg, i64, "key")
+                : builder.CreateBitCast(&arg, i64, "key"));
+        hash = builder.CreateMul(builder.CreateXor(hash, keys.back()),
+                                 llvm::ConstantInt::get(i64, HASH_MULTIPLIER),
+                                 "hash");
+    }
+    /* The high bits are the best mixed. */
+    llvm::Value *index = bits == 0? llvm::ConstantInt::get(i64, 0)
+                                  : builder.CreateLShr(hash, 64 - bits,
+                                                       "index");
+    Entry entry(builder,
+                builder.CreateInBoundsGEP(
+                    table, {llvm::ConstantInt::get(i64, 0), index}, "entry"),
+                shared);
+
+    /* Is the entry full (and not being written)? */
+    auto *zero = llvm::ConstantInt::get(i64, 0);
+    auto *state = entry.load(STATE, "state", llvm::Acquire);
+    llvm::Value *full = builder.CreateICmpNE(state, zero, "full");
+    if (shared) {
+        auto *even = builder.CreateICmpEQ(
+                builder.CreateAnd(state, llvm::ConstantInt::get(i64, 1)),
+                zero, "even");
+        full = builder.CreateAnd(full, even, "full");
+    }
+    builder.CreateCondBr(full, check_bb, miss_bb);
+
+    /* Does it hold these arguments? */
+    builder.SetInsertPoint(check_bb);
+    llvm::Value *match = llvm::ConstantInt::getTrue(context);
+    for (unsigned i = 0; i < keys.size(); ++i) {
+        auto *key = entry.load(STATE + 1 + i, "cached_key");
+        match = builder.CreateAnd(match,
+                                  builder.CreateICmpEQ(key, keys[i]),
+                                  "match");
+    }
+    auto *cached = entry.load(result_word, "cached");
+    if (shared) {
+        /* And was none of it overwritten while we were reading? */
+        builder.CreateFence(llvm::Acquire);
+        auto *again = entry.load(STATE, "state_again");
+        match = builder.CreateAnd(match, builder.CreateICmpEQ(again, state),
+                                  "match");
+    }
+    builder.CreateCondBr(match, hit_bb, miss_bb);
+
+    builder.SetInsertPoint(hit_bb);
+    builder.CreateRet(builder.CreateBitCast(cached, f.getReturnType()));
+
+    /* Compute the result, and try to cache it. */
+    builder.SetInsertPoint(miss_bb);
+    auto *result = builder.CreateCall(&f, args, "result");
+    result->setCallingConv(f.getCallingConv());
+    /* The call may itself have filled the entry (or, with a shared table,
+     * another thread may have). */
+    auto *now = entry.load(STATE, "state_now");
+    if (shared) {
+        auto *claim_bb = llvm::BasicBlock::Create(context, "claim", memo,
+                                                  write_bb);
+        llvm::Value *writable = builder.CreateICmpEQ(
+                builder.CreateAnd(now, llvm::ConstantInt::get(i64, 1)), zero,
+                "writable");
+        if (opts.eviction == MemoEviction::keep) {
+            writable = builder.CreateAnd(
+                    writable, builder.CreateICmpEQ(now, zero), "writable");
+        }
+        builder.CreateCondBr(writable, claim_bb, done_bb);
+
+        /* Make the sequence number odd, unless someone else got there
+         * first, in which case let them have it. */
+        builder.SetInsertPoint(claim_bb);
+        auto *writing = builder.CreateAdd(now, llvm::ConstantInt::get(i64, 1),
+                                          "writing");
+        auto *claim = builder.CreateAtomicCmpXchg(
+                entry.address(STATE), now, writing, llvm::AcquireRelease,
+                llvm::Monotonic);
+        builder.CreateCondBr(builder.CreateExtractValue(claim, 1),
+                             write_bb, done_bb);
+    } else if (opts.eviction == MemoEviction::keep) {
+        builder.CreateCondBr(builder.CreateICmpEQ(now, zero, "empty"),
+                             write_bb, done_bb);
+    } else {
+        builder.CreateBr(write_bb);
+    }
+
+    builder.SetInsertPoint(write_bb);
+    if (shared) builder.CreateFence(llvm::Release);
+    for (unsigned i = 0; i < keys.size(); ++i) {
+        entry.store(STATE + 1 + i, keys[i]);
+    }
+    entry.store(result_word, builder.CreateBitCast(result, i64));
+    entry.store(STATE,
+                shared? builder.CreateAdd(now, llvm::ConstantInt::get(i64, 2))
+                      : llvm::ConstantInt::get(i64, 2),
+                llvm::Release);
+    builder.CreateBr(done_bb);
+
+    builder.SetInsertPoint(done_bb);
+    builder.CreateRet(result);
+
+    return memo;
+}
+
+}
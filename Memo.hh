@@ -0,0 +1,31 @@
+/**
+ * @brief Caching the results of `memo` functions.
+ */
+
+#pragma once
+
+#include "llvm/IR/Function.h"
+
+#include "CodeGenerator.hh"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief Route every call to a function through a table of its results,
+ *        keyed on the bit patterns of its arguments.
+ *
+ * The function is renamed `<name>.uncached` and made internal.  A new
+ * function takes its name (and its place in every call, including recursive
+ * ones), looks the arguments up in the table and only calls the original on
+ * a miss.  The table is direct-mapped, with `capacity` (rounded up to a
+ * power of two) entries.
+ *
+ * The function must not access memory (i.e. must be `readnone`): otherwise
+ * a cached result could differ from what a call would return.
+ *
+ * @return The new function.
+ */
+llvm::Function *memoize(llvm::Function &, unsigned capacity,
+                        const MemoOptions &);
+
+}
@@ -1,6 +1,5 @@
 #include "Parser.hh"
 
-#include <iostream>
 #include <map>
 #include <vector>
 
@@ -10,10 +9,18 @@ namespace Kaleidoscope {
  * Utilities.
  */
 
-/** Associate operators with their precedence. */
-static const std::map<char, int> BINOP_PRECEDENCE {
+/** Associate operators (characters, or tokens for those of two characters)
+ *  with their precedence. */
+static const std::map<int, int> BINOP_PRECEDENCE {
     {'=', 2},
+    {tok_or, 4},
+    {tok_and, 6},
+    {tok_eq, 8},
+    {tok_ne, 8},
     {'<', 10},
+    {'>', 10},
+    {tok_le, 10},
+    {tok_ge, 10},
     {'+', 20},
     {'-', 20},
     {'*', 40},
@@ -21,9 +28,7 @@ static const std::map<char, int> BINOP_PRECEDENCE {
 };
 
 static ErrorInfo merge(ErrorInfo start, ErrorInfo end) {
-    return ErrorInfo(start.filename,
-                     start.charno_start, start.lineno_start,
-                     end.charno_end,     end.lineno_end);
+    return ErrorInfo(start.source, start.start, end.end);
 }
 
 [[noreturn]] static void _throw(std::string msg, ErrorInfo annotation) {
@@ -32,9 +37,6 @@ static ErrorInfo merge(ErrorInfo start, ErrorInfo end) {
 
 /* Look up the precedence of the current token. */
 int Parser::get_token_precedence(void) const {
-    if (!isascii(cur_token.second))
-        return -1;
-
     /* Can't just use operator[] because `BINOP_PRECEDENCE` is `const`. */
     if (BINOP_PRECEDENCE.count(cur_token.second) == 0) return -1;
 
@@ -44,8 +46,13 @@ int Parser::get_token_precedence(void) const {
     return result;
 }
 
-Parser::Parser(std::string input)
-    : lexer(input), cur_token(ErrorInfo(nullptr, 0, 0, 0, 0), 0) {
+Parser::Parser(std::string input, bool time_lexer)
+    : lexer(input, time_lexer), cur_token(ErrorInfo(nullptr, 0, 0), 0) {
+    shift_token();
+}
+
+Parser::Parser(std::shared_ptr<const Source> source, bool time_lexer)
+    : lexer(source, time_lexer), cur_token(ErrorInfo(nullptr, 0, 0), 0) {
     shift_token();
 }
 
@@ -88,6 +95,19 @@ AST::Expression Parser::parse_identifier(void) {
     /* Shift the identifier. */
     shift_token();
 
+    /* An array element looks like `name[index]`. */
+    if (cur_token.second == '[') {
+        shift_token();
+        auto index = parse_expression();
+        if (cur_token.second != ']') {
+            _throw("expected ']' after array index",
+                   merge(start, cur_token.first));
+        }
+        auto info = merge(start, cur_token.first);
+        shift_token();
+        return std::make_unique<AST::ArrayIndex>(id, std::move(index), info);
+    }
+
     /* Unless this is a function call, */
     if (cur_token.second != '(') {
         /* it's a variable. */
@@ -133,6 +153,7 @@ AST::Expression Parser::parse_primary(void) {
         case tok_if:
             return parse_if_then_else();
         case tok_for:
+        case tok_parfor:
             return parse_for_loop();
         case tok_var:
             return parse_local_var();
@@ -206,8 +227,25 @@ AST::Expression Parser::parse_if_then_else(void){
 
 AST::Expression Parser::parse_for_loop(void) {
     auto start = cur_token.first;
-    /* Shift "for". */
-    shift_token();
+    bool parallel = cur_token.second == tok_parfor;
+    /* Shift "for" (or "parfor"). */
+    unsigned chunk = 0;
+    if (shift_token() == '(' && parallel) {
+        /* An explicit chunk size. */
+        if (shift_token() != tok_number) {
+            _throw("expected chunk size after 'parfor('", cur_token.first);
+        }
+        double size = lexer.get_number();
+        if (size < 1 || size > UINT32_MAX || size != (uint32_t)size) {
+            _throw("parfor chunk size must be a positive whole number",
+                   cur_token.first);
+        }
+        chunk = size;
+        if (shift_token() != ')') {
+            _throw("expected ')' after parfor chunk size", cur_token.first);
+        }
+        shift_token();
+    }
 
     if (cur_token.second != tok_identifier) {
         _throw("expected identifier as loop index",
@@ -241,6 +279,26 @@ AST::Expression Parser::parse_for_loop(void) {
         incr = parse_expression();
     }
 
+    /* An unnamed reduction is the loop's own value. */
+    std::vector<AST::Reduction> reductions;
+    char reduce_op = 0;
+    if (cur_token.second == tok_reduce) {
+        for (auto &reduction: parse_reductions()) {
+            if (!reduction.var.empty()) {
+                if (!parallel) {
+                    _throw("only parfor loops can reduce into variables",
+                           reduction.info);
+                }
+                reductions.push_back(reduction);
+            } else if (reduce_op) {
+                _throw("a loop can only have one unnamed reduction",
+                       reduction.info);
+            } else {
+                reduce_op = reduction.op;
+            }
+        }
+    }
+
     if (cur_token.second != tok_in) {
         _throw("expected \"in\" after for loop",
                merge(start, cur_token.first));
@@ -250,9 +308,41 @@ AST::Expression Parser::parse_for_loop(void) {
 
     auto body = parse_expression();
 
-    return std::make_unique<AST::ForLoop>(
+    auto result = std::make_unique<AST::ForLoop>(
             idx, std::move(init), std::move(term),
             std::move(incr), std::move(body), merge(start, cur_token.first));
+    result->parallel = parallel;
+    result->chunk = chunk;
+    result->reductions = std::move(reductions);
+    result->reduce_op = reduce_op;
+    return result;
+}
+
+std::vector<AST::Reduction> Parser::parse_reductions(void) {
+    std::vector<AST::Reduction> result;
+    do {
+        /* Shift "reduce" (or the comma). */
+        shift_token();
+        auto start = cur_token.first;
+        int op = cur_token.second;
+        if (op == tok_identifier && lexer.get_identifier() == "min") {
+            op = '<';
+        } else if (op == tok_identifier && lexer.get_identifier() == "max") {
+            op = '>';
+        } else if (op != '+' && op != '*') {
+            _throw("expected '+', '*', 'min' or 'max' in reduction",
+                   cur_token.first);
+        }
+        if (shift_token() != tok_identifier) {
+            /* Unnamed. */
+            result.emplace_back(op, "", start);
+            continue;
+        }
+        result.emplace_back(op, lexer.get_identifier(),
+                            merge(start, cur_token.first));
+        shift_token();
+    } while (cur_token.second == ',');
+    return result;
 }
 
 AST::Expression Parser::parse_local_var(void) {
@@ -312,18 +402,34 @@ std::unique_ptr<AST::FunctionPrototype> Parser::parse_prototype(void) {
         _throw("expected '(' in prototype", cur_token.first);
     }
 
-    /* Read the list of argument names. */
+    /* Read the list of argument names, each followed by `[]` if it is an
+     * array. */
     std::vector<std::string> args;
-    while (shift_token() == tok_identifier)
+    std::vector<AST::Type> arg_types;
+    shift_token();
+    while (cur_token.second == tok_identifier) {
         args.push_back(lexer.get_identifier());
+        arg_types.push_back(AST::Type::number);
+        if (shift_token() == '[') {
+            if (shift_token() != ']') {
+                _throw("expected ']' after '[' in prototype",
+                       cur_token.first);
+            }
+            arg_types.back() = AST::Type::array;
+            shift_token();
+        }
+    }
     if (cur_token.second != ')') {
         _throw("expected ')' in prototype", cur_token.first);
     }
 
+    auto info = merge(start, cur_token.first);
     /* Shift the closing parenthesis. */
     shift_token();
 
-    return std::make_unique<AST::FunctionPrototype>(fname, std::move(args));
+    return std::make_unique<AST::FunctionPrototype>(fname, std::move(args),
+                                                    std::move(arg_types),
+                                                    info);
 }
 
 AST::Declaration Parser::parse_definition(void) {
@@ -340,14 +446,70 @@ AST::Declaration Parser::parse_definition(void) {
                                                      std::move(body));
 }
 
+AST::Declaration Parser::parse_memo_definition(void) {
+    auto start = cur_token.first;
+    /* Shift "memo". */
+    unsigned capacity = 0;
+    if (shift_token() == '(') {
+        /* An explicit table size. */
+        if (shift_token() != tok_number) {
+            _throw("expected table size after 'memo('", cur_token.first);
+        }
+        double size = lexer.get_number();
+        if (size < 1 || size > (1 << 24) || size != (unsigned)size) {
+            _throw("memo table size must be a whole number from 1 to 2^24",
+                   cur_token.first);
+        }
+        capacity = size;
+        if (shift_token() != ')') {
+            _throw("expected ')' after memo table size", cur_token.first);
+        }
+        shift_token();
+    }
+    if (cur_token.second != tok_def) {
+        _throw("expected 'def' after 'memo'", merge(start, cur_token.first));
+    }
+
+    auto result = parse_definition();
+    if (auto *def =
+            boost::get<std::unique_ptr<AST::FunctionDefinition>>(&result)) {
+        (*def)->memo = true;
+        (*def)->memo_capacity = capacity;
+    }
+    return result;
+}
+
+AST::Declaration Parser::parse_export(void) {
+    auto start = cur_token.first;
+    /* Shift "export". */
+    shift_token();
+    AST::Declaration result;
+    if (cur_token.second == tok_def) {
+        result = parse_definition();
+    } else if (cur_token.second == tok_memo) {
+        result = parse_memo_definition();
+    } else {
+        _throw("expected 'def' or 'memo' after 'export'",
+               merge(start, cur_token.first));
+    }
+
+    if (auto *def =
+            boost::get<std::unique_ptr<AST::FunctionDefinition>>(&result)) {
+        (*def)->exported = true;
+    }
+    return result;
+}
+
 AST::Declaration Parser::parse_extern(void) {
-    /* Shift "extern". */
+    bool builtin = cur_token.second == tok_builtin;
+    /* Shift "extern" (or "builtin"). */
     shift_token();
     /* Other than that, an extern is a normal prototype.*/
     auto result = parse_prototype();
 
     if (!result) return AST::Error{};
-    return std::move(result);
+    result->builtin = builtin;
+    return result;
 }
 
 AST::Declaration Parser::parse_top_level(void) {
@@ -357,7 +519,8 @@ AST::Declaration Parser::parse_top_level(void) {
     /* Turn it into the body of an anonymous prototype. */
     auto proto =
         std::make_unique<AST::FunctionPrototype>("",
-                                                 std::vector<std::string>());
+                                                 std::vector<std::string>(),
+                                                 AST::get_info(expr));
     return std::make_unique<AST::FunctionDefinition>(
             AST::FunctionDefinition(std::move(proto), std::move(expr)));
 }
@@ -367,7 +530,6 @@ AST::Declaration Parser::parse(void) {
     try {
         switch (cur_token.second) {
         case tok_eof:
-            std::cerr << "Hit end of file." << std::endl;
             return AST::Error{};
         case ';': // ignore top-level semicolons.
             shift_token();
@@ -375,7 +537,14 @@ AST::Declaration Parser::parse(void) {
         case tok_def:
             result = parse_definition();
             break;
+        case tok_memo:
+            result = parse_memo_definition();
+            break;
+        case tok_export:
+            result = parse_export();
+            break;
         case tok_extern:
+        case tok_builtin:
             result = parse_extern();
             break;
         default:
@@ -394,4 +563,12 @@ bool Parser::reached_end(void) const {
     return cur_token.second == tok_eof;
 }
 
+uint64_t Parser::token_count(void) const {
+    return lexer.token_count();
+}
+
+std::chrono::nanoseconds Parser::lexer_time(void) const {
+    return lexer.get_time_spent();
+}
+
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <memory>
 
 #include "AST.hh"
@@ -26,24 +27,35 @@ private:
     AST::Expression parse_binop_rhs(int prec, AST::Expression lhs);
     AST::Expression parse_if_then_else(void);
     AST::Expression parse_for_loop(void);
+    std::vector<AST::Reduction> parse_reductions(void);
     AST::Expression parse_local_var(void);
     AST::Expression parse_primary(void);
     AST::Expression parse_expression(void);
 
     std::unique_ptr<AST::FunctionPrototype> parse_prototype(void);
     AST::Declaration parse_definition(void);
+    AST::Declaration parse_memo_definition(void);
+    AST::Declaration parse_export(void);
     AST::Declaration parse_extern(void);
 
     AST::Declaration parse_top_level(void);
 
 public:
-    Parser(std::string input);
+    /**
+     * @param time_lexer Keep track of the time spent in the lexer.
+     */
+    Parser(std::string input, bool time_lexer=false);
+
+    /**
+     * @brief Parse a source already in memory.
+     */
+    Parser(std::shared_ptr<const Source> source, bool time_lexer=false);
 
     /**
      * @brief Parse and return a top-level AST node.
      *
-     * Returns `nullptr` and prints a message to std::cerr in case of an
-     * error.  Returns `nullptr` in case of EOF.
+     * Throws an `Error` (having skipped the offending token) in case of a
+     * syntax error.  Returns an empty `AST::Error` in case of EOF.
      */
     AST::Declaration parse(void);
 
@@ -51,6 +63,16 @@ public:
      * @brief Have we reached the end of the input stream?
      */
     bool reached_end(void) const;
+
+    /**
+     * @brief Return the number of tokens lexed so far.
+     */
+    uint64_t token_count(void) const;
+
+    /**
+     * @brief Return the time spent in the lexer (if `time_lexer` was set).
+     */
+    std::chrono::nanoseconds lexer_time(void) const;
 };
 
 }
@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <set>
+#include <sstream>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "Analysis.hh"
+#include "Profile.hh"
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+/** The first line of a profile; see runtime/profile.c. */
+static const char *const PROFILE_HEADER = "kalprof 1";
+
+[[noreturn]] static void _throw(std::string msg, ErrorInfo info) {
+    throw Error("Profile error", msg, info);
+}
+
+/** Functions with counters: those defined in the module, apart from the
+ *  anonymous functions of top-level expressions and the libraries' functions
+ *  (which are counted where they are compiled). */
+static bool counted(const llvm::Function &f) {
+    return !f.isDeclaration() && f.hasName()
+        && !f.hasAvailableExternallyLinkage();
+}
+
+/** The conditional branches of a function, in order. */
+static std::vector<llvm::BranchInst *> branches(llvm::Function &f) {
+    std::vector<llvm::BranchInst *> result;
+    for (auto &bb: f) {
+        auto *br = llvm::dyn_cast<llvm::BranchInst>(bb.getTerminator());
+        if (br && br->isConditional()) result.push_back(br);
+    }
+    return result;
+}
+
+/** FNV-1a over the shape of a function's code (its blocks and their
+ *  instructions' opcodes), which is all that its counters depend on. */
+static uint64_t code_hash(const llvm::Function &f) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&hash](uint64_t word) {
+        for (int i = 0; i < 64; i += 8) {
+            hash ^= (word >> i) & 0xff;
+            hash *= 0x100000001b3ull;
+        }
+    };
+    for (auto &bb: f) {
+        mix(bb.size());
+        for (auto &inst: bb) mix(inst.getOpcode());
+    }
+    return hash;
+}
+
+/** Functions that run on the thread pool: the bodies of `parfor` loops,
+ *  and everything they call. */
+static std::set<llvm::Function *> parallel_functions(llvm::Module &module) {
+    std::vector<llvm::Function *> work;
+    for (auto &f: module) {
+        for (auto &bb: f) {
+            for (auto &inst: bb) {
+                auto *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+                auto *body = call? parallel_body(*call): nullptr;
+                if (body) work.push_back(body);
+            }
+        }
+    }
+
+    std::set<llvm::Function *> result;
+    while (!work.empty()) {
+        auto *f = work.back();
+        work.pop_back();
+        if (!result.insert(f).second) continue;
+        for (auto &bb: *f) {
+            for (auto &inst: bb) {
+                auto *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+                auto *callee = call? call->getCalledFunction(): nullptr;
+                if (callee && !callee->isDeclaration()) work.push_back(callee);
+            }
+        }
+    }
+    return result;
+}
+
+/** Branch weights are 32 bits: scale counts down to fit, keeping them
+ *  non-zero (so that a branch never taken is unlikely, not impossible). */
+static std::vector<uint32_t> weights(std::vector<uint64_t> counts) {
+    uint64_t max = *std::max_element(counts.begin(), counts.end());
+    uint64_t scale = max / std::numeric_limits<uint32_t>::max() + 1;
+    std::vector<uint32_t> result;
+    for (auto count: counts) result.push_back(count / scale + 1);
+    return result;
+}
+
+/*****************************************************************************
+ * Reading profiles.
+ */
+
+Profile read_profile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        _throw("cannot read " + path,
+               ErrorInfo(std::make_shared<Source>(path, ""), 0, 0));
+    }
+    auto source = Source::read_stream(path, file);
+    auto &text = source->text();
+
+    Profile result;
+    uint32_t start = 0;
+    for (unsigned line = 0; start < text.size(); ++line) {
+        uint32_t end = std::min(text.find('\n', start), text.size());
+        ErrorInfo info(source, start, end);
+        std::istringstream in(text.substr(start, end - start));
+        start = end + 1;
+
+        if (line == 0) {
+            if (in.str() != PROFILE_HEADER) {
+                _throw("not a profile written by a --profile-generate build",
+                       info);
+            }
+            continue;
+        }
+        std::string name;
+        FunctionProfile function{0, {}, info};
+        size_t n;
+        if (!(in >> name >> std::hex >> function.hash >> std::dec >> n)
+         || n == 0 || n > text.size()) {
+            _throw("expected a function name, hash and number of counters",
+                   info);
+        }
+        function.counts.resize(n);
+        for (auto &count: function.counts) {
+            if (!(in >> count)) _throw("expected " + std::to_string(n)
+                                     + " counts for " + name, info);
+        }
+        if (!(in >> std::ws).eof()) _throw("unexpected text after the counts "
+                                         "for " + name, info);
+        result.emplace(name, function);
+    }
+    if (text.empty()) {
+        _throw("not a profile written by a --profile-generate build",
+               ErrorInfo(source, 0, 0));
+    }
+    return result;
+}
+
+/*****************************************************************************
+ * Collecting counts.
+ */
+
+/** Add one to a counter (atomically, if other threads count too). */
+static void increment(llvm::IRBuilder<> &builder, llvm::Value *counters,
+                      llvm::Value *index, bool atomic) {
+    auto *i64 = builder.getInt64Ty();
+    auto *one = llvm::ConstantInt::get(i64, 1);
+    auto *counter = builder.CreateInBoundsGEP(
+            counters, {llvm::ConstantInt::get(i64, 0), index});
+    if (atomic) {
+        builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter, one,
+                                llvm::Monotonic);
+    } else {
+        builder.CreateStore(
+                builder.CreateAdd(builder.CreateLoad(counter), one), counter);
+    }
+}
+
+void instrument(llvm::Module &module) {
+    auto &context = module.getContext();
+    auto *i8_ptr = llvm::Type::getInt8PtrTy(context);
+    auto *i32 = llvm::Type::getInt32Ty(context);
+    auto *i64 = llvm::Type::getInt64Ty(context);
+    auto parallel = parallel_functions(module);
+
+    /* See `struct kalrt_profile_function` in runtime/kalrt.h. */
+    auto *descriptor_type = llvm::StructType::get(
+            context, {i8_ptr, i64, i32, llvm::PointerType::getUnqual(i64)});
+    std::vector<llvm::Constant *> descriptors;
+
+    std::vector<llvm::Function *> functions;
+    for (auto &f: module) {
+        if (counted(f)) functions.push_back(&f);
+    }
+    for (auto *f: functions) {
+        uint64_t hash = code_hash(*f);
+        auto brs = branches(*f);
+        unsigned n = 1 + 2 * brs.size();
+        bool atomic = parallel.count(f);
+
+        auto *counters_type = llvm::ArrayType::get(i64, n);
+        auto *counters = new llvm::GlobalVariable(
+                module, counters_type, false,
+                llvm::GlobalValue::PrivateLinkage,
+                llvm::ConstantAggregateZero::get(counters_type),
+                f->getName() + ".counters");
+
+        /* After the allocas, which should stay together at the start. */
+        auto &entry = f->getEntryBlock();
+        auto it = entry.begin();
+        while (llvm::isa<llvm::AllocaInst>(*it)) ++it;
+        llvm::IRBuilder<> builder(&entry, it);
+        increment(builder, counters, llvm::ConstantInt::get(i64, 0), atomic);
+
+        for (unsigned k = 0; k < brs.size(); ++k) {
+            builder.SetInsertPoint(brs[k]);
+            auto *index = builder.CreateSelect(
+                    brs[k]->getCondition(),
+                    llvm::ConstantInt::get(i64, 1 + 2 * k),
+                    llvm::ConstantInt::get(i64, 2 + 2 * k));
+            increment(builder, counters, index, atomic);
+        }
+
+        /* Calls to it now have an effect: counting. */
+        f->removeFnAttr(llvm::Attribute::ReadNone);
+        f->removeFnAttr(llvm::Attribute::ReadOnly);
+        f->removeFnAttr(llvm::Attribute::ArgMemOnly);
+
+        auto *zero = llvm::ConstantInt::get(i32, 0);
+        descriptors.push_back(llvm::ConstantStruct::get(
+                descriptor_type,
+                {llvm::ConstantExpr::getPointerCast(
+                        builder.CreateGlobalString(f->getName(),
+                                                   f->getName() + ".name"),
+                        i8_ptr),
+                 llvm::ConstantInt::get(i64, hash),
+                 llvm::ConstantInt::get(i32, n),
+                 llvm::ConstantExpr::getInBoundsGetElementPtr(
+                        counters_type, counters,
+                        llvm::ArrayRef<llvm::Constant *>{zero, zero})}));
+    }
+    if (descriptors.empty()) return;
+
+    auto *table_type = llvm::ArrayType::get(descriptor_type,
+                                            descriptors.size());
+    auto *table = new llvm::GlobalVariable(
+            module, table_type, true, llvm::GlobalValue::PrivateLinkage,
+            llvm::ConstantArray::get(table_type, descriptors),
+            "profile.functions");
+
+    /* Register them with the runtime when the program starts. */
+    auto *ctor = llvm::Function::Create(
+            llvm::FunctionType::get(llvm::Type::getVoidTy(context), false),
+            llvm::Function::InternalLinkage, "profile.register", &module);
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry",
+                                                       ctor));
+    auto *register_type = llvm::FunctionType::get(
+            llvm::Type::getVoidTy(context),
+            {llvm::PointerType::getUnqual(descriptor_type), i32}, false);
+    builder.CreateCall(
+            module.getOrInsertFunction("kalrt_profile_register",
+                                       register_type),
+            {builder.CreateConstInBoundsGEP2_32(table_type, table, 0, 0),
+             llvm::ConstantInt::get(i32, descriptors.size())});
+    builder.CreateRetVoid();
+    llvm::appendToGlobalCtors(module, ctor, 0);
+}
+
+/*****************************************************************************
+ * Using counts.
+ */
+
+std::vector<Error> apply_profile(llvm::Module &module,
+                                 const Profile &profile) {
+    std::vector<Error> warnings;
+    llvm::MDBuilder md(module.getContext());
+    for (auto &f: module) {
+        if (!counted(f)) continue;
+        auto it = profile.find(f.getName().str());
+        /* Not in the profile: the program that wrote it didn't have it. */
+        if (it == profile.end()) continue;
+        auto &counts = it->second.counts;
+        auto brs = branches(f);
+        if (it->second.hash != code_hash(f)
+         || counts.size() != 1 + 2 * brs.size()) {
+            warnings.push_back(Error("Warning",
+                    "ignoring the counts for " + it->first + ", which has "
+                    "changed since they were collected",
+                    it->second.info, Severity::warning));
+            continue;
+        }
+
+        f.setEntryCount(counts[0]);
+        if (counts[0] == 0) {
+            f.addFnAttr(llvm::Attribute::Cold);
+            continue;
+        }
+        for (unsigned k = 0; k < brs.size(); ++k) {
+            uint64_t taken = counts[1 + 2 * k], not_taken = counts[2 + 2 * k];
+            /* Never reached: nothing to go on. */
+            if (taken == 0 && not_taken == 0) continue;
+            auto w = weights({taken, not_taken});
+            brs[k]->setMetadata(llvm::LLVMContext::MD_prof,
+                                md.createBranchWeights(w[0], w[1]));
+        }
+    }
+    return warnings;
+}
+
+}
@@ -0,0 +1,72 @@
+/**
+ * @brief Profile-guided optimization: counting how often each function is
+ *        called and which way each of its branches goes, and feeding the
+ *        counts back to the optimizer.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+
+#include "Error.hh"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief The counts collected from one function.
+ *
+ * The first counts calls to the function; then each of its conditional
+ * branches, in order, has a count for each way it can go (taken first).
+ */
+struct FunctionProfile {
+    /** Of the function's code when it was counted; see `instrument`. */
+    uint64_t hash;
+    std::vector<uint64_t> counts;
+    /** Its line in the profile, for diagnostics. */
+    ErrorInfo info;
+};
+
+/**
+ * @brief The counts from every function in a program, keyed by name.
+ */
+typedef std::map<std::string, FunctionProfile> Profile;
+
+/**
+ * @brief Read a profile written by a program compiled with
+ *        `--profile-generate`.
+ */
+Profile read_profile(const std::string &path);
+
+/**
+ * @brief Count calls to each function defined in the module, and which way
+ *        each of its conditional branches goes.
+ *
+ * The counters are registered with the runtime when the program starts,
+ * which adds them to the profile when it exits.  Each function's counters
+ * are recorded with a hash of its code, so that counts collected from an
+ * older version aren't applied to a newer one.
+ *
+ * Counted functions no longer count as not touching memory, so that LLVM
+ * can't merge or drop calls to them and make the counts inexact.
+ */
+void instrument(llvm::Module &);
+
+/**
+ * @brief Give each function in the module its entry count and branch
+ *        weights from the profile, marking functions that were never called
+ *        `cold`.
+ *
+ * Must see the module as `instrument` would have (i.e. at the same point
+ * in optimization).
+ *
+ * @return Warnings about functions whose code has changed since they were
+ *         counted (whose counts are ignored).
+ */
+std::vector<Error> apply_profile(llvm::Module &, const Profile &);
+
+}
@@ -0,0 +1,179 @@
+#include "Report.hh"
+#include "Json.hh"
+
+#include <iomanip>
+#include <time.h>
+#include <sys/resource.h>
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+/** CPU time used so far, by the whole process or just the calling thread. */
+static std::chrono::nanoseconds cpu_time(bool whole_process) {
+    struct timespec ts;
+    clock_gettime(whole_process? CLOCK_PROCESS_CPUTIME_ID
+                               : CLOCK_THREAD_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec)
+         + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+static bool is_phase(const std::string &category) {
+    return category == "phase";
+}
+
+static double to_ms(std::chrono::nanoseconds t) {
+    return t.count() / 1e6;
+}
+
+static double to_us(std::chrono::nanoseconds t) {
+    return t.count() / 1e3;
+}
+
+/** Peak resident set size, in kilobytes. */
+static uint64_t peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    /* Darwin reports bytes rather than kilobytes. */
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+/*****************************************************************************
+ * Report::Span implementation.
+ */
+
+Report::Span::Span(Report &report, std::string name, std::string category)
+    : report(&report), name(name), category(category),
+      start(std::chrono::steady_clock::now()),
+      cpu_start(cpu_time(is_phase(category))) {}
+
+Report::Span::Span(Span &&other)
+    : report(other.report), name(std::move(other.name)),
+      category(std::move(other.category)), start(other.start),
+      cpu_start(other.cpu_start) {
+    other.report = nullptr;
+}
+
+Report::Span::~Span() {
+    if (!report) return;
+    auto wall = std::chrono::steady_clock::now() - start;
+    auto cpu = cpu_time(is_phase(category)) - cpu_start;
+    report->finish(*this, wall, cpu);
+}
+
+/*****************************************************************************
+ * Report implementation.
+ */
+
+Report::Report(): epoch(std::chrono::steady_clock::now()) {}
+
+Report::Span Report::span(std::string name, std::string category) {
+    return Span(*this, name, category);
+}
+
+void Report::add_time(const std::string &name, std::chrono::nanoseconds t) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &time: times) {
+        if (time.first == name) {
+            time.second += t;
+            return;
+        }
+    }
+    times.push_back(std::make_pair(name, t));
+}
+
+void Report::count(const std::string &name, uint64_t n) {
+    std::lock_guard<std::mutex> guard(lock);
+    counters[name] += n;
+}
+
+unsigned Report::thread_number(void) {
+    /* Called with `lock` held. */
+    auto id = std::this_thread::get_id();
+    if (!threads.count(id)) {
+        unsigned n = threads.size();
+        threads[id] = n;
+    }
+    return threads[id];
+}
+
+void Report::finish(const Span &span, std::chrono::nanoseconds wall,
+                                      std::chrono::nanoseconds cpu) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto start = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            span.start - epoch);
+    events.push_back(Event { span.name, span.category, thread_number(),
+                             start, wall, cpu });
+}
+
+void Report::print_times(std::ostream &out) const {
+    std::lock_guard<std::mutex> guard(lock);
+    auto precision = out.precision();
+    std::chrono::nanoseconds total(0);
+    for (auto &e: events) {
+        if (is_phase(e.category)) total += e.wall;
+    }
+
+    out << "===== Compile time report =====\n"
+        << std::left << std::setw(32) << "phase"
+        << std::right << std::setw(12) << "wall (ms)"
+        << std::setw(12) << "cpu (ms)"
+        << std::setw(9) << "wall %" << "\n"
+        << std::fixed << std::setprecision(3);
+    for (auto &e: events) {
+        if (!is_phase(e.category)) continue;
+        out << std::left << std::setw(32) << e.name
+            << std::right << std::setw(12) << to_ms(e.wall)
+            << std::setw(12) << to_ms(e.cpu)
+            << std::setw(8) << std::setprecision(1)
+            << (total.count()? 100.0 * e.wall.count() / total.count(): 0.0)
+            << "%\n" << std::setprecision(3);
+    }
+    for (auto &t: times) {
+        out << std::left << std::setw(32) << ("  " + t.first)
+            << std::right << std::setw(12) << to_ms(t.second) << "\n";
+    }
+    out << std::left << std::setw(32) << "total"
+        << std::right << std::setw(12) << to_ms(total) << "\n";
+    out.unsetf(std::ios::floatfield);
+    out.precision(precision);
+}
+
+void Report::print_stats(std::ostream &out) const {
+    std::lock_guard<std::mutex> guard(lock);
+    out << "===== Compile statistics =====\n";
+    for (auto &c: counters) {
+        out << std::left << std::setw(40) << c.first
+            << std::right << std::setw(12) << c.second << "\n";
+    }
+    out << std::left << std::setw(40) << "peak RSS (KiB)"
+        << std::right << std::setw(12) << peak_rss_kb() << "\n";
+}
+
+void Report::write_trace(std::ostream &out) const {
+    std::lock_guard<std::mutex> guard(lock);
+    auto precision = out.precision();
+    out << "{\"traceEvents\": [\n" << std::fixed << std::setprecision(3);
+    bool first = true;
+    for (auto &e: events) {
+        if (!first) out << ",\n";
+        first = false;
+        out << "  {\"name\": " << json_string(e.name)
+            << ", \"cat\": " << json_string(e.category)
+            << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.tid
+            << ", \"ts\": " << to_us(e.start)
+            << ", \"dur\": " << to_us(e.wall)
+            << ", \"args\": {\"cpu_us\": " << to_us(e.cpu) << "}}";
+    }
+    out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    out.unsetf(std::ios::floatfield);
+    out.precision(precision);
+}
+
+}
@@ -0,0 +1,105 @@
+/**
+ * @brief Compile-time instrumentation: phase timers, per-function spans and
+ *        counters.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Kaleidoscope {
+
+/**
+ * @brief Collects timings and counters for one run of the compiler.
+ *
+ * Safe to use from several threads at once.
+ */
+class Report {
+public:
+    /**
+     * @brief Times a region of code from construction to destruction.
+     */
+    class Span {
+    public:
+        Span(Report &report, std::string name, std::string category);
+        Span(Span &&);
+        ~Span();
+
+    private:
+        friend class Report;
+
+        Report *report;
+        std::string name;
+        std::string category;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::nanoseconds cpu_start;
+    };
+
+    Report();
+
+    /**
+     * @brief Start timing a region.
+     *
+     * Spans in the "phase" category are top-level compiler phases, and are
+     * charged the CPU time of the whole process (e.g. of every parsing
+     * thread).  Other spans are charged only their own thread's CPU time.
+     */
+    Span span(std::string name, std::string category="phase");
+
+    /**
+     * @brief Add to a time that is not a single contiguous region (e.g. time
+     *        spent in the lexer, summed over all files).
+     */
+    void add_time(const std::string &name, std::chrono::nanoseconds);
+
+    /**
+     * @brief Add to a named counter.
+     */
+    void count(const std::string &name, uint64_t n=1);
+
+    /**
+     * @brief Print a table of phase timings.
+     */
+    void print_times(std::ostream &) const;
+
+    /**
+     * @brief Print a table of counters, including peak memory use.
+     */
+    void print_stats(std::ostream &) const;
+
+    /**
+     * @brief Write every span in the Chrome trace event format (load it in
+     *        chrome://tracing or Perfetto).
+     */
+    void write_trace(std::ostream &) const;
+
+private:
+    struct Event {
+        std::string name;
+        std::string category;
+        unsigned tid;
+        std::chrono::nanoseconds start;
+        std::chrono::nanoseconds wall;
+        std::chrono::nanoseconds cpu;
+    };
+
+    void finish(const Span &, std::chrono::nanoseconds wall,
+                              std::chrono::nanoseconds cpu);
+    unsigned thread_number(void);
+
+    std::chrono::steady_clock::time_point epoch;
+    mutable std::mutex lock;
+    std::vector<Event> events;
+    std::vector<std::pair<std::string, std::chrono::nanoseconds>> times;
+    std::map<std::string, uint64_t> counters;
+    std::map<std::thread::id, unsigned> threads;
+};
+
+}
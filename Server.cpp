@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Server.hh"
+#include "Target.hh"
+
+namespace Kaleidoscope {
+
+/*****************************************************************************
+ * Wire format.
+ *
+ * Client and server always run on the same machine, so integers are sent in
+ * native byte order.  Each message is a 32-bit length followed by that many
+ * bytes; strings within it are likewise length-prefixed.
+ *
+ * Request:  flags, opt_level, diagnostic format, max_errors, memo capacity,
+ *           memo table, memo eviction, profile to use, n_exports, the
+ *           exports, n_libraries, the libraries, n_sources, then per
+ *           source: kind, name and (for in-memory sources) text.
+ * Response: success, diagnostics, obj, ll, bc, kpm.
+ */
+
+enum RequestFlags : uint32_t {
+    want_obj = 1 << 0,
+    want_ll = 1 << 1,
+    want_bc = 1 << 2,
+    want_thinlto = 1 << 3,
+    warn_non_tail_recursion = 1 << 4,
+    color_diagnostics = 1 << 5,
+    no_builtins = 1 << 6,
+    associative_math = 1 << 7,
+    profile_generate = 1 << 8,
+    no_direct_ssa = 1 << 9,
+    want_kpm = 1 << 10,
+    veclib_kalrt = 1 << 11,
+};
+
+enum SourceKind : uint32_t { source_path = 0, source_text = 1 };
+
+/* No sane request or response comes anywhere near this. */
+static const uint32_t MAX_MESSAGE = 1u << 30;
+
+class MessageWriter {
+public:
+    void u32(uint32_t n) { buf.append((const char *)&n, sizeof n); }
+
+    void string(const std::string &s) {
+        u32(s.size());
+        buf.append(s);
+    }
+
+    const std::string &data(void) const { return buf; }
+
+private:
+    std::string buf;
+};
+
+class MessageReader {
+public:
+    MessageReader(const std::string &buf): buf(buf), pos(0) {}
+
+    uint32_t u32(void) {
+        uint32_t n;
+        need(sizeof n);
+        std::memcpy(&n, buf.data() + pos, sizeof n);
+        pos += sizeof n;
+        return n;
+    }
+
+    std::string string(void) {
+        uint32_t size = u32();
+        need(size);
+        pos += size;
+        return buf.substr(pos - size, size);
+    }
+
+private:
+    void need(size_t n) {
+        if (buf.size() - pos < n) throw std::runtime_error("truncated message");
+    }
+
+    const std::string &buf;
+    size_t pos;
+};
+
+static bool write_all(int fd, const char *data, size_t size) {
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char *data, size_t size) {
+    while (size) {
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool send_message(int fd, const std::string &msg) {
+    uint32_t size = msg.size();
+    return write_all(fd, (const char *)&size, sizeof size)
+        && write_all(fd, msg.data(), msg.size());
+}
+
+static bool receive_message(int fd, std::string &msg) {
+    uint32_t size;
+    if (!read_all(fd, (char *)&size, sizeof size) || size > MAX_MESSAGE) {
+        return false;
+    }
+    msg.resize(size);
+    return read_all(fd, &msg[0], size);
+}
+
+static sockaddr_un socket_address(const std::string &path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+    return addr;
+}
+
+static std::string encode(const CompileRequest &req) {
+    MessageWriter w;
+    w.u32((req.obj? want_obj: 0) | (req.ll? want_ll: 0)
+        | (req.bc? want_bc: 0) | (req.thinlto? want_thinlto: 0)
+        | (req.warn_non_tail_recursion? warn_non_tail_recursion: 0)
+        | (req.diagnostics.color? color_diagnostics: 0)
+        | (req.builtins? 0: no_builtins)
+        | (req.associative_math? associative_math: 0)
+        | (req.profile_generate? profile_generate: 0)
+        | (req.direct_ssa? 0: no_direct_ssa)
+        | (req.kpm? want_kpm: 0)
+        | (req.vector_library == VectorLibrary::kalrt? veclib_kalrt: 0));
+    w.u32(req.opt_level);
+    w.u32((uint32_t)req.diagnostics.format);
+    w.u32(req.diagnostics.max_errors);
+    w.u32(req.memo.capacity);
+    w.u32((uint32_t)req.memo.table);
+    w.u32((uint32_t)req.memo.eviction);
+    w.string(req.profile_use);
+    w.u32(req.exports.size());
+    for (auto &name: req.exports) w.string(name);
+    w.u32(req.libraries.size());
+    for (auto &path: req.libraries) w.string(path);
+    w.u32(req.sources.size());
+    for (auto &source: req.sources) {
+        w.u32(source.in_memory? source_text: source_path);
+        w.string(source.name);
+        if (source.in_memory) w.string(source.text);
+    }
+    return w.data();
+}
+
+static CompileRequest decode_request(const std::string &msg) {
+    MessageReader r(msg);
+    CompileRequest req;
+    uint32_t flags = r.u32();
+    req.obj = flags & want_obj;
+    req.ll = flags & want_ll;
+    req.bc = flags & want_bc;
+    req.thinlto = flags & want_thinlto;
+    req.warn_non_tail_recursion = flags & warn_non_tail_recursion;
+    req.diagnostics.color = flags & color_diagnostics;
+    req.builtins = !(flags & no_builtins);
+    req.associative_math = flags & associative_math;
+    req.profile_generate = flags & profile_generate;
+    req.direct_ssa = !(flags & no_direct_ssa);
+    req.kpm = flags & want_kpm;
+    req.vector_library = flags & veclib_kalrt? VectorLibrary::kalrt
+                                             : VectorLibrary::none;
+    req.opt_level = r.u32();
+    uint32_t format = r.u32();
+    if (format > (uint32_t)DiagnosticFormat::sarif) {
+        throw std::runtime_error("unknown diagnostic format");
+    }
+    req.diagnostics.format = DiagnosticFormat(format);
+    req.diagnostics.max_errors = r.u32();
+    req.memo.capacity = r.u32();
+    uint32_t table = r.u32(), eviction = r.u32();
+    if (req.memo.capacity == 0 || req.memo.capacity > (1u << 24)
+     || table > (uint32_t)MemoTable::shared
+     || eviction > (uint32_t)MemoEviction::keep) {
+        throw std::runtime_error("bad memo options");
+    }
+    req.memo.table = MemoTable(table);
+    req.memo.eviction = MemoEviction(eviction);
+    req.profile_use = r.string();
+    for (uint32_t n = r.u32(); n; --n) req.exports.push_back(r.string());
+    for (uint32_t n = r.u32(); n; --n) req.libraries.push_back(r.string());
+    for (uint32_t n = r.u32(); n; --n) {
+        uint32_t kind = r.u32();
+        auto name = r.string();
+        req.sources.push_back(kind == source_text
+                ? SourceFile::memory(name, r.string())
+                : SourceFile::file(name));
+    }
+    return req;
+}
+
+static std::string encode(const CompileResponse &res) {
+    MessageWriter w;
+    w.u32(res.success);
+    w.string(res.diagnostics);
+    w.string(res.obj);
+    w.string(res.ll);
+    w.string(res.bc);
+    w.string(res.kpm);
+    return w.data();
+}
+
+static CompileResponse decode_response(const std::string &msg) {
+    MessageReader r(msg);
+    CompileResponse res;
+    res.success = r.u32();
+    res.diagnostics = r.string();
+    res.obj = r.string();
+    res.ll = r.string();
+    res.bc = r.string();
+    res.kpm = r.string();
+    return res;
+}
+
+/*****************************************************************************
+ * Server implementation.
+ */
+
+/**
+ * @brief Compiles requests, one connection at a time, on its own thread.
+ */
+class Worker {
+public:
+    Worker() {
+        /* Warm up for the common case before the first request arrives. */
+        target(CodeGenOptions().opt_level);
+    }
+
+    void handle(int fd) {
+        std::string msg;
+        if (!receive_message(fd, msg)) return;
+        CompileResponse res;
+        try {
+            res = compile(decode_request(msg));
+        } catch (std::runtime_error &e) {
+            res.diagnostics = std::string("kalc server: ") + e.what() + "\n";
+        }
+        send_message(fd, encode(res));
+    }
+
+private:
+    /** A target machine for this thread at the given level, kept for
+     *  later requests. */
+    std::shared_ptr<Target> target(unsigned opt_level) {
+        auto &t = targets[opt_level];
+        if (!t) {
+            t = std::make_shared<Target>(llvm::sys::getDefaultTargetTriple(),
+                                         opt_level);
+        }
+        return t;
+    }
+
+    CompileResponse compile(const CompileRequest &req) {
+        CodeGenOptions opts;
+        opts.warn_non_tail_recursion = req.warn_non_tail_recursion;
+        opts.builtins = req.builtins;
+        opts.associative_math = req.associative_math;
+        opts.vector_library = req.vector_library;
+        opts.direct_ssa = req.direct_ssa;
+        opts.profile_generate = req.profile_generate;
+        opts.profile_use = req.profile_use;
+        opts.exports = req.exports;
+        opts.memo = req.memo;
+        CodeGenerator codegen("Kaleidoscope module", target(req.opt_level),
+                              opts);
+        /* Requests are already spread over the workers. */
+        DriverOptions driver_opts;
+        driver_opts.parse_threads = 1;
+        driver_opts.libraries = req.libraries;
+        Report report;
+        Diagnostics diag(req.diagnostics);
+        std::ostringstream obj, ll, bc, kpm;
+
+        CompileResponse res;
+        res.success = Kaleidoscope::compile(req.sources, codegen, report,
+                                            diag, driver_opts);
+        if (res.success) {
+            if (req.obj) codegen.emit_obj(obj);
+            if (req.bc) codegen.emit_bc(bc, req.thinlto);
+            if (req.ll) codegen.emit_ir(ll);
+            if (req.kpm) codegen.emit_kpm(kpm);
+        }
+
+        res.diagnostics = diag.render();
+        res.obj = obj.str();
+        res.ll = ll.str();
+        res.bc = bc.str();
+        res.kpm = kpm.str();
+        return res;
+    }
+
+    std::map<unsigned, std::shared_ptr<Target>> targets;
+};
+
+bool serve(const std::string &socket_path, unsigned jobs) {
+    /* A client going away mid-response shouldn't take the server with it. */
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    auto addr = socket_address(socket_path);
+    unlink(socket_path.c_str());
+    if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof addr) < 0
+                     || listen(listener, SOMAXCONN) < 0) {
+        std::cerr << socket_path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<int> connections;
+
+    if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < jobs; ++i) {
+        workers.emplace_back([&]() {
+            Worker worker;
+            for (;;) {
+                int fd;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    ready.wait(guard, [&]() { return !connections.empty(); });
+                    fd = connections.front();
+                    connections.pop_front();
+                }
+                worker.handle(fd);
+                close(fd);
+            }
+        });
+    }
+
+    for (;;) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << socket_path << ": " << std::strerror(errno)
+                      << std::endl;
+            /* The workers never finish, so don't wait for them. */
+            std::_Exit(1);
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            connections.push_back(fd);
+        }
+        ready.notify_one();
+    }
+}
+
+/*****************************************************************************
+ * Client implementation.
+ */
+
+bool request_compile(const std::string &socket_path,
+                     const CompileRequest &request,
+                     CompileResponse &response) {
+    signal(SIGPIPE, SIG_IGN);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    auto addr = socket_address(socket_path);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof addr) < 0) {
+        std::cerr << socket_path << ": " << std::strerror(errno) << std::endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    std::string msg;
+    bool ok = send_message(fd, encode(request)) && receive_message(fd, msg);
+    close(fd);
+    if (ok) {
+        try {
+            response = decode_response(msg);
+        } catch (std::runtime_error &) {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        std::cerr << socket_path << ": bad response from compile server"
+                  << std::endl;
+    }
+    return ok;
+}
+
+}
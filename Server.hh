@@ -0,0 +1,82 @@
+/**
+ * @brief A persistent compile server, and the client used to talk to it.
+ *
+ * Starting `kalc` afresh for every file pays for process startup, LLVM's
+ * target initialization and cold caches every time.  A server started once
+ * with `kalc --server SOCKET` keeps all of that warm, and compiles requests
+ * sent over a Unix-domain socket by `kalc --connect SOCKET`.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Driver.hh"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief Everything the server needs to know to compile a set of files.
+ *
+ * Sources on disk are sent by (absolute) path and read by the server; those
+ * in memory (e.g. from stdin) are sent whole.
+ */
+struct CompileRequest {
+    std::vector<SourceFile> sources;
+    unsigned opt_level = 2;
+    bool warn_non_tail_recursion = false;
+    bool builtins = true;
+    bool associative_math = false;
+    VectorLibrary vector_library = VectorLibrary::none;
+    bool direct_ssa = true;
+    std::vector<std::string> exports;
+    /** Absolute paths, like those of sources on disk. */
+    std::vector<std::string> libraries;
+    MemoOptions memo;
+    bool profile_generate = false;
+    /** An absolute path, like those of sources on disk. */
+    std::string profile_use;
+    bool obj = false;
+    bool ll = false;
+    bool bc = false;
+    bool kpm = false;
+    bool thinlto = false;
+    DiagnosticOptions diagnostics;
+};
+
+/**
+ * @brief The server's reply: diagnostics, plus whichever outputs were
+ *        requested if compilation succeeded.
+ */
+struct CompileResponse {
+    bool success = false;
+    /** Rendered as the request asked. */
+    std::string diagnostics;
+    std::string obj;
+    std::string ll;
+    std::string bc;
+    std::string kpm;
+};
+
+/**
+ * @brief Listen on the given socket, compiling requests on `jobs` worker
+ *        threads (0 for one per core).  Never returns, except on error.
+ *
+ * Each worker keeps its own target machines, so requests are compiled fully
+ * in parallel.
+ *
+ * @return false (after printing a message) if the socket can't be set up.
+ */
+bool serve(const std::string &socket_path, unsigned jobs);
+
+/**
+ * @brief Send a request to the server listening on the given socket, and
+ *        wait for its response.
+ *
+ * @return false (after printing a message) if the server can't be reached.
+ */
+bool request_compile(const std::string &socket_path,
+                     const CompileRequest &request, CompileResponse &response);
+
+}
@@ -0,0 +1,56 @@
+#include "Source.hh"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace Kaleidoscope {
+
+Source::Source(std::string name, std::string text)
+    : source_name(name), contents(std::move(text)) {}
+
+std::shared_ptr<const Source> Source::read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    return read_stream(path, file);
+}
+
+std::shared_ptr<const Source> Source::read_stream(std::string name,
+                                                  std::istream &in) {
+    std::ostringstream text;
+    if (in) text << in.rdbuf();
+    return std::make_shared<Source>(name, text.str());
+}
+
+const std::vector<uint32_t> &Source::line_starts(void) const {
+    /* Diagnostics may be printed from several threads at once. */
+    std::call_once(indexed, [this]() {
+        starts.push_back(0);
+        for (size_t i = 0; i < contents.size(); ++i) {
+            if (contents[i] == '\n') starts.push_back(i + 1);
+        }
+    });
+    return starts;
+}
+
+Source::Location Source::location(uint32_t offset) const {
+    auto &lines = line_starts();
+    /* The last line starting at or before `offset`. */
+    auto line = std::upper_bound(lines.begin(), lines.end(), offset) - 1;
+    return Location { unsigned(line - lines.begin()), offset - *line };
+}
+
+std::pair<uint32_t, uint32_t> Source::line_extent(unsigned line) const {
+    auto &lines = line_starts();
+    uint32_t begin = lines[line];
+    uint32_t end = line + 1 < lines.size()? lines[line + 1] - 1
+                                          : contents.size();
+    /* Leave out the \r of a \r\n. */
+    if (end > begin && contents[end - 1] == '\r') --end;
+    return std::make_pair(begin, end);
+}
+
+unsigned Source::line_count(void) const {
+    return line_starts().size();
+}
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Kaleidoscope {
+
+/**
+ * @brief The full text of one input, read once and shared (via
+ *        `std::shared_ptr`) by the lexer and every diagnostic pointing into
+ *        it.
+ *
+ * Positions within it are byte offsets.  Line numbers are worked out only when
+ * needed (i.e. when printing a diagnostic), from an index of line starts built
+ * on first use.
+ */
+class Source {
+public:
+    /** Zero-based line and column (in bytes) of a position. */
+    struct Location {
+        unsigned line;
+        unsigned column;
+    };
+
+    Source(std::string name, std::string text);
+
+    /**
+     * @brief Read a whole file.  A file that can't be read is treated as
+     *        empty.
+     */
+    static std::shared_ptr<const Source> read_file(const std::string &path);
+
+    /**
+     * @brief Read a whole stream, naming it `name` in diagnostics.
+     */
+    static std::shared_ptr<const Source> read_stream(std::string name,
+                                                     std::istream &);
+
+    const std::string &name(void) const { return source_name; }
+
+    const std::string &text(void) const { return contents; }
+
+    /**
+     * @brief Find the line and column of a byte offset, in O(log n) for a
+     *        source of n lines.
+     */
+    Location location(uint32_t offset) const;
+
+    /**
+     * @brief Return the [begin, end) byte offsets of a line, excluding its
+     *        line terminator.
+     */
+    std::pair<uint32_t, uint32_t> line_extent(unsigned line) const;
+
+    /**
+     * @brief Number of lines, counting an empty line after a final newline.
+     */
+    unsigned line_count(void) const;
+
+private:
+    const std::vector<uint32_t> &line_starts(void) const;
+
+    std::string source_name;
+    std::string contents;
+    mutable std::once_flag indexed;
+    mutable std::vector<uint32_t> starts;
+};
+
+}
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include "Target.hh"
+
+namespace Kaleidoscope {
+
+/** Does the triple name the architecture kalc is running on? */
+static bool is_native(const llvm::Triple &triple) {
+    return triple.getArch()
+        == llvm::Triple(llvm::sys::getProcessTriple()).getArch();
+}
+
+/**
+ * Initialize just the host's backend, once per process.  This is all kalc
+ * needs to compile for the machine it's running on, and much cheaper than
+ * initializing every backend LLVM was built with.
+ */
+static void initialize_native_target(void) {
+    static std::once_flag initialized;
+    std::call_once(initialized, []() {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+    });
+}
+
+#ifndef KALC_NATIVE_ONLY
+/** Initialize every backend, once per process, for cross-compiling. */
+static void initialize_all_targets(void) {
+    static std::once_flag initialized;
+    std::call_once(initialized, []() {
+        llvm::InitializeAllTargetInfos();
+        llvm::InitializeAllTargets();
+        llvm::InitializeAllTargetMCs();
+        llvm::InitializeAllAsmPrinters();
+    });
+}
+#endif
+
+Target::Target(std::string triple, unsigned opt_level)
+    : triple_name(triple), level(std::min(opt_level, 3u)) {
+	std::string error;
+	auto target_triple = llvm::Triple(triple);
+    if (is_native(target_triple)) {
+        initialize_native_target();
+    } else {
+#ifdef KALC_NATIVE_ONLY
+        llvm::errs() << "kalc was built for the native target only; cannot "
+                     << "compile for " << triple << "\n";
+        std::exit(1);
+#else
+        initialize_all_targets();
+#endif
+    }
+
+	/* TODO: Allow target-specific information. */
+    auto llvm_target =
+        llvm::TargetRegistry::lookupTarget("", target_triple, error);
+
+	// Print an error and exit if we couldn't find the requested target.
+	// This generally occurs if we've forgotten to initialise the
+	// TargetRegistry or we have a bogus target triple.
+
+	/* TODO: fix this to properly handle the error. */
+	if (!llvm_target) {
+	    llvm::errs() << error << "\n";
+	    std::exit(1);
+	}
+
+    /* TODO: give a more specific CPU. */
+    auto cpu = "generic";
+    auto features = "";
+    llvm::TargetOptions options;
+    auto reloc_model = llvm::Reloc::Model();
+    static const llvm::CodeGenOpt::Level LEVELS[] = {
+        llvm::CodeGenOpt::None,    llvm::CodeGenOpt::Less,
+        llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive,
+    };
+
+    target_machine.reset(llvm_target->createTargetMachine(
+            triple, cpu, features, options, reloc_model,
+            llvm::CodeModel::Default, LEVELS[level]));
+}
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "llvm/Target/TargetMachine.h"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief An LLVM target machine for a particular triple and optimization
+ *        level.
+ *
+ * Creating one is comparatively expensive, so they can be shared (via
+ * `std::shared_ptr`) between `CodeGenerator`s, but only by one thread at a
+ * time.
+ */
+class Target {
+public:
+    /**
+     * @brief Set up the target machine, initializing LLVM's backend for it
+     *        first if that has not been done yet.
+     *
+     * Only the host's backend is initialized when compiling for the host.
+     * Builds with `KALC_NATIVE_ONLY` defined (see the Makefile) include no
+     * other backends, and exit with an error for any other triple.
+     */
+    Target(std::string triple, unsigned opt_level);
+
+    llvm::TargetMachine &machine(void) { return *target_machine; }
+
+    const std::string &triple(void) const { return triple_name; }
+
+    unsigned opt_level(void) const { return level; }
+
+private:
+    std::string triple_name;
+    unsigned level;
+    std::unique_ptr<llvm::TargetMachine> target_machine;
+};
+
+}
@@ -0,0 +1,190 @@
+#include <cmath>
+#include <map>
+#include <vector>
+
+#include "Lexer.hh"
+#include "Types.hh"
+
+namespace Kaleidoscope {
+
+namespace {
+
+/* A variable: its loop, its entry in a `var`, or null for an argument. */
+typedef const void *Binding;
+
+static bool whole(double val, double max) {
+    return val == std::trunc(val) && std::fabs(val) <= max;
+}
+
+static bool is_step(const AST::Expression &expr) {
+    auto *num = boost::get<AST::NumberLiteral>(&expr);
+    return num && whole(num->val, max_integer_step);
+}
+
+class Inference: public boost::static_visitor<void> {
+public:
+    /* Candidates not yet demoted. */
+    std::set<Binding> integers;
+    bool changed = false;
+
+    void visit(const AST::Expression &expr) {
+        boost::apply_visitor(*this, expr);
+    }
+
+    void operator()(const AST::NumberLiteral &) {}
+    void operator()(const AST::VariableName &) {}
+
+    void operator()(const std::unique_ptr<AST::BinaryOp> &op) {
+        visit(op->lhs);
+        visit(op->rhs);
+        auto *var = boost::get<AST::VariableName>(&op->lhs);
+        if (op->op == '=' && var && !integral(op->rhs)) demote(lookup(*var));
+    }
+
+    void operator()(const std::unique_ptr<AST::FunctionCall> &call) {
+        for (auto &arg: call->args) visit(arg);
+    }
+
+    void operator()(const std::unique_ptr<AST::IfThenElse> &if_) {
+        visit(if_->cond);
+        visit(if_->then);
+        visit(if_->else_);
+    }
+
+    void operator()(const std::unique_ptr<AST::ForLoop> &loop) {
+        visit(loop->start);
+        candidate(loop.get(), integral(loop->start) && is_step(loop->step));
+        /* Counted loops (see CodeGeneratorImpl) evaluate their limit and
+         * step before the index exists. */
+        bool counted = loop->parallel || loop->reduce_op;
+        if (counted) {
+            visit(loop->end);
+            visit(loop->step);
+            for (auto &reduction: loop->reductions) {
+                auto it = scope.find(reduction.var);
+                if (it != scope.end()) demote(it->second);
+            }
+        }
+
+        auto outer = bind(loop->index_var, loop.get());
+        if (!counted) {
+            visit(loop->end);
+            visit(loop->step);
+        }
+        visit(loop->body);
+        unbind(loop->index_var, outer);
+    }
+
+    void operator()(const std::unique_ptr<AST::LocalVar> &local) {
+        std::vector<std::pair<std::string, Binding>> outer;
+        for (auto &name: local->names) {
+            visit(name.second);
+            candidate(&name, integral(name.second));
+            outer.push_back({name.first, bind(name.first, &name)});
+        }
+        visit(local->body);
+        for (auto it = outer.rbegin(); it != outer.rend(); ++it) {
+            unbind(it->first, it->second);
+        }
+    }
+
+    void operator()(const std::unique_ptr<AST::ArrayIndex> &elt) {
+        visit(elt->index);
+    }
+
+    void declare_args(const AST::FunctionPrototype &proto) {
+        for (auto &arg: proto.args) scope[arg] = nullptr;
+    }
+
+private:
+    std::map<std::string, Binding> scope;
+    std::set<Binding> seen;
+
+    Binding lookup(const AST::VariableName &var) {
+        auto it = scope.find(var.name);
+        return it == scope.end()? nullptr: it->second;
+    }
+
+    /* Bind `name`, and return what it was bound to before. */
+    Binding bind(const std::string &name, Binding binding) {
+        auto it = scope.find(name);
+        Binding outer = it == scope.end()? nullptr: it->second;
+        scope[name] = binding;
+        return outer;
+    }
+
+    void unbind(const std::string &name, Binding outer) {
+        if (outer) {
+            scope[name] = outer;
+        } else {
+            scope.erase(name);
+        }
+    }
+
+    /* The first time a variable is seen it becomes an integer, unless its
+     * starting value isn't one. */
+    void candidate(Binding binding, bool integer) {
+        if (seen.insert(binding).second) integers.insert(binding);
+        if (!integer) demote(binding);
+    }
+
+    void demote(Binding binding) {
+        if (binding && integers.erase(binding)) changed = true;
+    }
+
+    /* Is the expression a whole number that an integer variable may be set
+     * to? */
+    bool integral(const AST::Expression &expr) {
+        if (auto *num = boost::get<AST::NumberLiteral>(&expr)) {
+            return whole(num->val, max_integer_start);
+        }
+        if (auto *var = boost::get<AST::VariableName>(&expr)) {
+            auto binding = lookup(*var);
+            return binding && integers.count(binding);
+        }
+        if (auto *op = boost::get<std::unique_ptr<AST::BinaryOp>>(&expr)) {
+            switch ((*op)->op) {
+            /* Comparisons, which are booleans. */
+            case '<':
+            case '>':
+            case tok_le:
+            case tok_ge:
+            case tok_eq:
+            case tok_ne:
+            case tok_and:
+            case tok_or:
+                return true;
+            case '=':
+                return integral((*op)->rhs);
+            case '+':
+                if (is_step((*op)->lhs)) return integral((*op)->rhs);
+                /* Fall through. */
+            case '-':
+                return is_step((*op)->rhs) && integral((*op)->lhs);
+            default:
+                return false;
+            }
+        }
+        if (auto *if_ = boost::get<std::unique_ptr<AST::IfThenElse>>(&expr)) {
+            return integral((*if_)->then) && integral((*if_)->else_);
+        }
+        return false;
+    }
+};
+
+}
+
+IntegerVariables infer_integers(const AST::FunctionDefinition &f) {
+    Inference inference;
+    do {
+        inference.changed = false;
+        inference.declare_args(*f.proto);
+        inference.visit(f.body);
+    } while (inference.changed);
+
+    IntegerVariables result;
+    result.variables = inference.integers;
+    return result;
+}
+
+}
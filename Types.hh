@@ -0,0 +1,61 @@
+/**
+ * @brief Inferring which variables only ever hold whole numbers.
+ */
+
+#pragma once
+
+#include <set>
+#include <string>
+#include <utility>
+
+#include "AST.hh"
+
+namespace Kaleidoscope {
+
+/**
+ * @brief The variables of a function that can be kept in 64-bit integers
+ *        rather than `double`s.
+ *
+ * These are loop indices and `var`s that start at whole numbers and are
+ * only ever set to such numbers, to each other (give or take a small whole
+ * number), or to the results of comparisons.  A `double` holds every whole
+ * number up to 2^53 exactly, and a variable that starts below 2^32 and moves
+ * by at most 64 at a time would take days of stepping to get that far, so
+ * integer arithmetic on it gives the same results as floating-point.
+ */
+struct IntegerVariables {
+    /** Keyed by the loop (for its index) or the entry in the `var`. */
+    std::set<const void *> variables;
+
+    bool contains(const AST::ForLoop &loop) const {
+        return variables.count(&loop);
+    }
+
+    bool contains(const std::pair<std::string, AST::Expression> &local)
+            const {
+        return variables.count(&local);
+    }
+};
+
+/**
+ * @brief The largest whole number (in magnitude) a variable may start at
+ *        and still be inferred to be an integer.
+ */
+const double max_integer_start = 4294967296.0;
+
+/**
+ * @brief The largest whole number (in magnitude) an integer variable may be
+ *        stepped by.
+ */
+const double max_integer_step = 64;
+
+/**
+ * @brief Work out which of a function's variables only hold whole numbers.
+ *
+ * Every candidate starts out as an integer, and is demoted to a `double` if
+ * it is ever set to anything else, until nothing changes.  The arguments
+ * are always `double`s, as are `parfor` reduction variables.
+ */
+IntegerVariables infer_integers(const AST::FunctionDefinition &);
+
+}
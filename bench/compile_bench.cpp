@@ -0,0 +1,177 @@
+/**
+ * @brief Measures the throughput of each stage of the compiler separately
+ *        (lexing, parsing, code generation, optimization and object code
+ *        emission), plus the end-to-end time of `kalc`.
+ *
+ * Prints one JSON object per stage and input file.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "CodeGenerator.hh"
+#include "Lexer.hh"
+#include "Parser.hh"
+
+namespace opt = boost::program_options;
+using namespace Kaleidoscope;
+
+typedef std::chrono::duration<double> seconds;
+
+/**
+ * @brief Statistics over repeated runs of one stage.
+ */
+struct Timing {
+    double min;
+    double mean;
+};
+
+/**
+ * @brief Run `setup` and then time `stage`, `reps` times over.
+ */
+static Timing time_stage(unsigned reps, std::function<void(void)> setup,
+                                        std::function<void(void)> stage) {
+    Timing result { 1e300, 0 };
+    for (unsigned i = 0; i < reps; ++i) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        stage();
+        double t = seconds(std::chrono::steady_clock::now() - start).count();
+        result.min = std::min(result.min, t);
+        result.mean += t / reps;
+    }
+    return result;
+}
+
+static void report(const std::string &stage, const std::string &file,
+                   size_t bytes, unsigned reps, Timing t) {
+    std::cout << "{\"stage\": \"" << stage << "\", \"file\": \"" << file
+              << "\", \"bytes\": " << bytes << ", \"reps\": " << reps
+              << ", \"min_s\": " << t.min << ", \"mean_s\": " << t.mean
+              << ", \"mb_per_s\": " << bytes / t.min / 1e6 << "}"
+              << std::endl;
+}
+
+static std::vector<AST::Declaration> parse(const std::string &file) {
+    std::vector<AST::Declaration> result;
+    Parser parser(file);
+    while (!parser.reached_end()) result.push_back(parser.parse());
+    return result;
+}
+
+static void generate(CodeGenerator &codegen,
+                     const std::vector<AST::Declaration> &decls) {
+    for (auto &decl: decls) codegen.declare(decl);
+    for (auto &decl: decls) codegen(decl);
+}
+
+static void bench_file(const std::string &file, unsigned reps,
+                       const std::string &kalc) {
+    struct stat st;
+    if (stat(file.c_str(), &st)) {
+        std::cerr << file << ": cannot stat" << std::endl;
+        return;
+    }
+    size_t bytes = st.st_size;
+    auto nothing = []() {};
+
+    report("lexer", file, bytes, reps, time_stage(reps, nothing, [&]() {
+        Lexer lexer(file);
+        while (lexer.get_token().second != tok_eof);
+    }));
+
+    report("parser", file, bytes, reps, time_stage(reps, nothing, [&]() {
+        parse(file);
+    }));
+
+    /* Later stages need the output of earlier ones, produced (untimed) by
+     * each `setup`. */
+    auto decls = parse(file);
+    std::unique_ptr<CodeGenerator> codegen;
+    auto fresh_codegen = [&]() {
+        codegen = std::make_unique<CodeGenerator>("bench");
+    };
+    auto generated = [&]() {
+        fresh_codegen();
+        generate(*codegen, decls);
+    };
+    auto optimized = [&]() {
+        generated();
+        codegen->optimize();
+    };
+
+    report("codegen", file, bytes, reps, time_stage(reps, fresh_codegen,
+                [&]() { generate(*codegen, decls); }));
+
+    report("optimize", file, bytes, reps, time_stage(reps, generated,
+                [&]() { codegen->optimize(); }));
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    report("emit_obj", file, bytes, reps, time_stage(reps, optimized,
+                [&]() { codegen->emit_obj(null_fd); }));
+    close(null_fd);
+
+    if (!kalc.empty()) {
+        std::string cmd = kalc + " '" + file + "' --obj /dev/null";
+        report("kalc", file, bytes, reps, time_stage(reps, nothing, [&]() {
+            if (std::system(cmd.c_str())) {
+                std::cerr << "failed: " << cmd << std::endl;
+            }
+        }));
+    }
+}
+
+int main(int argc, char **argv) {
+    unsigned reps;
+    std::string kalc;
+    opt::options_description desc("Compiler throughput benchmark options");
+    desc.add_options()
+        ("help", "print usage information")
+        ("reps", opt::value(&reps)->default_value(5),
+            "number of times to run each stage")
+        ("kalc", opt::value(&kalc),
+            "path to kalc, to also time end-to-end compilation")
+        ("in", opt::value<std::vector<std::string>>(),
+            "select input files");
+    opt::positional_options_description pos;
+    pos.add("in", -1);
+
+    opt::variables_map opt_map;
+    try {
+        opt::store(opt::command_line_parser(argc, argv).options(desc)
+                                                       .positional(pos)
+                                                       .run(),
+                   opt_map);
+        opt::notify(opt_map);
+    } catch (opt::error) {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+    if (opt_map.count("help") || !opt_map.count("in") || reps == 0) {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+
+    try {
+        for (auto &file: opt_map["in"].as<std::vector<std::string>>()) {
+            bench_file(file, reps, kalc);
+        }
+    } catch (Error e) {
+        e.emit(std::cerr);
+        return 2;
+    }
+
+    return 0;
+}
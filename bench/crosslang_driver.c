@@ -0,0 +1,44 @@
+/* Calls the `lerp` kernel from crosslang.kal in a hot loop.  Linked against
+ * a native object, every iteration pays for a call; linked as ThinLTO
+ * bitcode, the kernel is inlined and the loop vectorized. */
+
+#include <stdio.h>
+#include <time.h>
+
+#ifndef VARIANT
+#define VARIANT "native"
+#endif
+
+#define N 1000
+#define REPS 100000
+
+double lerp(double, double, double);
+
+static double xs[N], ys[N];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void) {
+    double start, elapsed;
+    int i, rep;
+
+    for (i = 0; i < N; ++i) xs[i] = i;
+
+    start = now();
+    for (rep = 0; rep < REPS; ++rep) {
+        for (i = 0; i < N; ++i) {
+            ys[i] = lerp(xs[i], ys[i], 0.25);
+        }
+    }
+    elapsed = now() - start;
+
+    printf("{\"bench\": \"crosslang\", \"variant\": \"%s\", "
+           "\"ns_per_call\": %.3f}\n",
+           VARIANT, elapsed / ((double)N * REPS));
+
+    return ys[N / 2] == 42.0;
+}
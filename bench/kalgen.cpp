@@ -0,0 +1,243 @@
+/**
+ * @brief Deterministic generator of synthetic Kaleidoscope programs, for
+ *        benchmarking the compiler at scale.
+ *
+ * The same options (including the seed) always produce the same program, on
+ * any platform.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+namespace opt = boost::program_options;
+
+/**
+ * @brief Shape of the generated program.
+ */
+struct Config {
+    unsigned functions;
+    unsigned params;
+    unsigned depth;
+    unsigned width;
+    double loop_density;
+    double var_density;
+    double call_density;
+    double if_density;
+    double literal_density;
+    double comment_ratio;
+    uint64_t seed;
+};
+
+/**
+ * @brief SplitMix64.  Unlike the <random> distributions, its output is
+ *        specified exactly, so programs are reproducible everywhere.
+ */
+class Random {
+public:
+    Random(uint64_t seed): state(seed) {}
+
+    uint64_t next(void) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    /** Uniform in [0, 1). */
+    double real(void) { return (next() >> 11) * (1.0 / (1ULL << 53)); }
+
+    /** Uniform in [0, n). */
+    unsigned below(unsigned n) { return next() % n; }
+
+private:
+    uint64_t state;
+};
+
+class Generator {
+public:
+    Generator(Config cfg): cfg(cfg), rng(cfg.seed), fresh(0), column(0) {}
+
+    std::string program(void) {
+        for (unsigned i = 0; i < cfg.functions; ++i) function(i);
+        return out.str();
+    }
+
+private:
+    void function(unsigned i) {
+        scope.clear();
+        emit("def f" + std::to_string(i) + "(");
+        for (unsigned p = 0; p < cfg.params; ++p) {
+            scope.push_back("a" + std::to_string(p));
+            emit((p? " ": "") + scope.back());
+        }
+        emit(")");
+        newline();
+        emit("    ");
+        expression(i, cfg.depth);
+        newline();
+        newline();
+    }
+
+    void expression(unsigned fn, unsigned depth) {
+        if (depth == 0) return leaf();
+
+        double r = rng.real();
+        if ((r -= cfg.loop_density) < 0) return loop(fn, depth);
+        if ((r -= cfg.var_density) < 0) return local(fn, depth);
+        if ((r -= cfg.call_density) < 0 && fn > 0) return call(fn, depth);
+        if ((r -= cfg.if_density) < 0) return conditional(fn, depth);
+
+        static const char *OPS[] = { " + ", " - ", " * " };
+        emit("(");
+        for (unsigned i = 0; i < cfg.width; ++i) {
+            if (i) emit(OPS[rng.below(3)]);
+            expression(fn, depth - 1);
+        }
+        emit(")");
+    }
+
+    void leaf(void) {
+        if (scope.empty() || rng.real() < cfg.literal_density) {
+            std::ostringstream num;
+            num << rng.below(1000) / 8.0;
+            emit(num.str());
+        } else {
+            emit(scope[rng.below(scope.size())]);
+        }
+    }
+
+    /* An accumulating loop: (var accN = 0 in (for iN = ... in
+     * accN = accN + body) + accN). */
+    void loop(unsigned fn, unsigned depth) {
+        auto n = std::to_string(fresh++);
+        auto acc = "acc" + n, idx = "i" + n;
+        emit("(var " + acc + " = 0 in (for " + idx + " = 0, " + idx + " < "
+           + std::to_string(1 + rng.below(16)) + " in ");
+        newline();
+        emit("        " + acc + " = " + acc + " + ");
+        scope.push_back(acc);
+        scope.push_back(idx);
+        expression(fn, depth - 1);
+        scope.pop_back();
+        scope.pop_back();
+        emit(") + " + acc + ")");
+    }
+
+    void local(unsigned fn, unsigned depth) {
+        auto name = "v" + std::to_string(fresh++);
+        emit("(var " + name + " = ");
+        expression(fn, depth - 1);
+        emit(" in ");
+        scope.push_back(name);
+        expression(fn, depth - 1);
+        scope.pop_back();
+        emit(")");
+    }
+
+    /* Only call functions already defined, so the program is valid. */
+    void call(unsigned fn, unsigned depth) {
+        emit("f" + std::to_string(rng.below(fn)) + "(");
+        for (unsigned p = 0; p < cfg.params; ++p) {
+            if (p) emit(", ");
+            expression(fn, depth - 1);
+        }
+        emit(")");
+    }
+
+    void conditional(unsigned fn, unsigned depth) {
+        emit("(if ");
+        expression(fn, depth - 1);
+        emit(" < ");
+        expression(fn, depth - 1);
+        emit(" then ");
+        expression(fn, depth - 1);
+        emit(" else ");
+        expression(fn, depth - 1);
+        emit(")");
+    }
+
+    /* Break long lines (outside of tokens), so that comments can go between
+     * them. */
+    void emit(const std::string &s) {
+        if (column > 72 && s[0] == ' ') {
+            newline();
+            out << "       ";
+            column = 7;
+        }
+        out << s;
+        column += s.size();
+    }
+
+    /* End a line, following it with comment lines so that they make up
+     * (on average) `comment_ratio` of all lines. */
+    void newline(void) {
+        out << "\n";
+        column = 0;
+        /* Each extra comment line is added with probability `p`, for
+         * p / (1 - p) comment lines per code line: a fraction p of all. */
+        double p = std::min(cfg.comment_ratio, 0.99);
+        while (rng.real() < p) {
+            out << "# comment " << fresh++
+                << ": the quick brown fox jumps over the lazy dog\n";
+        }
+    }
+
+    Config cfg;
+    Random rng;
+    std::ostringstream out;
+    std::vector<std::string> scope;
+    unsigned fresh;
+    size_t column;
+};
+
+int main(int argc, char **argv) {
+    Config cfg;
+    opt::options_description desc("Kaleidoscope program generator options");
+    desc.add_options()
+        ("help", "print usage information")
+        ("functions", opt::value(&cfg.functions)->default_value(100),
+            "number of functions")
+        ("params", opt::value(&cfg.params)->default_value(3),
+            "parameters per function")
+        ("depth", opt::value(&cfg.depth)->default_value(4),
+            "maximum expression nesting depth")
+        ("width", opt::value(&cfg.width)->default_value(3),
+            "operands per arithmetic expression")
+        ("loop-density", opt::value(&cfg.loop_density)->default_value(0.05),
+            "probability that an expression is a `for` loop")
+        ("var-density", opt::value(&cfg.var_density)->default_value(0.1),
+            "probability that an expression is a `var` binding")
+        ("call-density", opt::value(&cfg.call_density)->default_value(0.1),
+            "probability that an expression is a function call")
+        ("if-density", opt::value(&cfg.if_density)->default_value(0.1),
+            "probability that an expression is a conditional")
+        ("literal-density",
+            opt::value(&cfg.literal_density)->default_value(0.3),
+            "probability that a leaf is a literal rather than a variable")
+        ("comment-ratio", opt::value(&cfg.comment_ratio)->default_value(0.1),
+            "fraction of lines that are comments")
+        ("seed", opt::value(&cfg.seed)->default_value(1),
+            "random seed");
+
+    opt::variables_map opt_map;
+    try {
+        opt::store(opt::parse_command_line(argc, argv, desc), opt_map);
+        opt::notify(opt_map);
+    } catch (opt::error) {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+    if (opt_map.count("help") || cfg.width == 0) {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+
+    std::cout << Generator(cfg).program();
+    return 0;
+}
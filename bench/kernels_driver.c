@@ -0,0 +1,71 @@
+/* Times each kernel in kernels.kal against the equivalent C in
+ * kernels_ref.c, compiled at the same optimization level. */
+
+#include <stdio.h>
+#include <time.h>
+
+#ifndef OPT
+#define OPT 2
+#endif
+
+double fib(double), c_fib(double);
+double sumsq(double), c_sumsq(double);
+double poly(double), c_poly(double);
+double logistic(double, double, double), c_logistic(double, double, double);
+double dot(double *, double *, double), c_dot(double *, double *, double);
+double rdot(double *, double *, double);
+double scale(double *, double, double), c_scale(double *, double, double);
+
+#define N_ELTS 4096
+static double xs[N_ELTS], ys[N_ELTS];
+
+static volatile double sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, const char *impl, double ns) {
+    printf("{\"bench\": \"%s\", \"impl\": \"%s\", \"opt\": %d, "
+           "\"ns_per_call\": %.3f}\n", name, impl, OPT, ns);
+}
+
+/* Time `reps` evaluations of `expr` (which may depend on `k`). */
+#define TIME(name, impl, reps, expr) do {                 \
+        long k;                                           \
+        double start = now();                             \
+        for (k = 0; k < (reps); ++k) sink += (expr);      \
+        report((name), (impl), (now() - start) / (reps)); \
+    } while (0)
+
+int main(void) {
+    int j;
+    for (j = 0; j < N_ELTS; ++j) {
+        xs[j] = j * 1e-3;
+        ys[j] = 1 - j * 1e-3;
+    }
+
+    TIME("fib", "kalc",  20, fib(25 + (k & 1)));
+    TIME("fib", "clang", 20, c_fib(25 + (k & 1)));
+
+    TIME("sumsq", "kalc",  1000, sumsq(10000 + (k & 1)));
+    TIME("sumsq", "clang", 1000, c_sumsq(10000 + (k & 1)));
+
+    TIME("poly", "kalc",  10000000, poly(k * 1e-7));
+    TIME("poly", "clang", 10000000, c_poly(k * 1e-7));
+
+    TIME("logistic", "kalc",  1000, logistic(0.5, 3.7, 10000 + (k & 1)));
+    TIME("logistic", "clang", 1000, c_logistic(0.5, 3.7, 10000 + (k & 1)));
+
+    TIME("dot", "kalc",  10000, dot(xs, ys, N_ELTS - (k & 1)));
+    TIME("dot", "clang", 10000, c_dot(xs, ys, N_ELTS - (k & 1)));
+    TIME("rdot", "kalc",  10000, rdot(xs, ys, N_ELTS - (k & 1)));
+
+    /* Alternate between scaling up and down, to keep the values finite. */
+    TIME("scale", "kalc",  10000, scale(ys, (k & 1)? 0.5: 2, N_ELTS));
+    TIME("scale", "clang", 10000, c_scale(ys, (k & 1)? 0.5: 2, N_ELTS));
+
+    return 0;
+}
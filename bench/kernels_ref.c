@@ -0,0 +1,49 @@
+/* The kernels from kernels.kal, in C.  Kaleidoscope's `for` loops test their
+ * condition after the body, hence the do/while loops. */
+
+double c_fib(double n) {
+    return n < 1.5? n: c_fib(n - 1) + c_fib(n - 2);
+}
+
+double c_sumsq(double n) {
+    double acc = 0, i = 0;
+    do {
+        acc = acc + i * i / (i + 1);
+        i += 1;
+    } while (i < n);
+    return acc;
+}
+
+double c_poly(double x) {
+    return ((((((((0.5 * x + 1.25) * x - 2) * x + 0.75) * x - 1.5) * x
+             + 3.25) * x - 0.125) * x + 2) * x - 1);
+}
+
+double c_logistic(double x0, double r, double n) {
+    double x = x0, y = 0, t = 0, i = 0;
+    do {
+        t = r * x * (1 - x);
+        y = y + t;
+        x = t;
+        i += 1;
+    } while (i < n);
+    return y;
+}
+
+double c_dot(double *xs, double *ys, double n) {
+    double acc = 0, i = 0;
+    do {
+        acc = acc + xs[(long)i] * ys[(long)i];
+        i += 1;
+    } while (i < n);
+    return acc;
+}
+
+double c_scale(double *xs, double a, double n) {
+    double i = 0;
+    do {
+        xs[(long)i] = xs[(long)i] * a;
+        i += 1;
+    } while (i < n);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/* Times the kernels in memo.kal with and without memoization, as the
+ * problem grows.  Each size is measured in a fresh process, so the memo
+ * tables start out empty; a second (warm) call shows the cost of a hit. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+double fib(double), mfib(double);
+double paths(double, double), mpaths(double, double);
+
+static volatile double sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, const char *impl, int n, double ns) {
+    printf("{\"bench\": \"%s\", \"impl\": \"%s\", \"n\": %d, \"ns\": %.0f}\n",
+           name, impl, n, ns);
+}
+
+/* Time a single evaluation of `expr`. */
+#define TIME(name, impl, n, expr) do {        \
+        double start = now();                 \
+        sink += (expr);                       \
+        report((name), (impl), (n), now() - start); \
+    } while (0)
+
+/* Run `body` in a child process, and wait for it. */
+#define FRESH(body) do {                      \
+        fflush(stdout);                       \
+        if (fork() == 0) {                    \
+            body;                             \
+            fflush(stdout);                   \
+            _exit(0);                         \
+        }                                     \
+        wait(NULL);                           \
+    } while (0)
+
+int main(void) {
+    int n;
+
+    for (n = 10; n <= 35; n += 5) {
+        FRESH({
+            TIME("fib", "plain", n, fib(n));
+            TIME("fib", "memo", n, mfib(n));
+            TIME("fib", "memo (warm)", n, mfib(n));
+        });
+    }
+
+    for (n = 4; n <= 14; n += 2) {
+        FRESH({
+            TIME("paths", "plain", n, paths(n, n));
+            TIME("paths", "memo", n, mpaths(n, n));
+            TIME("paths", "memo (warm)", n, mpaths(n, n));
+        });
+    }
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+/* Times each kernel in parallel.kal as a serial loop and as a `parfor`
+ * loop.  Set KALRT_THREADS to vary the number of threads. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../runtime/kalrt.h"
+
+double sumsqrt(double *, double), psumsqrt(double *, double);
+double scale(double *, double, double), pscale(double *, double, double);
+double triangle(double), ptriangle(double);
+
+#define N_ELTS (1 << 22)
+
+static volatile double sink;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, const char *impl, double ns) {
+    printf("{\"bench\": \"%s\", \"impl\": \"%s\", \"threads\": %d, "
+           "\"ns_per_call\": %.0f}\n", name, impl, kalrt_threads(), ns);
+}
+
+/* Time `reps` evaluations of `expr` (which may depend on `k`). */
+#define TIME(name, impl, reps, expr) do {                 \
+        long k;                                           \
+        double start = now();                             \
+        for (k = 0; k < (reps); ++k) sink += (expr);      \
+        report((name), (impl), (now() - start) / (reps)); \
+    } while (0)
+
+int main(void) {
+    double *xs = malloc(N_ELTS * sizeof(double));
+    int j;
+    for (j = 0; j < N_ELTS; ++j) xs[j] = j * 1e-3;
+
+    TIME("sumsqrt", "for",    10, sumsqrt(xs, N_ELTS));
+    TIME("sumsqrt", "parfor", 10, psumsqrt(xs, N_ELTS));
+
+    /* Alternate between scaling up and down, to keep the values finite. */
+    TIME("scale", "for",    10, scale(xs, (k & 1)? 0.5: 2, N_ELTS));
+    TIME("scale", "parfor", 10, pscale(xs, (k & 1)? 0.5: 2, N_ELTS));
+
+    TIME("triangle", "for",    10, triangle(4000));
+    TIME("triangle", "parfor", 10, ptriangle(4000));
+
+    free(xs);
+    return 0;
+}
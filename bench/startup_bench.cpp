@@ -0,0 +1,110 @@
+/**
+ * @brief Measures the fixed cost of running `kalc`: process startup, LLVM
+ *        initialization and emitting an empty module.
+ *
+ * Builds that compile thousands of small files pay this for every one.
+ * Prints one JSON object per command line timed.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+namespace opt = boost::program_options;
+
+extern char **environ;
+
+typedef std::chrono::duration<double> seconds;
+
+/**
+ * @brief Run a command to completion without going through the shell, whose
+ *        own startup would swamp what we are trying to measure.
+ *
+ * @return Whether it exited successfully.
+ */
+static bool run(const std::vector<std::string> &args) {
+    std::vector<char *> argv;
+    for (auto &arg: args) argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    int status;
+    if (posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ)
+     || waitpid(pid, &status, 0) < 0) {
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned reps;
+    std::string kalc, input;
+    opt::options_description desc("kalc startup latency benchmark options");
+    desc.add_options()
+        ("help", "print usage information")
+        ("reps", opt::value(&reps)->default_value(100),
+            "number of times to run kalc")
+        ("kalc", opt::value(&kalc)->default_value("../kalc"),
+            "path to kalc")
+        ("input", opt::value(&input)->default_value("empty.kal"),
+            "source file to compile (normally empty)")
+        ("arg", opt::value<std::vector<std::string>>(),
+            "extra arguments for kalc (e.g. --connect SOCKET), after --");
+    opt::positional_options_description pos;
+    pos.add("arg", -1);
+
+    opt::variables_map opt_map;
+    try {
+        opt::store(opt::command_line_parser(argc, argv).options(desc)
+                                                       .positional(pos)
+                                                       .run(),
+                   opt_map);
+        opt::notify(opt_map);
+    } catch (opt::error) {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+    if (opt_map.count("help") || reps == 0) {
+        std::cerr << desc << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> args { kalc, input, "--obj", "/dev/null" };
+    if (opt_map.count("arg")) {
+        for (auto &arg: opt_map["arg"].as<std::vector<std::string>>()) {
+            args.push_back(arg);
+        }
+    }
+    std::string command;
+    for (auto &arg: args) command += (command.empty()? "": " ") + arg;
+
+    /* Once untimed, so that the binary and its libraries are in the page
+     * cache: a build running kalc thousands of times will find them there. */
+    if (!run(args)) {
+        std::cerr << "failed: " << command << std::endl;
+        return 2;
+    }
+
+    double min = 1e300, mean = 0;
+    for (unsigned i = 0; i < reps; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        if (!run(args)) {
+            std::cerr << "failed: " << command << std::endl;
+            return 2;
+        }
+        double t = seconds(std::chrono::steady_clock::now() - start).count();
+        min = std::min(min, t);
+        mean += t / reps;
+    }
+
+    std::cout << "{\"stage\": \"startup\", \"command\": \"" << command
+              << "\", \"reps\": " << reps << ", \"min_ms\": " << min * 1e3
+              << ", \"mean_ms\": " << mean * 1e3 << "}" << std::endl;
+    return 0;
+}
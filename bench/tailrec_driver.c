@@ -0,0 +1,35 @@
+/* Times the kernels in tailrec.kal at recursion depths far beyond what fits
+ * on the stack unless the recursion has been turned into a loop. */
+
+#include <stdio.h>
+#include <time.h>
+
+double countdown(double, double);
+double fibonacci(double);
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double depth, double ns) {
+    printf("{\"bench\": \"%s\", \"depth\": %.0f, \"ns_per_level\": %.3f}\n",
+           name, depth, ns / depth);
+}
+
+int main(void) {
+    double depth = 1e8;
+    double start, result;
+
+    start = now();
+    result = countdown(0, depth);
+    report("countdown", depth, now() - start);
+
+    start = now();
+    result += fibonacci(depth);
+    report("fibonacci", depth, now() - start);
+
+    /* Keep the calls from being optimized away. */
+    return result == 42.0;
+}
@@ -1,15 +1,20 @@
-#include <cassert>
+#include <cstdlib>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <unistd.h>
+#include <vector>
 
 #include <boost/program_options.hpp>
-#include <boost/variant.hpp>
+#include "llvm/Support/ManagedStatic.h"
 
-#include "AST.hh"
-#include "Parser.hh"
 #include "CodeGenerator.hh"
+#include "Diagnostics.hh"
+#include "Driver.hh"
+#include "Interpreter.hh"
+#include "Report.hh"
+#include "Server.hh"
 
 namespace opt = boost::program_options;
 
@@ -17,24 +22,225 @@ namespace opt = boost::program_options;
 static const int OBJFILE_MODE_BLAZEIT = 420;
 
 /**
- * @brief Pull a single AST out of the parser, and have the code generator
- *        visit it.
+ * @brief Open (truncating or creating) an output file for LLVM to write to.
+ *
+ * LLVM's stream formats are weird, so we can't use regular STL stream
+ * classes.
  */
-bool handle_input(Kaleidoscope::Parser &p, Kaleidoscope::CodeGenerator &c) {
-    try {
-        auto e = p.parse();
-        c(e);
-        return true;
-    } catch (Kaleidoscope::Error e) {
-        e.emit(std::cerr);
+static int open_output(const std::string &fname) {
+    return open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                OBJFILE_MODE_BLAZEIT);
+}
+
+/**
+ * @brief A path relative to the working directory, made absolute for a
+ *        compile server (which has its own working directory).
+ */
+static std::string absolute_path(const std::string &fname) {
+    if (fname[0] == '/') return fname;
+    char *cwd = getcwd(nullptr, 0);
+    std::string result = std::string(cwd? cwd: ".") + "/" + fname;
+    free(cwd);
+    return result;
+}
+
+/**
+ * @brief Collect the named inputs, reading `-` from stdin.
+ *
+ * @param absolute Name files by absolute path, so that a compile server
+ *                 (with its own working directory) can find them.
+ */
+static std::vector<Kaleidoscope::SourceFile> sources(
+        const std::vector<std::string> &fnames, bool absolute) {
+    std::vector<Kaleidoscope::SourceFile> result;
+    for (auto &fname: fnames) {
+        if (fname == "-") {
+            std::ostringstream text;
+            text << std::cin.rdbuf();
+            result.push_back(
+                    Kaleidoscope::SourceFile::memory("<stdin>", text.str()));
+        } else if (absolute) {
+            result.push_back(
+                    Kaleidoscope::SourceFile::file(absolute_path(fname)));
+        } else {
+            result.push_back(Kaleidoscope::SourceFile::file(fname));
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Work out how to print diagnostics from the command line.
+ *
+ * @return false if the options make no sense.
+ */
+static bool diagnostic_options(const opt::variables_map &opt_map,
+                               Kaleidoscope::DiagnosticOptions &diag_opts) {
+    using Kaleidoscope::DiagnosticFormat;
+    auto format = opt_map["diagnostics-format"].as<std::string>();
+    if (format == "human") {
+        diag_opts.format = DiagnosticFormat::human;
+    } else if (format == "json") {
+        diag_opts.format = DiagnosticFormat::json;
+    } else if (format == "sarif") {
+        diag_opts.format = DiagnosticFormat::sarif;
+    } else {
         return false;
     }
+    diag_opts.max_errors = opt_map["max-errors"].as<unsigned>();
+    /* Only colour output that's going straight to a person. */
+    diag_opts.color = diag_opts.format == DiagnosticFormat::human
+                   && isatty(STDERR_FILENO);
+    return true;
+}
+
+/**
+ * @brief Work out how to build the tables of `memo` functions from the
+ *        command line.
+ *
+ * @return false if the options make no sense.
+ */
+static bool memo_options(const opt::variables_map &opt_map,
+                         Kaleidoscope::MemoOptions &memo_opts) {
+    using Kaleidoscope::MemoTable;
+    using Kaleidoscope::MemoEviction;
+    auto table = opt_map["memo-table"].as<std::string>();
+    if (table == "per-thread") {
+        memo_opts.table = MemoTable::per_thread;
+    } else if (table == "shared") {
+        memo_opts.table = MemoTable::shared;
+    } else {
+        return false;
+    }
+    auto eviction = opt_map["memo-eviction"].as<std::string>();
+    if (eviction == "replace") {
+        memo_opts.eviction = MemoEviction::replace;
+    } else if (eviction == "keep") {
+        memo_opts.eviction = MemoEviction::keep;
+    } else {
+        return false;
+    }
+    memo_opts.capacity = opt_map["memo-capacity"].as<unsigned>();
+    return memo_opts.capacity > 0 && memo_opts.capacity <= (1u << 24);
+}
+
+/**
+ * @brief Work out where vectorized loops get vector math functions from the
+ *        command line.
+ *
+ * @return false if the option makes no sense.
+ */
+static bool vector_library(const opt::variables_map &opt_map,
+                           Kaleidoscope::VectorLibrary &library) {
+    using Kaleidoscope::VectorLibrary;
+    auto name = opt_map["veclib"].as<std::string>();
+    if (name == "none") {
+        library = VectorLibrary::none;
+    } else if (name == "kalrt") {
+        library = VectorLibrary::kalrt;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief The functions named by `--export` options, each of which may list
+ *        several, separated by commas.
+ */
+static std::vector<std::string> exports(const opt::variables_map &opt_map) {
+    std::vector<std::string> result;
+    if (!opt_map.count("export")) return result;
+    for (auto &list: opt_map["export"].as<std::vector<std::string>>()) {
+        std::istringstream names(list);
+        std::string name;
+        while (std::getline(names, name, ',')) {
+            if (!name.empty()) result.push_back(name);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief The libraries named by `--use` options, made absolute if they are
+ *        to be read by a compile server.
+ */
+static std::vector<std::string> libraries(const opt::variables_map &opt_map,
+                                          bool absolute) {
+    std::vector<std::string> result;
+    if (!opt_map.count("use")) return result;
+    for (auto &path: opt_map["use"].as<std::vector<std::string>>()) {
+        result.push_back(absolute? absolute_path(path): path);
+    }
+    return result;
+}
+
+/**
+ * @brief Write bytes received from a compile server to an output file.
+ */
+static void write_output(const std::string &fname, const std::string &data) {
+    std::ofstream file(fname, std::ios::binary);
+    file.write(data.data(), data.size());
+}
+
+/**
+ * @brief Have a compile server do the work.
+ */
+static int compile_remotely(const std::string &socket_path,
+                            const opt::variables_map &opt_map,
+                            Kaleidoscope::DiagnosticOptions diag_opts,
+                            Kaleidoscope::MemoOptions memo_opts,
+                            Kaleidoscope::VectorLibrary veclib) {
+    Kaleidoscope::CompileRequest request;
+    request.diagnostics = diag_opts;
+    request.memo = memo_opts;
+    request.sources = sources(opt_map["in"].as<std::vector<std::string>>(),
+                              true);
+    request.opt_level = opt_map["opt-level"].as<unsigned>();
+    request.warn_non_tail_recursion = opt_map.count("warn-non-tail-recursion");
+    request.builtins = !opt_map.count("fno-builtin");
+    request.associative_math = opt_map.count("fassociative-math");
+    request.vector_library = veclib;
+    request.direct_ssa = !opt_map.count("fno-direct-ssa");
+    request.exports = exports(opt_map);
+    request.libraries = libraries(opt_map, true);
+    request.profile_generate = opt_map.count("profile-generate");
+    if (opt_map.count("profile-use")) {
+        request.profile_use =
+            absolute_path(opt_map["profile-use"].as<std::string>());
+    }
+    request.obj = opt_map.count("obj");
+    request.ll = opt_map.count("ll");
+    request.bc = opt_map.count("emit-bc");
+    request.kpm = opt_map.count("emit-kpm");
+    request.thinlto = opt_map.count("thinlto");
+
+    Kaleidoscope::CompileResponse response;
+    if (!Kaleidoscope::request_compile(socket_path, request, response)) {
+        return 1;
+    }
+    std::cerr.write(response.diagnostics.data(),
+                    response.diagnostics.size());
+    if (!response.success) return 2;
+
+    if (request.obj) write_output(opt_map["obj"].as<std::string>(),
+                                  response.obj);
+    if (request.bc) write_output(opt_map["emit-bc"].as<std::string>(),
+                                 response.bc);
+    if (request.ll) write_output(opt_map["ll"].as<std::string>(),
+                                 response.ll);
+    if (request.kpm) write_output(opt_map["emit-kpm"].as<std::string>(),
+                                  response.kpm);
+    return 0;
 }
 
 /**
  * @brief Entry point.
  */
 int main(int argc, char **argv) {
+    /* Makes LLVM print its pass timings (if any) on the way out. */
+    llvm::llvm_shutdown_obj shutdown;
+
     /* Boost command-line option stuff... */
     opt::options_description desc("Kaleidoscope Compiler Options");
     desc.add_options()
@@ -43,7 +249,80 @@ int main(int argc, char **argv) {
             "select output file to emit object code")
         ("ll", opt::value<std::string>(),
             "select output file to emit LLVM IR")
-        ("in", opt::value<std::string>(), "select input file");
+        ("emit-bc", opt::value<std::string>(),
+            "select output file to emit LLVM bitcode")
+        ("emit-kpm", opt::value<std::string>(),
+            "select output file to emit a precompiled library, for --use")
+        ("use", opt::value<std::vector<std::string>>()->composing(),
+            "call (and inline) the functions of a precompiled library from "
+            "--emit-kpm; link with its object code")
+        ("run",
+            "run the program's top-level expressions, printing their values: "
+            "its functions are interpreted, until they get hot enough to "
+            "compile")
+        ("jit-threshold", opt::value<uint64_t>()->default_value(10000),
+            "calls to a function plus iterations of its loops after which "
+            "--run compiles it (0 to only interpret)")
+        ("thinlto",
+            "write a ThinLTO summary with the bitcode, so that it can be "
+            "inlined into C/C++ code at link time")
+        ("opt-level,O", opt::value<unsigned>()->default_value(2),
+            "optimization level (0-3)")
+        ("warn-non-tail-recursion",
+            "warn about recursive calls that are not in tail position")
+        ("fno-builtin",
+            "treat extern math functions (sqrt, sin, ...) as ordinary "
+            "functions, rather than LLVM intrinsics")
+        ("fassociative-math",
+            "let loop reductions add and multiply in any order, and assume "
+            "they see no NaNs, so that they can be vectorized")
+        ("veclib", opt::value<std::string>()->default_value("none"),
+            "vector versions of exp, log, sin, cos, pow, etc. for vectorized "
+            "loops: none, or kalrt (link with runtime/libkalrt.a and -lm)")
+        ("fno-direct-ssa",
+            "give every variable a stack slot, and leave LLVM to turn them "
+            "into SSA values")
+        ("export", opt::value<std::vector<std::string>>()->composing(),
+            "keep only these functions (comma-separated, as well as those "
+            "defined with 'export') callable from outside the module, so "
+            "that the rest can be inlined and deleted")
+        ("profile-generate",
+            "count calls and branches as the program runs, adding them to "
+            "$KALRT_PROFILE_FILE (default.kalprof) when it exits; link with "
+            "runtime/libkalrt.a")
+        ("profile-use", opt::value<std::string>(),
+            "optimize for the counts in a profile from a --profile-generate "
+            "build")
+        ("memo-capacity", opt::value<unsigned>()->default_value(1024),
+            "entries in the table of each memo function without its own "
+            "size (rounded up to a power of two)")
+        ("memo-table", opt::value<std::string>()->default_value("per-thread"),
+            "give memo functions a table per thread, or one shared by all "
+            "threads")
+        ("memo-eviction", opt::value<std::string>()->default_value("replace"),
+            "when a memo table slot is taken, replace the old result or keep "
+            "it")
+        ("time-report",
+            "print the time taken by each compiler phase and LLVM pass")
+        ("time-trace", opt::value<std::string>(),
+            "write a Chrome trace of compiler phases and functions")
+        ("stats",
+            "print counts of tokens, AST nodes, functions and instructions")
+        ("server", opt::value<std::string>(),
+            "run as a compile server listening on the given Unix socket")
+        ("jobs,j", opt::value<unsigned>()->default_value(0),
+            "number of requests a compile server handles at once (default: "
+            "one per core)")
+        ("diagnostics-format", opt::value<std::string>()
+                                   ->default_value("human"),
+            "print errors and warnings as human-readable text, json or sarif")
+        ("max-errors", opt::value<unsigned>()->default_value(0),
+            "stop printing diagnostics after this many errors (0 for no "
+            "limit)")
+        ("connect", opt::value<std::string>(),
+            "compile using the server listening on the given Unix socket")
+        ("in", opt::value<std::vector<std::string>>(),
+            "select input files (- for stdin)");
     opt::positional_options_description pos;
     pos.add("in", -1);
 
@@ -59,40 +338,144 @@ int main(int argc, char **argv) {
     }
     opt::notify(opt_map);
 
+    if (opt_map.count("server") && !opt_map.count("help")) {
+        return Kaleidoscope::serve(opt_map["server"].as<std::string>(),
+                                   opt_map["jobs"].as<unsigned>())? 0: 1;
+    }
+
+    Kaleidoscope::DiagnosticOptions diag_opts;
+    Kaleidoscope::MemoOptions memo_opts;
+    Kaleidoscope::VectorLibrary veclib;
+    bool emit = opt_map.count("obj") || opt_map.count("ll")
+             || opt_map.count("emit-bc") || opt_map.count("emit-kpm");
+    bool run = opt_map.count("run");
     /* If the user did good, */
     if (!opt_map.count("help")
-      && (opt_map.count("obj") || opt_map.count("ll"))
+      && diagnostic_options(opt_map, diag_opts)
+      && memo_options(opt_map, memo_opts)
+      && vector_library(opt_map, veclib)
+      && (emit || run)
+      /* Programs are run here, and on their own. */
+      && !(run && (emit || opt_map.count("connect") || opt_map.count("use")))
       && opt_map.count("in")) {
-        /* Get a code generator. */
-        Kaleidoscope::CodeGenerator codegen("Kaleidoscope module");
-        /* Open the source file. */
-        std::string infile(opt_map["in"].as<std::string>());
-        /* Construct a parser on that file. */
-        Kaleidoscope::Parser parser(infile);
-        bool successful = true;
-        /* Pull ASTs out of the parser */
-        while (true) {
-            /* until we hit EOF. */
-            if (parser.reached_end()) break;
-            if (!handle_input(parser, codegen)) successful = false;
+        /* Only bitcode has a summary. */
+        if (opt_map.count("thinlto") && !opt_map.count("emit-bc")) {
+            std::cerr << "kalc: --thinlto can only be used with --emit-bc"
+                      << std::endl;
+            return 1;
+        }
+        if (opt_map.count("connect")) {
+            /* The server's timings and counters would include its other
+             * requests (and LLVM's pass timers are process-wide). */
+            if (opt_map.count("time-report") || opt_map.count("stats")
+                || opt_map.count("time-trace")) {
+                std::cerr << "kalc: --time-report, --stats and --time-trace "
+                             "can't be used with --connect" << std::endl;
+                return 1;
+            }
+            return compile_remotely(opt_map["connect"].as<std::string>(),
+                                    opt_map, diag_opts, memo_opts, veclib);
+        }
+
+        Kaleidoscope::CodeGenOptions codegen_opts;
+        codegen_opts.opt_level = opt_map["opt-level"].as<unsigned>();
+        codegen_opts.warn_non_tail_recursion =
+            opt_map.count("warn-non-tail-recursion");
+        codegen_opts.builtins = !opt_map.count("fno-builtin");
+        codegen_opts.associative_math = opt_map.count("fassociative-math");
+        codegen_opts.vector_library = veclib;
+        codegen_opts.direct_ssa = !opt_map.count("fno-direct-ssa");
+        codegen_opts.exports = exports(opt_map);
+        codegen_opts.profile_generate = opt_map.count("profile-generate");
+        if (opt_map.count("profile-use")) {
+            codegen_opts.profile_use =
+                opt_map["profile-use"].as<std::string>();
+        }
+        codegen_opts.memo = memo_opts;
+        bool time_report = opt_map.count("time-report");
+        bool stats = opt_map.count("stats");
+        codegen_opts.time_passes = time_report;
+        Kaleidoscope::Report report;
+
+        std::unique_ptr<Kaleidoscope::CodeGenerator> codegen_ptr;
+        {
+            auto phase = report.span("startup");
+            /* Get a code generator.  A program that is run is only
+             * checked, so there's no point optimizing it. */
+            auto check_opts = codegen_opts;
+            if (run) check_opts.opt_level = 0;
+            codegen_ptr = std::make_unique<Kaleidoscope::CodeGenerator>(
+                    "Kaleidoscope module",
+                    llvm::sys::getDefaultTargetTriple(),
+                    run? check_opts: codegen_opts);
         }
+        auto &codegen = *codegen_ptr;
 
+        Kaleidoscope::DriverOptions driver_opts;
+        driver_opts.time_lexer = time_report;
+        driver_opts.stats = stats;
+        driver_opts.libraries = libraries(opt_map, false);
+        Kaleidoscope::Diagnostics diagnostics(diag_opts);
+        std::vector<Kaleidoscope::AST::Declaration> decls;
+        bool successful = Kaleidoscope::compile(
+                sources(opt_map["in"].as<std::vector<std::string>>(), false),
+                codegen, report, diagnostics, driver_opts, decls);
+        /* All at once, sorted, now that we have them all. */
+        diagnostics.flush(std::cerr);
         if (!successful) return 2;
 
+        if (run) {
+            codegen_ptr.reset();
+            auto phase = report.span("run");
+            Kaleidoscope::RunOptions run_opts;
+            run_opts.jit_threshold = opt_map["jit-threshold"].as<uint64_t>();
+            run_opts.codegen = codegen_opts;
+            Kaleidoscope::Interpreter interpreter(decls, run_opts, report);
+            try {
+                interpreter.run(std::cout);
+            } catch (Kaleidoscope::Error e) {
+                diagnostics.report(e);
+                diagnostics.flush(std::cerr);
+                return 2;
+            }
+            if (stats) {
+                for (auto &s: interpreter.statistics()) {
+                    report.count(s.first, s.second);
+                }
+            }
+        }
+
         if (opt_map.count("obj")) {
-            /* Open the output file (LLVM's stream formats are weird, so we
-             * can't use regular STL stream classes). */
-            int fd = open(opt_map["obj"].as<std::string>().c_str(),
-                          O_RDWR | O_CREAT,
-                          OBJFILE_MODE_BLAZEIT);
+            auto phase = report.span("emit object code");
+            int fd = open_output(opt_map["obj"].as<std::string>());
             /* Emit the object code. */
             codegen.emit_obj(fd);
             close(fd);
         }
+        if (opt_map.count("emit-bc")) {
+            auto phase = report.span("emit bitcode");
+            int fd = open_output(opt_map["emit-bc"].as<std::string>());
+            codegen.emit_bc(fd, opt_map.count("thinlto"));
+            close(fd);
+        }
+        if (opt_map.count("emit-kpm")) {
+            auto phase = report.span("emit library");
+            int fd = open_output(opt_map["emit-kpm"].as<std::string>());
+            codegen.emit_kpm(fd);
+            close(fd);
+        }
         if (opt_map.count("ll")) {
+            auto phase = report.span("emit IR");
             std::ofstream file(opt_map["ll"].as<std::string>());
             codegen.emit_ir(file);
         }
+
+        if (time_report) report.print_times(std::cerr);
+        if (stats) report.print_stats(std::cerr);
+        if (opt_map.count("time-trace")) {
+            std::ofstream trace(opt_map["time-trace"].as<std::string>());
+            report.write_trace(trace);
+        }
     } else {
         /* Print usage information if the user did bad. */
         std::cerr << desc << std::endl;
@@ -0,0 +1,301 @@
+/* The Kaleidoscope runtime: a work-stealing thread pool for `parfor` loops.
+ *
+ * The pool runs one loop at a time.  The thread that starts a loop works on
+ * it alongside the pool's threads, each of which starts with an equal share
+ * of the loop's chunks.  A thread takes chunks from the front of its own
+ * share until it runs out, then steals the back half of another's.  Loops
+ * started while the pool is busy (including loops nested in a parallel
+ * loop's body) run on the thread that starts them. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "kalrt.h"
+
+#define CACHE_LINE 64
+#define LINE_DOUBLES (CACHE_LINE / sizeof(double))
+
+/* Chunks each thread starts with, when the loop doesn't say how big chunks
+ * are: enough to even out iterations that take different times. */
+#define CHUNKS_PER_THREAD 8
+
+/* Chunk numbers have to fit in half a word; see `struct share`. */
+#define MAX_CHUNKS ((int64_t)1 << 31)
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+static double identity(char op) {
+    switch (op) {
+    case '*': return 1;
+    case '<': return INFINITY;
+    case '>': return -INFINITY;
+    case '+':
+    default:  return 0;
+    }
+}
+
+static double combine(char op, double a, double b) {
+    switch (op) {
+    case '*': return a * b;
+    /* Like `fmin` and `fmax`, ignoring NaNs. */
+    case '<': return b < a || a != a? b: a;
+    case '>': return b > a || a != a? b: a;
+    case '+':
+    default:  return a + b;
+    }
+}
+
+/*****************************************************************************
+ * The pool.
+ */
+
+/* The chunks [lo, hi) that a thread has yet to run (or have stolen), packed
+ * into one word so that thieves can take some with a compare-and-swap.
+ * Chunks only ever move from one share to another, so a share never holds
+ * the same non-empty range twice during a loop (and ABA can't happen). */
+struct share {
+    _Atomic uint64_t bounds;
+    char padding[CACHE_LINE - sizeof(uint64_t)];
+};
+
+static uint64_t pack(int64_t lo, int64_t hi) {
+    return (uint64_t)hi << 32 | (uint64_t)lo;
+}
+
+static int64_t lo_of(uint64_t bounds) { return bounds & 0xffffffff; }
+static int64_t hi_of(uint64_t bounds) { return bounds >> 32; }
+
+struct job {
+    kalrt_body *body;
+    void *env;
+    int64_t iterations, chunk;
+    int32_t reductions;
+    const char *ops;
+    /* Each thread's accumulators, `stride` doubles apart. */
+    double *acc;
+    size_t stride;
+};
+
+static struct {
+    pthread_once_t once;
+    int threads;
+    /* From KALRT_CHUNK, or 0. */
+    int64_t chunk;
+    struct share *shares;
+
+    /* Held by the thread whose loop the pool is running. */
+    pthread_mutex_t busy;
+
+    /* Protects the rest. */
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    struct job *job;
+    /* Incremented for each loop. */
+    unsigned long generation;
+    /* Pool threads still working on the current loop. */
+    int running;
+} pool = {
+    .once = PTHREAD_ONCE_INIT,
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Is this thread already running part of a parallel loop? */
+static _Thread_local int in_pool;
+
+/* Take the first chunk of thread `self`'s share, or return -1. */
+static int64_t take(int self) {
+    _Atomic uint64_t *bounds = &pool.shares[self].bounds;
+    uint64_t b = atomic_load(bounds);
+    while (lo_of(b) < hi_of(b)) {
+        if (atomic_compare_exchange_weak(bounds, &b,
+                                         pack(lo_of(b) + 1, hi_of(b)))) {
+            return lo_of(b);
+        }
+    }
+    return -1;
+}
+
+/* Steal the back half of another thread's share (whose own is empty), and
+ * return its first chunk; or return -1 if there is nothing left. */
+static int64_t steal(int self) {
+    for (int i = 1; i < pool.threads; ++i) {
+        int victim = (self + i) % pool.threads;
+        _Atomic uint64_t *bounds = &pool.shares[victim].bounds;
+        uint64_t b = atomic_load(bounds);
+        while (lo_of(b) < hi_of(b)) {
+            int64_t lo = lo_of(b), hi = hi_of(b);
+            int64_t mid = hi - (hi - lo + 1) / 2;
+            if (atomic_compare_exchange_weak(bounds, &b, pack(lo, mid))) {
+                /* No-one else writes to an empty share. */
+                atomic_store(&pool.shares[self].bounds, pack(mid + 1, hi));
+                return mid;
+            }
+        }
+    }
+    return -1;
+}
+
+static void run_chunks(struct job *job, int self) {
+    double *acc = job->acc? job->acc + self * job->stride: NULL;
+    int64_t chunk;
+    while ((chunk = take(self)) >= 0 || (chunk = steal(self)) >= 0) {
+        int64_t begin = chunk * job->chunk;
+        int64_t end = job->iterations - begin < job->chunk
+                    ? job->iterations
+                    : begin + job->chunk;
+        job->body(job->env, begin, end, acc);
+    }
+}
+
+static void *worker_main(void *arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+    in_pool = 1;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        seen = pool.generation;
+        struct job *job = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_chunks(job, self);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.running == 0) pthread_cond_signal(&pool.done);
+    }
+    return NULL;
+}
+
+static void start_pool(void) {
+    const char *threads = getenv("KALRT_THREADS");
+    const char *chunk = getenv("KALRT_CHUNK");
+    pool.threads = threads? atoi(threads): (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (pool.threads < 1) pool.threads = 1;
+    pool.chunk = chunk? strtoll(chunk, NULL, 10): 0;
+
+    void *shares;
+    if (posix_memalign(&shares, CACHE_LINE,
+                       pool.threads * sizeof(struct share))) {
+        pool.threads = 1;
+        return;
+    }
+    pool.shares = shares;
+
+    /* Thread 0 is whichever starts the loop. */
+    for (int i = 1; i < pool.threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, (void *)(intptr_t)i)) {
+            pool.threads = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/** Run a whole loop on this thread, in order.  Its reductions still start
+ *  from the identity and are combined with the values before the loop, as
+ *  on the pool, so that the results don't depend on where it ran. */
+static void run_here(int64_t iterations, kalrt_body *body, void *env,
+                     int32_t reductions, const char *ops, double *results) {
+    double acc[reductions > 0? reductions: 1];
+    for (int32_t r = 0; r < reductions; ++r) acc[r] = identity(ops[r]);
+    body(env, 0, iterations, acc);
+    for (int32_t r = 0; r < reductions; ++r) {
+        results[r] = combine(ops[r], results[r], acc[r]);
+    }
+}
+
+/*****************************************************************************
+ * Interface.
+ */
+
+int kalrt_threads(void) {
+    pthread_once(&pool.once, start_pool);
+    return pool.threads;
+}
+
+void kalrt_parfor(int64_t iterations, int64_t chunk,
+                  kalrt_body *body, void *env,
+                  int32_t reductions, const char *ops, double *results) {
+    if (iterations <= 0) return;
+    int threads = kalrt_threads();
+
+    if (chunk <= 0) chunk = pool.chunk;
+    if (chunk <= 0) chunk = iterations / (threads * CHUNKS_PER_THREAD);
+    if (chunk < (iterations - 1) / MAX_CHUNKS + 1) {
+        chunk = (iterations - 1) / MAX_CHUNKS + 1;
+    }
+    int64_t chunks = (iterations - 1) / chunk + 1;
+
+    if (chunks == 1 || threads == 1 || in_pool
+     || pthread_mutex_trylock(&pool.busy) != 0) {
+        /* Just run the loop here, in order. */
+        run_here(iterations, body, env, reductions, ops, results);
+        return;
+    }
+    in_pool = 1;
+
+    struct job job = {
+        .body = body, .env = env,
+        .iterations = iterations, .chunk = chunk,
+        .reductions = reductions, .ops = ops,
+        /* Keep each thread's accumulators on their own cache lines. */
+        .stride = (reductions + LINE_DOUBLES - 1) / LINE_DOUBLES
+                * LINE_DOUBLES,
+    };
+    void *acc = NULL;
+    size_t acc_size = threads * job.stride * sizeof(double);
+    if (acc_size && posix_memalign(&acc, CACHE_LINE, acc_size)) {
+        in_pool = 0;
+        pthread_mutex_unlock(&pool.busy);
+        run_here(iterations, body, env, reductions, ops, results);
+        return;
+    }
+    job.acc = acc;
+    for (int t = 0; t < threads; ++t) {
+        for (int32_t r = 0; r < reductions; ++r) {
+            job.acc[t * job.stride + r] = identity(ops[r]);
+        }
+        atomic_store(&pool.shares[t].bounds,
+                     pack(chunks * t / threads, chunks * (t + 1) / threads));
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = &job;
+    pool.running = threads - 1;
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_chunks(&job, 0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    /* Combine the threads' contributions in a fixed order. */
+    for (int t = 0; t < threads; ++t) {
+        for (int32_t r = 0; r < reductions; ++r) {
+            results[r] = combine(ops[r], results[r],
+                                 job.acc[t * job.stride + r]);
+        }
+    }
+    free(acc);
+
+    in_pool = 0;
+    pthread_mutex_unlock(&pool.busy);
+}
@@ -0,0 +1,78 @@
+/**
+ * @brief The Kaleidoscope runtime library, which programs using `parfor` or
+ *        compiled with `--profile-generate` or `--veclib=kalrt` must be
+ *        linked with (`runtime/libkalrt.a`, and `-pthread` and `-lm`).
+ *
+ * `kalc` generates the calls to these functions; C code may call them too.
+ * The vector math functions (`kalrt_exp_v4f64` and so on, see vecmath.c)
+ * take and return vectors, so aren't declared here.
+ */
+
+#ifndef KALRT_H
+#define KALRT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief The body of a parallel loop.
+ *
+ * Runs iterations `begin` (inclusive) to `end` (exclusive), with `begin <
+ * end`, folding each reduction's contributions into the corresponding
+ * element of `acc`.
+ */
+typedef void kalrt_body(void *env, int64_t begin, int64_t end, double *acc);
+
+/**
+ * @brief Run `iterations` iterations of a loop body on the thread pool.
+ *
+ * The iterations are split into chunks of `chunk` iterations (or, if it is
+ * 0, of a size chosen to give each thread several chunks), which idle
+ * threads steal from busy ones.  Returns once every iteration has run.
+ *
+ * @param reductions The number of reduction variables.
+ * @param ops        Their operators: `+`, `*`, `<` (minimum) or `>`
+ *                   (maximum).
+ * @param results    Their values before the loop, which are updated to
+ *                   their values after it.
+ */
+void kalrt_parfor(int64_t iterations, int64_t chunk,
+                  kalrt_body *body, void *env,
+                  int32_t reductions, const char *ops, double *results);
+
+/**
+ * @brief The number of threads parallel loops run on: `KALRT_THREADS` if
+ *        it is set, otherwise the number of online processors.
+ */
+int kalrt_threads(void);
+
+/**
+ * @brief The counters of a function compiled with `--profile-generate`.
+ */
+struct kalrt_profile_function {
+    const char *name;
+    /** Of its code, so that counts from different versions aren't mixed. */
+    uint64_t hash;
+    uint32_t counters;
+    uint64_t *counts;
+};
+
+/**
+ * @brief Add the counts of `count` functions to the profile when the
+ *        program exits.
+ *
+ * The profile is `KALRT_PROFILE_FILE` if it is set, otherwise
+ * `default.kalprof` in the working directory.  Counts already in it (from
+ * earlier runs of the same code) are added to, so that it covers every run.
+ */
+void kalrt_profile_register(const struct kalrt_profile_function *functions,
+                            int32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,213 @@
+/* The Kaleidoscope runtime: profiles of programs compiled with
+ * `--profile-generate`.
+ *
+ * Each module registers its functions' counters from a constructor.  When
+ * the program exits the profile is read back (if there is one), the counts
+ * are added to those recorded for the same code, and the result replaces
+ * it: written to a temporary file first, so that a run that dies part of
+ * the way through doesn't lose the counts of earlier ones.
+ *
+ * Profiles are text: a `kalprof 1` line, then a line per function giving
+ * its name, its hash (in hex), the number of counters, and their counts. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kalrt.h"
+
+#define HEADER "kalprof 1"
+
+/* Registered before `main`, so only ever touched by one thread. */
+static struct module {
+    const struct kalrt_profile_function *functions;
+    int32_t count;
+    struct module *next;
+} *modules;
+
+/* A function's line in an existing profile. */
+struct record {
+    struct kalrt_profile_function function;
+    /* Superseded by one of the program's functions. */
+    int merged;
+};
+
+/*****************************************************************************
+ * Reading profiles.
+ */
+
+static const char *profile_path(void) {
+    const char *path = getenv("KALRT_PROFILE_FILE");
+    return path && *path? path: "default.kalprof";
+}
+
+static void free_records(struct record *records, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        free((char *)records[i].function.name);
+        free(records[i].function.counts);
+    }
+    free(records);
+}
+
+/* Parse a function's line (destructively), or return 0 if it isn't one. */
+static int parse_record(char *line, struct record *r) {
+    const char *delims = " \n";
+    char *save, *end;
+    char *name = strtok_r(line, delims, &save);
+    char *hash = strtok_r(NULL, delims, &save);
+    char *counters = strtok_r(NULL, delims, &save);
+    if (!name || !hash || !counters) return 0;
+
+    r->function.hash = strtoull(hash, &end, 16);
+    if (*end) return 0;
+    unsigned long long n = strtoull(counters, &end, 10);
+    if (*end || n == 0 || n > UINT32_MAX) return 0;
+    r->function.counters = n;
+    uint64_t *counts = malloc(n * sizeof *counts);
+    if (!counts) return 0;
+    for (unsigned long long i = 0; i < n; ++i) {
+        char *count = strtok_r(NULL, delims, &save);
+        if (count) counts[i] = strtoull(count, &end, 10);
+        if (!count || *end) {
+            free(counts);
+            return 0;
+        }
+    }
+    if (strtok_r(NULL, delims, &save) || !(name = strdup(name))) {
+        free(counts);
+        return 0;
+    }
+    r->function.name = name;
+    r->function.counts = counts;
+    r->merged = 0;
+    return 1;
+}
+
+/* The functions in the profile at `path`: none if there isn't one, or if it
+ * can't be read (in which case it will be replaced). */
+static struct record *read_profile(const char *path, size_t *count) {
+    *count = 0;
+    FILE *in = fopen(path, "r");
+    if (!in) return NULL;
+
+    struct record *records = NULL;
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t size = 0;
+    int ok = getline(&line, &size, in) > 0 && !strcmp(line, HEADER "\n");
+    while (ok && getline(&line, &size, in) > 0) {
+        if (*count == capacity) {
+            capacity = capacity? 2 * capacity: 16;
+            struct record *grown = realloc(records,
+                                           capacity * sizeof *records);
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            records = grown;
+        }
+        ok = parse_record(line, &records[*count]);
+        if (ok) ++*count;
+    }
+    free(line);
+    fclose(in);
+
+    if (!ok) {
+        fprintf(stderr, "kalrt: replacing %s, which is not a profile\n",
+                path);
+        free_records(records, *count);
+        *count = 0;
+        return NULL;
+    }
+    return records;
+}
+
+/*****************************************************************************
+ * Writing profiles.
+ */
+
+static struct record *find(struct record *records, size_t count,
+                           const char *name) {
+    for (size_t i = 0; i < count; ++i) {
+        if (!strcmp(records[i].function.name, name)) return &records[i];
+    }
+    return NULL;
+}
+
+/* Write a function's line, adding `earlier` counts (if any) to its own. */
+static void write_function(FILE *out, const struct kalrt_profile_function *f,
+                           const uint64_t *earlier) {
+    fprintf(out, "%s %016" PRIx64 " %" PRIu32, f->name, f->hash,
+            f->counters);
+    for (uint32_t i = 0; i < f->counters; ++i) {
+        fprintf(out, " %" PRIu64, f->counts[i] + (earlier? earlier[i]: 0));
+    }
+    fputc('\n', out);
+}
+
+static void write_profile(void) {
+    const char *path = profile_path();
+    size_t n_records;
+    struct record *records = read_profile(path, &n_records);
+
+    size_t tmp_size = strlen(path) + 32;
+    char *tmp = malloc(tmp_size);
+    FILE *out = NULL;
+    if (tmp) {
+        snprintf(tmp, tmp_size, "%s.%ld.tmp", path, (long)getpid());
+        out = fopen(tmp, "w");
+    }
+    if (!out) {
+        fprintf(stderr, "kalrt: cannot write the profile %s\n", path);
+        free(tmp);
+        free_records(records, n_records);
+        return;
+    }
+
+    fputs(HEADER "\n", out);
+    for (struct module *m = modules; m; m = m->next) {
+        for (int32_t i = 0; i < m->count; ++i) {
+            const struct kalrt_profile_function *f = &m->functions[i];
+            struct record *r = find(records, n_records, f->name);
+            const uint64_t *earlier = NULL;
+            if (r) {
+                r->merged = 1;
+                /* Counts from different code don't add up. */
+                if (r->function.hash == f->hash
+                 && r->function.counters == f->counters) {
+                    earlier = r->function.counts;
+                }
+            }
+            write_function(out, f, earlier);
+        }
+    }
+    /* Keep functions this program doesn't have (e.g. from other programs
+     * sharing the profile). */
+    for (size_t i = 0; i < n_records; ++i) {
+        if (!records[i].merged) write_function(out, &records[i].function,
+                                               NULL);
+    }
+
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "kalrt: cannot write the profile %s\n", path);
+        remove(tmp);
+    }
+    free(tmp);
+    free_records(records, n_records);
+}
+
+void kalrt_profile_register(const struct kalrt_profile_function *functions,
+                            int32_t count) {
+    struct module *m = malloc(sizeof *m);
+    if (!m) return;
+    if (!modules) atexit(write_profile);
+    m->functions = functions;
+    m->count = count;
+    m->next = modules;
+    modules = m;
+}
@@ -0,0 +1,114 @@
+/* The Kaleidoscope runtime: vector versions of the C library's math
+ * functions, which loops calling `exp`, `log`, `sin`, etc. are vectorized
+ * with when compiled with `--veclib=kalrt`.
+ *
+ * Each function comes in three widths: two doubles (SSE2), four (AVX) and
+ * eight (AVX-512), passed and returned in a single vector register, as
+ * LLVM's vectorizer calls them.  All the lanes are computed at once, by
+ * fdlibm's polynomial approximations, to within a couple of ulps of the C
+ * library.  Lanes the approximations don't cover (NaNs, infinities, results
+ * that overflow or are subnormal, and large arguments to `sin` and `cos`)
+ * are handed to the C library one by one, so that they come out exactly as
+ * the scalar calls would. */
+
+#include <math.h>
+#include <stdint.h>
+
+#include "kalrt.h"
+
+#if defined(__x86_64__)
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+
+/*****************************************************************************
+ * Constants shared by every width.
+ */
+
+/* Adding this rounds a double of magnitude below 2^51 to an integer, which
+ * is then the low bits of the sum's representation. */
+#define SHIFTER 0x1.8p52
+#define SHIFTER_BITS 0x4338000000000000LL
+
+#define EXPONENT_BIAS 1023
+#define MANTISSA_MASK 0x000fffffffffffffLL
+#define ONE_BITS 0x3ff0000000000000LL
+#define SIGN_BIT INT64_MIN
+#define SQRT2 1.41421356237309504880
+
+/* ln 2, split so that multiples of the high part by small integers are
+ * exact. */
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define LN2 6.93147180559945309417e-01
+#define INV_LN2 1.44269504088896338700e+00
+#define INV_LN10 4.34294481903251816668e-01
+
+/* Bounds within which the approximations are used. */
+#define EXP_MAX 708.0
+#define EXP2_MAX 1020.0
+#define TRIG_MAX 0x1p18
+#define POW_Y_MAX 0x1p900
+
+/* log(1 + f) on [sqrt(2)/2 - 1, sqrt(2) - 1]; see fdlibm's e_log.c. */
+#define LG1 6.666666666666735130e-01
+#define LG2 3.999999999940941908e-01
+#define LG3 2.857142874366239149e-01
+#define LG4 2.222219843214978396e-01
+#define LG5 1.818357216161805012e-01
+#define LG6 1.531383769920937332e-01
+#define LG7 1.479819860511658591e-01
+
+/* pi/2 in three parts, the first two of 33 bits each; see fdlibm's
+ * e_rem_pio2.c. */
+#define INV_PIO2 6.36619772367581382433e-01
+#define PIO2_1 1.57079632673412561417e+00
+#define PIO2_2 6.07710050630396597660e-11
+#define PIO2_2T 2.02226624879595063154e-21
+
+/* sin and cos on [-pi/4, pi/4]; see fdlibm's k_sin.c and k_cos.c. */
+#define S1 -1.66666666666666324348e-01
+#define S2 8.33333333332248946124e-03
+#define S3 -1.98412698298579493134e-04
+#define S4 2.75573137070700676789e-06
+#define S5 -2.50507602534068634195e-08
+#define S6 1.58969099521155010221e-10
+#define C1 4.16666666666666019037e-02
+#define C2 -1.38888888888741095749e-03
+#define C3 2.48015872894767294178e-05
+#define C4 -2.75573143513906633035e-07
+#define C5 2.08757232129817482790e-09
+#define C6 -1.13596475577881948265e-11
+
+/* Splits a double into halves whose products are exact (Veltkamp). */
+#define SPLITTER 134217729.0
+
+/*****************************************************************************
+ * The functions, once per width.
+ */
+
+#define WIDTH 2
+#define TARGET
+#include "vecmath_width.h"
+#undef WIDTH
+#undef TARGET
+
+#define WIDTH 4
+#define TARGET __attribute__((target("avx")))
+#include "vecmath_width.h"
+#undef WIDTH
+#undef TARGET
+
+#define WIDTH 8
+#define TARGET __attribute__((target("avx512f")))
+#include "vecmath_width.h"
+#undef WIDTH
+#undef TARGET
+
+#else
+
+/* Only x86-64's vector calling convention is supported so far; kalc maps
+ * math functions to these only when compiling for it. */
+typedef int kalrt_no_vector_math;
+
+#endif
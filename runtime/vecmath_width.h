@@ -0,0 +1,263 @@
+/* The vector math functions for vectors of WIDTH doubles, compiled with the
+ * TARGET attribute; included by vecmath.c once per width.
+ *
+ * The vectors are GCC's generic vectors: arithmetic and comparisons work
+ * lane by lane (a comparison giving -1 in the lanes where it holds, 0
+ * elsewhere), scalars are broadcast, and casting between vectors of the
+ * same size reinterprets their bits. */
+
+#define VD CONCAT(vdouble, WIDTH)
+#define VI CONCAT(vint, WIDTH)
+#define LOCAL(name) CONCAT(name##_, WIDTH)
+#define PUBLIC(name) CONCAT(CONCAT(kalrt_##name##_v, WIDTH), f64)
+
+typedef double VD __attribute__((vector_size(WIDTH * sizeof(double))));
+typedef int64_t VI __attribute__((vector_size(WIDTH * sizeof(double))));
+
+/*****************************************************************************
+ * Utilities.
+ */
+
+/* A vector with every lane `d`. */
+static inline TARGET VD LOCAL(splat)(double d) {
+    VD zero = {0};
+    return zero + d;
+}
+
+/* `a` in the lanes where `mask` is set, `b` elsewhere. */
+static inline TARGET VD LOCAL(select)(VI mask, VD a, VD b) {
+    return (VD)(((VI)a & mask) | ((VI)b & ~mask));
+}
+
+/* Small integers (below 2^51 in magnitude) as doubles. */
+static inline TARGET VD LOCAL(to_double)(VI n) {
+    return (VD)(n + SHIFTER_BITS) - SHIFTER;
+}
+
+/* Round to the nearest integer, returned both as a double and (through
+ * `n`) as an integer. */
+static inline TARGET VD LOCAL(round)(VD x, VI *n) {
+    VD shifted = x + SHIFTER;
+    *n = (VI)shifted - SHIFTER_BITS;
+    return shifted - SHIFTER;
+}
+
+/* e^(hi + lo), for |hi| <= EXP_MAX and |lo| much smaller: with hi + lo =
+ * k ln2 + r, |r| <= ln2 / 2, it is 2^k e^r, and e^r is its Taylor series
+ * (whose terms from r^14 on are too small to matter). */
+static inline TARGET VD LOCAL(exp_reduced)(VD hi, VD lo) {
+    VI k;
+    VD kd = LOCAL(round)(hi * INV_LN2, &k);
+    VD r = ((hi - kd * LN2_HI) - kd * LN2_LO) + lo;
+    VD p = r * (1.0 / 6227020800) + 1.0 / 479001600;
+    p = p * r + 1.0 / 39916800;
+    p = p * r + 1.0 / 3628800;
+    p = p * r + 1.0 / 362880;
+    p = p * r + 1.0 / 40320;
+    p = p * r + 1.0 / 5040;
+    p = p * r + 1.0 / 720;
+    p = p * r + 1.0 / 120;
+    p = p * r + 1.0 / 24;
+    p = p * r + 1.0 / 6;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+    return p * (VD)((k + EXPONENT_BIAS) << 52);
+}
+
+/* For positive, normal, finite x: log(x) = k ln2 + log(1 + f), where
+ * 1 + f is the mantissa, in (sqrt(2)/2, sqrt(2)].  With s = f / (2 + f),
+ * log(1 + f) = 2s + sR, R being a polynomial in s^2.  Returns k, and sets
+ * `f`, `s` and `sR`. */
+static inline TARGET VD LOCAL(log_reduced)(VD x, VD *f, VD *s, VD *sR) {
+    VI bits = (VI)x;
+    VI k = (bits >> 52) - EXPONENT_BIAS;
+    VD m = (VD)((bits & MANTISSA_MASK) | ONE_BITS);
+    VI big = (VI)(m > SQRT2);
+    m = LOCAL(select)(big, m * 0.5, m);
+    k -= big;
+
+    *f = m - 1.0;
+    *s = *f / (2.0 + *f);
+    VD z = *s * *s, w = z * z;
+    VD t1 = w * (LG2 + w * (LG4 + w * LG6));
+    VD t2 = z * (LG1 + w * (LG3 + w * (LG5 + w * LG7)));
+    *sR = *s * (t1 + t2);
+    return LOCAL(to_double)(k);
+}
+
+/* log(x), from its reduction: k ln2 + f - (f^2 / 2 - s (f^2 / 2 + R)),
+ * summed in the order fdlibm does for accuracy. */
+static inline TARGET VD LOCAL(log_sum)(VD k, VD f, VD s, VD sR) {
+    VD hfsq = 0.5 * f * f;
+    VD c = hfsq - (s * hfsq + sR);
+    return k * LN2_HI - ((c - k * LN2_LO) - f);
+}
+
+/* Lanes a positive, normal, finite number. */
+static inline TARGET VI LOCAL(log_domain)(VD x) {
+    return (VI)(x >= 0x1p-1022) & (VI)(x <= 0x1.fffffffffffffp1023);
+}
+
+/* x mod pi/2, for |x| <= TRIG_MAX, setting `quadrant` to the multiple of
+ * pi/2 taken away (mod 4). */
+static inline TARGET VD LOCAL(trig_reduced)(VD x, VI *quadrant) {
+    VI n;
+    VD nd = LOCAL(round)(x * INV_PIO2, &n);
+    *quadrant = n & 3;
+    return ((x - nd * PIO2_1) - nd * PIO2_2) - nd * PIO2_2T;
+}
+
+static inline TARGET VD LOCAL(sin_kernel)(VD x) {
+    VD z = x * x;
+    VD r = S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)));
+    return x + z * x * (S1 + z * r);
+}
+
+static inline TARGET VD LOCAL(cos_kernel)(VD x) {
+    VD z = x * x;
+    VD r = z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+    VD hz = 0.5 * z;
+    VD w = 1.0 - hz;
+    return w + (((1.0 - w) - hz) + z * r);
+}
+
+/* Flip the sign of the lanes where `mask` is set. */
+static inline TARGET VD LOCAL(negate)(VI mask, VD x) {
+    return (VD)((VI)x ^ (mask & SIGN_BIT));
+}
+
+/* The exact sum a + b = s + err. */
+static inline TARGET VD LOCAL(two_sum)(VD a, VD b, VD *err) {
+    VD s = a + b;
+    VD bb = s - a;
+    *err = (a - (s - bb)) + (b - bb);
+    return s;
+}
+
+/* The exact product a * b = p + err (Dekker's, without an FMA). */
+static inline TARGET VD LOCAL(two_product)(VD a, VD b, VD *err) {
+    VD p = a * b;
+    VD ta = SPLITTER * a, tb = SPLITTER * b;
+    VD ah = ta - (ta - a), bh = tb - (tb - b);
+    VD al = a - ah, bl = b - bh;
+    *err = ((ah * bh - p) + ah * bl + al * bh) + al * bl;
+    return p;
+}
+
+/*****************************************************************************
+ * The functions.
+ */
+
+TARGET VD PUBLIC(exp)(VD x) {
+    VI ok = (VI)(x >= -EXP_MAX) & (VI)(x <= EXP_MAX);
+    VD zero = LOCAL(splat)(0);
+    VD result = LOCAL(exp_reduced)(LOCAL(select)(ok, x, zero), zero);
+    for (int i = 0; i < WIDTH; ++i) if (!ok[i]) result[i] = exp(x[i]);
+    return result;
+}
+
+TARGET VD PUBLIC(exp2)(VD x) {
+    VI ok = (VI)(x >= -EXP2_MAX) & (VI)(x <= EXP2_MAX);
+    VD zero = LOCAL(splat)(0);
+    VI k;
+    VD kd = LOCAL(round)(LOCAL(select)(ok, x, zero), &k);
+    /* 2^x = 2^k e^((x - k) ln2), where x - k is exact. */
+    VD result = LOCAL(exp_reduced)((x - kd) * LN2, zero)
+              * (VD)((k + EXPONENT_BIAS) << 52);
+    for (int i = 0; i < WIDTH; ++i) if (!ok[i]) result[i] = exp2(x[i]);
+    return result;
+}
+
+TARGET VD PUBLIC(log)(VD x) {
+    VI ok = LOCAL(log_domain)(x);
+    VD f, s, sR;
+    VD k = LOCAL(log_reduced)(LOCAL(select)(ok, x, LOCAL(splat)(1)),
+                              &f, &s, &sR);
+    VD result = LOCAL(log_sum)(k, f, s, sR);
+    for (int i = 0; i < WIDTH; ++i) if (!ok[i]) result[i] = log(x[i]);
+    return result;
+}
+
+TARGET VD PUBLIC(log2)(VD x) {
+    VI ok = LOCAL(log_domain)(x);
+    VD f, s, sR;
+    VD k = LOCAL(log_reduced)(LOCAL(select)(ok, x, LOCAL(splat)(1)),
+                              &f, &s, &sR);
+    VD result = k + LOCAL(log_sum)(LOCAL(splat)(0), f, s, sR) * INV_LN2;
+    for (int i = 0; i < WIDTH; ++i) if (!ok[i]) result[i] = log2(x[i]);
+    return result;
+}
+
+TARGET VD PUBLIC(log10)(VD x) {
+    VI ok = LOCAL(log_domain)(x);
+    VD f, s, sR;
+    VD k = LOCAL(log_reduced)(LOCAL(select)(ok, x, LOCAL(splat)(1)),
+                              &f, &s, &sR);
+    VD result = LOCAL(log_sum)(k, f, s, sR) * INV_LN10;
+    for (int i = 0; i < WIDTH; ++i) if (!ok[i]) result[i] = log10(x[i]);
+    return result;
+}
+
+TARGET VD PUBLIC(sin)(VD x) {
+    VI ok = (VI)(x >= -TRIG_MAX) & (VI)(x <= TRIG_MAX);
+    VI quadrant;
+    VD r = LOCAL(trig_reduced)(LOCAL(select)(ok, x, LOCAL(splat)(0)),
+                               &quadrant);
+    VI odd = (VI)((quadrant & 1) != 0);
+    VD result = LOCAL(select)(odd, LOCAL(cos_kernel)(r),
+                              LOCAL(sin_kernel)(r));
+    result = LOCAL(negate)((VI)((quadrant & 2) != 0), result);
+    for (int i = 0; i < WIDTH; ++i) if (!ok[i]) result[i] = sin(x[i]);
+    return result;
+}
+
+TARGET VD PUBLIC(cos)(VD x) {
+    VI ok = (VI)(x >= -TRIG_MAX) & (VI)(x <= TRIG_MAX);
+    VI quadrant;
+    VD r = LOCAL(trig_reduced)(LOCAL(select)(ok, x, LOCAL(splat)(0)),
+                               &quadrant);
+    VI odd = (VI)((quadrant & 1) != 0);
+    VD result = LOCAL(select)(odd, LOCAL(sin_kernel)(r),
+                              LOCAL(cos_kernel)(r));
+    result = LOCAL(negate)((VI)(((quadrant + 1) & 2) != 0), result);
+    for (int i = 0; i < WIDTH; ++i) if (!ok[i]) result[i] = cos(x[i]);
+    return result;
+}
+
+TARGET VD PUBLIC(pow)(VD x, VD y) {
+    VD zero = LOCAL(splat)(0);
+    VI ok = LOCAL(log_domain)(x)
+          & (VI)(y >= -POW_Y_MAX) & (VI)(y <= POW_Y_MAX);
+    VD base = LOCAL(select)(ok, x, LOCAL(splat)(1));
+    VD power = LOCAL(select)(ok, y, zero);
+
+    /* log(x) as a sum of two doubles, hi + lo, then y log(x) likewise,
+     * so that its rounding error isn't magnified by y.  That means
+     * working s out to twice the precision too: s = f / (2 + f) + s_lo. */
+    VD f, s, sR, err;
+    VD k = LOCAL(log_reduced)(base, &f, &s, &sR);
+    VD d_lo;
+    VD d = LOCAL(two_sum)(LOCAL(splat)(2), f, &d_lo);
+    VD sd = LOCAL(two_product)(s, d, &err);
+    VD s_lo = (((f - sd) - err) - s * d_lo) / d;
+    VD hi = LOCAL(two_sum)(k * LN2_HI, 2 * s, &err);
+    VD lo = err + (k * LN2_LO + (2 * s_lo + sR));
+    VD log_hi = hi + lo;
+    VD log_lo = lo - (log_hi - hi);
+    VD t_hi = LOCAL(two_product)(power, log_hi, &err);
+    VD t_lo = err + power * log_lo;
+
+    ok &= (VI)(t_hi >= -EXP_MAX) & (VI)(t_hi <= EXP_MAX);
+    VD result = LOCAL(exp_reduced)(LOCAL(select)(ok, t_hi, zero),
+                                   LOCAL(select)(ok, t_lo, zero));
+    for (int i = 0; i < WIDTH; ++i) {
+        if (!ok[i]) result[i] = pow(x[i], y[i]);
+    }
+    return result;
+}
+
+#undef VD
+#undef VI
+#undef LOCAL
+#undef PUBLIC